@@ -0,0 +1,100 @@
+#include "zcc.h"
+
+// Objects that live as long as a compilation phase (tokens, AST nodes,
+// types) are carved out of large zero-filled blocks instead of being
+// calloc'ed one by one. Objects of the same phase end up next to each
+// other in memory, and a whole phase can be released at once.
+
+#define ARENA_BLOCK_SIZE (1024 * 1024)
+
+struct ArenaBlock
+{
+    ArenaBlock *next;
+    size_t size;
+    char data[];
+};
+
+Arena token_arena = {"tokens"};
+Arena ast_arena = {"ast"};
+Arena type_arena = {"types"};
+Arena ir_arena = {"ir"};
+Arena asm_arena = {"asm"};
+
+static Arena *arenas[] = {&token_arena, &ast_arena, &type_arena, &ir_arena, &asm_arena};
+
+static ArenaBlock *new_block(Arena *arena, size_t size)
+{
+    ArenaBlock *blk = calloc(1, sizeof(ArenaBlock) + size);
+    if (!blk)
+    {
+        error("out of memory");
+    }
+    blk->size = size;
+    arena->reserved += size;
+    return blk;
+}
+
+// Returns a zero-filled memory region of `size` bytes.
+void *arena_alloc(Arena *arena, size_t size)
+{
+    size = align_to(size, 16);
+    arena->used += size;
+    arena->nallocs++;
+
+    if (arena->end - arena->ptr >= size)
+    {
+        void *p = arena->ptr;
+        arena->ptr += size;
+        return p;
+    }
+
+    // Huge objects get a block of their own so that they do not
+    // waste the rest of the current block.
+    if (size > ARENA_BLOCK_SIZE / 4)
+    {
+        ArenaBlock *blk = new_block(arena, size);
+        if (arena->blocks)
+        {
+            blk->next = arena->blocks->next;
+            arena->blocks->next = blk;
+        }
+        else
+        {
+            arena->blocks = blk;
+        }
+        return blk->data;
+    }
+
+    ArenaBlock *blk = new_block(arena, ARENA_BLOCK_SIZE);
+    blk->next = arena->blocks;
+    arena->blocks = blk;
+    arena->ptr = blk->data + size;
+    arena->end = blk->data + ARENA_BLOCK_SIZE;
+    return blk->data;
+}
+
+// Releases every object allocated from a given arena.
+void arena_free(Arena *arena)
+{
+    ArenaBlock *blk = arena->blocks;
+    while (blk)
+    {
+        ArenaBlock *next = blk->next;
+        free(blk);
+        blk = next;
+    }
+    arena->blocks = NULL;
+    arena->ptr = arena->end = NULL;
+    arena->used = arena->reserved = 0;
+    arena->nallocs = 0;
+}
+
+void arena_report(FILE *out)
+{
+    fprintf(out, "%-8s %12s %12s %10s\n", "arena", "used", "reserved", "allocs");
+    for (int i = 0; i < sizeof(arenas) / sizeof(*arenas); i++)
+    {
+        Arena *a = arenas[i];
+        fprintf(out, "%-8s %12zu %12zu %10zu\n", a->name, a->used, a->reserved, a->nallocs);
+    }
+}
@@ -0,0 +1,118 @@
+// Loop micro-benchmark.
+//
+// Runs array and struct loops compiled by zcc itself and reports the
+// best time of each kernel. Compare builds with and without -O1 to see
+// what the loop optimizations buy.
+//
+//   $ make bench
+//   ./bench/loops
+
+// Number of timed runs. The best one is reported.
+#define RUNS 5
+
+#define N 1000
+#define REPEAT 2000
+
+typedef struct
+{
+    long tv_sec;
+    long tv_nsec;
+} Timespec;
+
+int printf(char *fmt, ...);
+int clock_gettime(int clk, Timespec *ts);
+
+typedef struct
+{
+    int x;
+    int y;
+    long z;
+    double w;
+} Point;
+
+int ints[N];
+Point points[N];
+double mat_a[64][64];
+double mat_b[64][64];
+double mat_c[64][64];
+
+static double now(void)
+{
+    Timespec ts;
+    clock_gettime(1, &ts); // CLOCK_MONOTONIC
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long sum_ints(int *a, int n)
+{
+    long s = 0;
+    for (int r = 0; r < REPEAT; r++)
+        for (int i = 0; i < n; i++)
+            s += a[i];
+    return s;
+}
+
+static long sum_points(Point *p, int n, int k)
+{
+    long s = 0;
+    for (int r = 0; r < REPEAT; r++)
+        for (int i = 0; i < n; i++)
+            s += p[i].x * (k * 3 + 1) + p[i].y - p[i].z;
+    return s;
+}
+
+static double matmul(int n)
+{
+    for (int i = 0; i < n; i++)
+        for (int j = 0; j < n; j++)
+        {
+            double t = 0;
+            for (int k = 0; k < n; k++)
+                t += mat_a[i][k] * mat_b[k][j];
+            mat_c[i][j] = t;
+        }
+    return mat_c[n - 1][n - 1];
+}
+
+static double best_of(int kernel)
+{
+    double best = 0;
+    for (int i = 0; i < RUNS; i++)
+    {
+        double start = now();
+        if (kernel == 0)
+            sum_ints(ints, N);
+        else if (kernel == 1)
+            sum_points(points, N, 7);
+        else
+            for (int j = 0; j < 40; j++)
+                matmul(64);
+        double elapsed = now() - start;
+        if (best == 0 || elapsed < best)
+            best = elapsed;
+    }
+    return best;
+}
+
+int main(void)
+{
+    for (int i = 0; i < N; i++)
+    {
+        ints[i] = i * 7 % 13;
+        points[i].x = i;
+        points[i].y = i * 2;
+        points[i].z = i / 3;
+    }
+    for (int i = 0; i < 64; i++)
+        for (int j = 0; j < 64; j++)
+        {
+            mat_a[i][j] = i + j;
+            mat_b[i][j] = i - j;
+        }
+
+    printf("checksum:   %ld %ld %.0f\n", sum_ints(ints, N), sum_points(points, N, 7), matmul(64));
+    printf("sum_ints:   %.3f ms\n", best_of(0) * 1000);
+    printf("sum_points: %.3f ms\n", best_of(1) * 1000);
+    printf("matmul:     %.3f ms\n", best_of(2) * 1000);
+    return 0;
+}
@@ -0,0 +1,106 @@
+// Tokenizer micro-benchmark.
+//
+// Concatenates the given source files into one large input and
+// reports how many tokens per second `tokenize_file` produces.
+//
+//   $ make bench
+//   ./bench/tokenize test/*.c
+#include "../zcc.h"
+#include <time.h>
+#include <unistd.h>
+
+// Size of the synthesized input
+#define INPUT_SIZE (4 * 1024 * 1024)
+
+// Number of timed runs. The best one is reported.
+#define RUNS 5
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *read_all(char *path, size_t *len)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+    {
+        error("cannot open %s: %s", path, strerror(errno));
+    }
+
+    char *buf;
+    FILE *out = open_memstream(&buf, len);
+    for (;;)
+    {
+        char buf2[4096];
+        int n = fread(buf2, 1, sizeof(buf2), fp);
+        if (n == 0)
+        {
+            break;
+        }
+        fwrite(buf2, 1, n, out);
+    }
+    fclose(fp);
+    fclose(out);
+    return buf;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s <file>...\n", argv[0]);
+        return 1;
+    }
+
+    char path[] = "/tmp/zcc-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1)
+    {
+        error("mkstemp failed: %s", strerror(errno));
+    }
+    FILE *out = fdopen(fd, "w");
+
+    size_t total = 0;
+    while (total < INPUT_SIZE)
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            size_t len;
+            char *buf = read_all(argv[i], &len);
+            fwrite(buf, 1, len, out);
+            total += len;
+            free(buf);
+        }
+    }
+    fclose(out);
+
+    double best = 0;
+    long ntokens = 0;
+    for (int i = 0; i < RUNS; i++)
+    {
+        double start = now();
+        Token *tok = tokenize_file(path);
+        double elapsed = now() - start;
+
+        ntokens = 0;
+        for (; tok->kind != TK_EOF; tok = tok->next)
+        {
+            ntokens++;
+        }
+        if (best == 0 || elapsed < best)
+        {
+            best = elapsed;
+        }
+        arena_free(&token_arena);
+        arena_free(&type_arena);
+    }
+    unlink(path);
+
+    printf("input:  %zu bytes, %ld tokens\n", total, ntokens);
+    printf("best:   %.3f ms\n", best * 1000);
+    printf("tokens: %.2f M/s\n", ntokens / best / 1e6);
+    return 0;
+}
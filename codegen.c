@@ -1,55 +1,71 @@
 #include "zcc.h"
 
 static FILE *output_file;
-static int depth;
-static char *argreg8[] = {"%dil", "%sil", "%dl", "%cl", "%r8b", "%r9b"};
-static char *argreg16[] = {"%di", "%si", "%dx", "%cx", "%r8w", "%r9w"};
-static char *argreg32[] = {"%edi", "%esi", "%edx", "%ecx", "%r8d", "%r9d"};
-static char *argreg64[] = {"%rdi", "%rsi", "%rdx", "%rcx", "%r8", "%r9"};
 static Var *current_fn;
 
-static void gen_expr(Node *node);
-static void gen_stmt(Node *node);
+static char *reg64[] = {"%rax", "%rcx", "%rdx", "%rbx", "%rsp", "%rbp", "%rsi", "%rdi",
+                        "%r8", "%r9", "%r10", "%r11", "%r12", "%r13", "%r14", "%r15"};
+static char *reg32[] = {"%eax", "%ecx", "%edx", "%ebx", "%esp", "%ebp", "%esi", "%edi",
+                        "%r8d", "%r9d", "%r10d", "%r11d", "%r12d", "%r13d", "%r14d", "%r15d"};
+static char *reg16[] = {"%ax", "%cx", "%dx", "%bx", "%sp", "%bp", "%si", "%di",
+                        "%r8w", "%r9w", "%r10w", "%r11w", "%r12w", "%r13w", "%r14w", "%r15w"};
+static char *reg8[] = {"%al", "%cl", "%dl", "%bl", "%spl", "%bpl", "%sil", "%dil",
+                       "%r8b", "%r9b", "%r10b", "%r11b", "%r12b", "%r13b", "%r14b", "%r15b"};
+static int argreg[] = {REG_RDI, REG_RSI, REG_RDX, REG_RCX, REG_R8, REG_R9};
+
+// Scratch registers. They are never assigned to virtual registers.
+#define GP_TMP1 REG_R10
+#define GP_TMP2 REG_R11
+#define FP_TMP 15
+
+// Blocks up to this size are copied or cleared with unrolled moves
+// instead of `rep movsb` or `rep stosb`.
+#define INLINE_MEM_MAX 256
+
+// Bytes below %rsp that signal handlers leave alone (System V ABI)
+#define RED_ZONE_SIZE 128
+
+// Stack slots to save callee-saved registers to, or 0 if unused
+static int callee_saved_offset[16];
+
+// Register and displacement that stack slots are addressed with. A
+// slot at offset `off` from the frame base is at `off+frame_disp` from
+// `frame_reg`, which is %rbp unless the frame pointer is omitted.
+static char *frame_reg;
+static int frame_disp;
+
+// Set if the current function has no frame pointer. It then has
+// moved %rsp down by `frame_size` bytes on entry.
+static bool omit_fp;
+static int frame_size;
+
+static BB *next_bb;
+static int cur_line;
+
+// Jump tables of the current function, emitted after its code
+static IR *jump_tables[256];
+static int njump_tables;
+
+// Set while emitting the body of a function, whose lines go to the
+// peephole optimizer instead of the output file.
+static bool buffering;
 
 static void println(char *fmt, ...)
 {
     va_list ap;
     va_start(ap, fmt);
-    vfprintf(output_file, fmt, ap);
+    if (buffering)
+    {
+        char buf[1024];
+        vsnprintf(buf, sizeof(buf), fmt, ap);
+        peephole_push(buf);
+    }
+    else
+    {
+        vfprintf(output_file, fmt, ap);
+        fprintf(output_file, "\n");
+    }
     va_end(ap);
-    fprintf(output_file, "\n");
-}
-
-static int count(void)
-{
-    static int i = 1;
-    return i++;
-}
-
-static void push(void)
-{
-    println("  push %%rax");
-    depth++;
-}
-
-static void pop(char *arg)
-{
-    println("  pop %s", arg);
-    depth--;
-}
-
-static void pushf(void)
-{
-    println("  sub $8, %%rsp");
-    println("  movsd %%xmm0, (%%rsp)");
-    depth++;
-}
-
-static void popf(int reg)
-{
-    println("  movsd (%%rsp), %%xmm%d", reg);
-    println("  add $8, %%rsp");
-    depth--;
 }
 
 // Round up `n` to the nearest multiple of `align`
@@ -60,118 +76,6 @@ int align_to(int n, int align)
     return (n + align - 1) / align * align;
 }
 
-// Compute the absolute address of a given node.
-// It's an error if a given node does not reside in memory.
-static void gen_addr(Node *node)
-{
-    switch (node->kind)
-    {
-    case ND_VAR:
-        if (node->var->is_local)
-        {
-            // Local variable
-            println("  lea %d(%%rbp), %%rax", node->var->offset);
-        }
-        else
-        {
-            // Global variable
-            println("  lea %s(%%rip), %%rax", node->var->name);
-        }
-        return;
-    case ND_DEREF:
-        gen_expr(node->lhs);
-        return;
-    case ND_COMMA:
-        gen_expr(node->lhs);
-        gen_addr(node->rhs);
-        return;
-    case ND_MEMBER:
-        gen_addr(node->lhs);
-        println("  add $%d, %%rax", node->member->offset);
-        return;
-    }
-
-    error_tok(node->tok, "not an lvalue");
-}
-
-// Load a value from where %rax is pointing to.
-static void load(Type *ty)
-{
-    switch (ty->kind)
-    {
-    case TY_ARRAY:
-    case TY_STRUCT:
-    case TY_UNION:
-        return;
-    case TY_FLOAT:
-        println("  movss (%%rax), %%xmm0");
-        return;
-    case TY_DOUBLE:
-        println("  movsd (%%rax), %%xmm0");
-        return;
-    }
-
-    char *insn = ty->is_unsigned ? "movz" : "movs";
-
-    if (ty->size == 1)
-    {
-        println("  %sbl (%%rax), %%eax", insn);
-    }
-    else if (ty->size == 2)
-    {
-        println("  %swl (%%rax), %%eax", insn);
-    }
-    else if (ty->size == 4)
-    {
-        println("  movsxd (%%rax), %%rax");
-    }
-    else
-    {
-        println("  mov (%%rax), %%rax");
-    }
-}
-
-// Store %rax to an address that the stack top is pointing to.
-static void store(Type *ty)
-{
-    pop("%rdi");
-
-    switch (ty->kind)
-    {
-    case TY_STRUCT:
-    case TY_UNION:
-        for (int i = 0; i < ty->size; i++)
-        {
-            println("  mov %d(%%rax), %%r8b", i);
-            println("  mov %%r8b, %d(%%rdi)", i);
-        }
-        return;
-    case TY_FLOAT:
-        println("  movss %%xmm0, (%%rdi)");
-        return;
-    case TY_DOUBLE:
-        println("  movsd %%xmm0, (%%rdi)");
-        return;
-    }
-
-    if (ty->size == 1)
-    {
-        println("  mov %%al, (%%rdi)");
-    }
-    else if (ty->size == 2)
-    {
-        println("  mov %%ax, (%%rdi)");
-    }
-    else if (ty->size == 4)
-    {
-        println("  mov %%eax, (%%rdi)");
-    }
-    else
-    {
-        println("  mov %%rax, (%%rdi)");
-    }
-}
-
 static void cmp_zero(Type *ty)
 {
     switch (ty->kind)
@@ -249,8 +153,8 @@ static char i64f64[] = "cvtsi2sdq %rax, %xmm0";
 static char u64f32[] = "cvtsi2ssq %rax, %xmm0";
 static char u64f64[] =
     "test %rax,%rax; js 1f; pxor %xmm0,%xmm0; cvtsi2sd %rax,%xmm0; jmp 2f; "
-    "1: mov %rax,%rdi; and $1,%eax; pxor %xmm0,%xmm0; shr %rdi; "
-    "or %rax,%rdi; cvtsi2sd %rdi,%xmm0; addsd %xmm0,%xmm0; 2:";
+    "1: mov %rax,%r10; and $1,%eax; pxor %xmm0,%xmm0; shr %r10; "
+    "or %rax,%r10; cvtsi2sd %r10,%xmm0; addsd %xmm0,%xmm0; 2:";
 
 static char f32i8[] = "cvttss2sil %xmm0, %eax; movsbl %al, %eax";
 static char f32u8[] = "cvttss2sil %xmm0, %eax; movzbl %al, %eax";
@@ -308,570 +212,1648 @@ static void cast(Type *from, Type *to)
     }
 }
 
-static void push_args(Node *args)
+static void emit_data(Var *prog)
 {
-    if (args)
+    for (Var *var = prog; var; var = var->next)
     {
-        push_args(args->next);
+        if (var->is_function || !var->is_definition)
+        {
+            continue;
+        }
 
-        gen_expr(args);
-        if (is_flonum(args->ty))
+        if (var->is_static)
         {
-            pushf();
+            println("  .local %s", var->name);
         }
         else
         {
-            push();
+            println("  .globl %s", var->name);
+        }
+        println("  .align %d", var->align);
+
+        if (var->init_data)
+        {
+            println("  .data");
+            println("%s:", var->name);
+
+            Relocation *rel = var->rel;
+            int pos = 0;
+            while (pos < var->ty->size)
+            {
+                if (rel && rel->offset == pos)
+                {
+                    println("  .quad %s%+ld", rel->label, rel->addend);
+                    rel = rel->next;
+                    pos += 8;
+                }
+                else
+                {
+                    println("  .byte %d", var->init_data[pos++]);
+                }
+            }
+            continue;
         }
+        println("  .bss");
+        println("%s:", var->name);
+        println("  .zero %d", var->ty->size);
     }
 }
 
-// Generate code for a given node.
-static void gen_expr(Node *node)
+static char *gpreg(int rn, int sz)
 {
-    println("  .loc 1 %d", node->tok->line_no);
-    switch (node->kind)
-    {
-    case ND_NULL_EXPR:
-        return;
-    case ND_NUM:
+    switch (sz)
     {
-        union
-        {
-            float f32;
-            double f64;
-            uint32_t u32;
-            uint64_t u64;
-        } u;
+    case 1:
+        return reg8[rn];
+    case 2:
+        return reg16[rn];
+    case 4:
+        return reg32[rn];
+    }
+    return reg64[rn];
+}
 
-        switch (node->ty->kind)
-        {
-        case TY_FLOAT:
-            u.f32 = node->fval;
-            println("  mov $%u, %%eax  # float %f", u.u32, node->fval);
-            println("  movq %%rax, %%xmm0");
-            return;
-        case TY_DOUBLE:
-            u.f64 = node->fval;
-            println("  mov $%lu, %%rax  # double %f", u.u64, node->fval);
-            println("  movq %%rax, %%xmm0");
-            return;
-        }
+static int op_size(Type *ty)
+{
+    return (ty->kind == TY_LONG || ty->base) ? 8 : 4;
+}
 
-        println("  mov $%ld, %%rax", node->val);
-        return;
+static bool in_reg(Reg *r)
+{
+    return r->rn != -1;
+}
+
+static char *frame_slot(int offset)
+{
+    return format("%d(%s)", offset + frame_disp, frame_reg);
+}
+
+// Returns the assembly operand for a virtual register.
+static char *opd(Reg *r, int sz)
+{
+    if (!in_reg(r))
+    {
+        return frame_slot(r->offset);
     }
-    case ND_NEG:
-        gen_expr(node->lhs);
-        println("  neg %%rax");
-        return;
-    case ND_VAR:
-    case ND_MEMBER:
-        gen_addr(node);
-        load(node->ty);
-        return;
-    case ND_DEREF:
-        gen_expr(node->lhs);
-        load(node->ty);
-        return;
-    case ND_ADDR:
-        gen_addr(node->lhs);
-        return;
-    case ND_ASSIGN:
-        gen_addr(node->lhs);
-        push();
-        gen_expr(node->rhs);
-        store(node->ty);
-        return;
-    case ND_STMT_EXPR:
-        for (Node *n = node->body; n; n = n->next)
-        {
-            gen_stmt(n);
-        }
-        return;
-    case ND_COMMA:
-        gen_expr(node->lhs);
-        gen_expr(node->rhs);
-        return;
-    case ND_CAST:
-        gen_expr(node->lhs);
-        cast(node->lhs->ty, node->ty);
-        return;
-    case ND_MEMZERO:
-        // `rep stosb` is equivalent to `memset(%rdi, %al, %rcx)`.
-        println("  mov $%d, %%rcx", node->var->ty->size);
-        println("  lea %d(%%rbp), %%rdi", node->var->offset);
-        println("  mov $0, %%al");
-        println("  rep stosb");
-        return;
-    case ND_COND:
+    if (r->is_fp)
     {
-        int c = count();
-        gen_expr(node->cond);
-        cmp_zero(node->cond->ty);
-        println("  je .L.else.%d", c);
-        gen_expr(node->then);
-        println("  jmp .L.end.%d", c);
-        println(".L.else.%d:", c);
-        gen_expr(node->els);
-        println(".L.end.%d:", c);
-        return;
+        return format("%%xmm%d", r->rn);
     }
-    case ND_NOT:
-        gen_expr(node->lhs);
-        cmp_zero(node->lhs->ty);
-        println("  sete %%al");
-        println("  movzx %%al, %%rax");
-        return;
-    case ND_BITNOT:
-        gen_expr(node->lhs);
-        println("  not %%rax");
-        return;
-    case ND_LOGAND:
+    return gpreg(r->rn, sz);
+}
+
+// Returns the assembly operand for the second operand of a binary
+// operator.
+static char *opd_b(IR *ir, int sz)
+{
+    if (ir->b)
     {
-        int c = count();
-        gen_expr(node->lhs);
-        cmp_zero(node->lhs->ty);
-        println("  je .L.false.%d", c);
-        gen_expr(node->rhs);
-        cmp_zero(node->rhs->ty);
-        println("  je .L.false.%d", c);
-        println("  mov $1, %%rax");
-        println("  jmp .L.end.%d", c);
-        println(".L.false.%d:", c);
-        println("  mov $0, %%rax");
-        println(".L.end.%d:", c);
-        return;
+        return opd(ir->b, sz);
     }
-    case ND_LOGOR:
+    if (ir->var)
     {
-        int c = count();
-        gen_expr(node->lhs);
-        cmp_zero(node->lhs->ty);
-        println("  jne .L.true.%d", c);
-        gen_expr(node->rhs);
-        cmp_zero(node->rhs->ty);
-        println("  jne .L.true.%d", c);
-        println("  mov $0, %%rax");
-        println("  jmp .L.end.%d", c);
-        println(".L.true.%d:", c);
-        println("  mov $1, %%rax");
-        println(".L.end.%d:", c);
-        return;
+        return frame_slot(ir->var->offset + ir->imm);
     }
-    case ND_FUNCALL:
+    return format("$%ld", ir->imm);
+}
+
+// Returns the register to compute the value of `d` in.
+static int gp_dest(Reg *d)
+{
+    return in_reg(d) ? d->rn : GP_TMP2;
+}
+
+static int fp_dest(Reg *d)
+{
+    return in_reg(d) ? d->rn : FP_TMP;
+}
+
+// Copies a virtual register to a real register.
+static void gp_get(Reg *r, int rn)
+{
+    if (r->rn != rn)
     {
-        push_args(node->args);
-
-        int gp = 0, fp = 0;
-        for (Node *arg = node->args; arg; arg = arg->next)
-        {
-            if (is_flonum(arg->ty))
-            {
-                popf(fp++);
-            }
-            else
-            {
-                pop(argreg64[gp++]);
-            }
-        }
+        println("  mov %s, %s", opd(r, 8), reg64[rn]);
+    }
+}
 
-        if (depth % 2 == 0)
-        {
-            println("  call %s", node->funcname);
-        }
-        else
+static void fp_get(Reg *r, int xn)
+{
+    if (r->rn != xn)
+    {
+        println("  movsd %s, %%xmm%d", opd(r, 8), xn);
+    }
+}
+
+// Copies a real register to a virtual register.
+static void gp_set(Reg *d, int rn)
+{
+    if (d->rn != rn)
+    {
+        println("  mov %s, %s", reg64[rn], opd(d, 8));
+    }
+}
+
+static void fp_set(Reg *d, int xn)
+{
+    if (d->rn != xn)
+    {
+        println("  movsd %%xmm%d, %s", xn, opd(d, 8));
+    }
+}
+
+// Returns a register holding a given address.
+static char *addr_reg(Reg *r)
+{
+    gp_get(r, in_reg(r) ? r->rn : GP_TMP1);
+    return reg64[in_reg(r) ? r->rn : GP_TMP1];
+}
+
+typedef struct
+{
+    int src;   // Source register, or -1 if `mem` is the source
+    int dst;   // Destination register, or -1 if `mem` is the destination
+    char *mem; // Memory operand
+} Move;
+
+// Performs register-to-register moves as if they happened at the same
+// time. A cycle is broken by moving one of its values to a scratch
+// register.
+static void parallel_move(Move *moves, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        if (moves[i].dst == -1)
         {
-            println("  sub $8, %%rsp");
-            println("  call %s", node->funcname);
-            println("  add $8, %%rsp");
+            println("  mov %s, %s", reg64[moves[i].src], moves[i].mem);
+            moves[i].src = moves[i].dst;
         }
+    }
 
-        switch (node->ty->kind)
+    for (;;)
+    {
+        bool pending = false;
+        bool progress = false;
+
+        for (int i = 0; i < n; i++)
         {
-        case TY_BOOL:
-            println("  movzx %%al, %%eax");
-            return;
-        case TY_CHAR:
-            if (node->ty->is_unsigned)
+            Move *m = &moves[i];
+            if (m->src == m->dst)
             {
-                println("  movzbl %%al, %%eax");
+                continue;
             }
-            else
+            pending = true;
+
+            bool blocked = false;
+            for (int j = 0; j < n; j++)
             {
-                println("  movsbl %%al, %%eax");
+                if (j != i && moves[j].src != moves[j].dst && moves[j].src == m->dst)
+                {
+                    blocked = true;
+                    break;
+                }
             }
-            return;
-        case TY_SHORT:
-            if (node->ty->is_unsigned)
+            if (blocked)
             {
-                println("  movzwl %%ax, %%eax");
+                continue;
+            }
+
+            if (m->src == -1)
+            {
+                println("  mov %s, %s", m->mem, reg64[m->dst]);
             }
             else
             {
-                println("  movswl %%ax, %%eax");
+                println("  mov %s, %s", reg64[m->src], reg64[m->dst]);
             }
-            return;
+            m->src = m->dst;
+            progress = true;
         }
 
-        return;
-    }
-    }
-
-    if (is_flonum(node->lhs->ty))
-    {
-        gen_expr(node->rhs);
-        pushf();
-        gen_expr(node->lhs);
-        popf(1);
-
-        char *sz = (node->lhs->ty->kind == TY_FLOAT) ? "ss" : "sd";
-
-        switch (node->kind)
+        if (!pending)
         {
-        case ND_ADD:
-            println("  add%s %%xmm1, %%xmm0", sz);
-            return;
-        case ND_SUB:
-            println("  sub%s %%xmm1, %%xmm0", sz);
             return;
-        case ND_MUL:
-            println("  mul%s %%xmm1, %%xmm0", sz);
-            return;
-        case ND_DIV:
-            println("  div%s %%xmm1, %%xmm0", sz);
-            return;
-        case ND_EQ:
-        case ND_NE:
-        case ND_LT:
-        case ND_LE:
-            println("  ucomi%s %%xmm0, %%xmm1", sz);
+        }
 
-            if (node->kind == ND_EQ)
-            {
-                println("  sete %%al");
-                println("  setnp %%dl");
-                println("  and %%dl, %%al");
-            }
-            else if (node->kind == ND_NE)
-            {
-                println("  setne %%al");
-                println("  setp %%dl");
-                println("  or %%dl, %%al");
-            }
-            else if (node->kind == ND_LT)
+        if (!progress)
+        {
+            // Every pending move is part of a cycle.
+            int rn = -1;
+            for (int i = 0; i < n; i++)
             {
-                println("  seta %%al");
+                if (moves[i].src != moves[i].dst)
+                {
+                    rn = moves[i].src;
+                    break;
+                }
             }
-            else
+            println("  mov %s, %s", reg64[rn], reg64[GP_TMP2]);
+            for (int i = 0; i < n; i++)
             {
-                println("  setae %%al");
+                if (moves[i].src == rn && moves[i].src != moves[i].dst)
+                {
+                    moves[i].src = GP_TMP2;
+                }
             }
-
-            println("  and $1, %%al");
-            println("  movzb %%al, %%rax");
-            return;
         }
-
-        error_tok(node->tok, "invalid expression");
     }
+}
 
-    gen_expr(node->rhs);
-    push();
-    gen_expr(node->lhs);
-    pop("%rdi");
-
-    char *ax, *di, *dx;
+static void gen_gp_binary(IR *ir, char *insn, bool commutative)
+{
+    int sz = op_size(ir->ty);
+    int w = gp_dest(ir->d);
+    Reg *a = ir->a;
+    char *src = opd_b(ir, sz);
 
-    if (node->lhs->ty->kind == TY_LONG || node->lhs->ty->base)
+    if (ir->b && ir->b->rn == w && a->rn != w)
     {
-        ax = "%rax";
-        di = "%rdi";
-        dx = "%rdx";
-    }
+        if (commutative)
+        {
+            src = opd(a, sz);
+            a = ir->b;
+        }
+        else
+        {
+            w = GP_TMP2;
+        }
+    }
+
+    gp_get(a, w);
+    println("  %s %s, %s", insn, src, gpreg(w, sz));
+    gp_set(ir->d, w);
+}
+
+static void gen_fp_binary(IR *ir, char *insn, bool commutative)
+{
+    char *sz = (ir->ty->kind == TY_FLOAT) ? "ss" : "sd";
+    int w = fp_dest(ir->d);
+    Reg *a = ir->a;
+    char *src = opd_b(ir, 8);
+
+    if (ir->b && ir->b->rn == w && a->rn != w)
+    {
+        if (commutative)
+        {
+            src = opd(a, 8);
+            a = ir->b;
+        }
+        else
+        {
+            w = FP_TMP;
+        }
+    }
+
+    fp_get(a, w);
+    println("  %s%s %s, %%xmm%d", insn, sz, src, w);
+    fp_set(ir->d, w);
+}
+
+static void gen_div(IR *ir)
+{
+    int sz = op_size(ir->ty);
+    char *suffix = (sz == 8) ? "q" : "l";
+
+    gp_get(ir->a, REG_RAX);
+    if (ir->ty->is_unsigned)
+    {
+        println("  mov $0, %%edx");
+        println("  div%s %s", suffix, opd_b(ir, sz));
+    }
+    else
+    {
+        println((sz == 8) ? "  cqo" : "  cdq");
+        println("  idiv%s %s", suffix, opd_b(ir, sz));
+    }
+    gp_set(ir->d, (ir->op == IR_MOD) ? REG_RDX : REG_RAX);
+}
+
+static void gen_mulh(IR *ir)
+{
+    int sz = op_size(ir->ty);
+    gp_get(ir->a, REG_RAX);
+    println("  %s%s %s", ir->ty->is_unsigned ? "mul" : "imul", (sz == 8) ? "q" : "l", opd(ir->b, sz));
+    gp_set(ir->d, REG_RDX);
+}
+
+static void gen_shift(IR *ir)
+{
+    int sz = op_size(ir->ty);
+    int w = gp_dest(ir->d);
+    char *insn = "shl";
+    if (ir->op == IR_SHR)
+    {
+        insn = ir->ty->is_unsigned ? "shr" : "sar";
+    }
+
+    if (!ir->b)
+    {
+        gp_get(ir->a, w);
+        println("  %s $%ld, %s", insn, ir->imm, gpreg(w, sz));
+        gp_set(ir->d, w);
+        return;
+    }
+
+    gp_get(ir->b, REG_RCX);
+    gp_get(ir->a, w);
+    println("  %s %%cl, %s", insn, gpreg(w, sz));
+    gp_set(ir->d, w);
+}
+
+static void gen_cmp(IR *ir)
+{
+    int w = gp_dest(ir->d);
+
+    if (is_flonum(ir->ty))
+    {
+        // ucomis compares its second operand to its first one.
+        char *sz = (ir->ty->kind == TY_FLOAT) ? "ss" : "sd";
+        int xn = in_reg(ir->b) ? ir->b->rn : FP_TMP;
+        fp_get(ir->b, xn);
+        println("  ucomi%s %s, %%xmm%d", sz, opd(ir->a, 8), xn);
+
+        switch (ir->op)
+        {
+        case IR_EQ:
+            println("  sete %s", reg8[w]);
+            println("  setnp %%dl");
+            println("  and %%dl, %s", reg8[w]);
+            break;
+        case IR_NE:
+            println("  setne %s", reg8[w]);
+            println("  setp %%dl");
+            println("  or %%dl, %s", reg8[w]);
+            break;
+        case IR_LT:
+            println("  seta %s", reg8[w]);
+            break;
+        case IR_LE:
+            println("  setae %s", reg8[w]);
+            break;
+        }
+    }
+    else
+    {
+        int sz = op_size(ir->ty);
+        int rn = in_reg(ir->a) ? ir->a->rn : GP_TMP1;
+        gp_get(ir->a, rn);
+        println("  cmp %s, %s", opd_b(ir, sz), gpreg(rn, sz));
+
+        char *cc;
+        switch (ir->op)
+        {
+        case IR_EQ:
+            cc = "e";
+            break;
+        case IR_NE:
+            cc = "ne";
+            break;
+        case IR_LT:
+            cc = ir->ty->is_unsigned ? "b" : "l";
+            break;
+        case IR_LE:
+            cc = ir->ty->is_unsigned ? "be" : "le";
+            break;
+        }
+        println("  set%s %s", cc, reg8[w]);
+    }
+
+    println("  movzbl %s, %s", reg8[w], reg32[w]);
+    gp_set(ir->d, w);
+}
+
+// Returns the memory operand of IR_LEA, IR_LOAD or IR_STORE.
+static char *mem_opd(IR *ir)
+{
+    if (ir->var && !ir->var->is_local)
+    {
+        if (ir->imm)
+        {
+            return format("%s%+ld(%%rip)", ir->var->name, ir->imm);
+        }
+        return format("%s(%%rip)", ir->var->name);
+    }
+
+    char *base = ir->var ? frame_reg : addr_reg(ir->a);
+    int64_t disp = ir->imm + (ir->var ? ir->var->offset + frame_disp : 0);
+    char *s = disp ? format("%ld(%s", disp, base) : format("(%s", base);
+
+    if (ir->index)
+    {
+        // %rax is free at a memory access.
+        gp_get(ir->index, in_reg(ir->index) ? ir->index->rn : REG_RAX);
+        char *index = reg64[in_reg(ir->index) ? ir->index->rn : REG_RAX];
+        s = format("%s,%s,%d", s, index, ir->scale);
+    }
+    return format("%s)", s);
+}
+
+static void gen_load(IR *ir)
+{
+    Type *ty = ir->ty;
+    char *addr = mem_opd(ir);
+
+    if (is_flonum(ty))
+    {
+        int xn = fp_dest(ir->d);
+        println("  mov%s %s, %%xmm%d", (ty->kind == TY_FLOAT) ? "ss" : "sd", addr, xn);
+        fp_set(ir->d, xn);
+        return;
+    }
+
+    int w = gp_dest(ir->d);
+    char *insn = ty->is_unsigned ? "movz" : "movs";
+
+    if (ty->size == 1)
+    {
+        println("  %sbl %s, %s", insn, addr, reg32[w]);
+    }
+    else if (ty->size == 2)
+    {
+        println("  %swl %s, %s", insn, addr, reg32[w]);
+    }
+    else if (ty->size == 4)
+    {
+        println("  movsxd %s, %s", addr, reg64[w]);
+    }
+    else
+    {
+        println("  mov %s, %s", addr, reg64[w]);
+    }
+    gp_set(ir->d, w);
+}
+
+static void gen_store(IR *ir)
+{
+    Type *ty = ir->ty;
+    char *addr = mem_opd(ir);
+    Reg *val = ir->b;
+
+    if (is_flonum(ty))
+    {
+        int xn = in_reg(val) ? val->rn : FP_TMP;
+        fp_get(val, xn);
+        println("  mov%s %%xmm%d, %s", (ty->kind == TY_FLOAT) ? "ss" : "sd", xn, addr);
+        return;
+    }
+
+    int rn = in_reg(val) ? val->rn : GP_TMP2;
+    gp_get(val, rn);
+    println("  mov %s, %s", gpreg(rn, ty->size), addr);
+}
+
+// Clears `n` bytes at `disp(base)` with the widest stores that fit.
+static void gen_memzero_inline(char *base, int disp, int n)
+{
+    int i = 0;
+    if (n >= 16)
+    {
+        println("  xorps %%xmm%d, %%xmm%d", FP_TMP, FP_TMP);
+        for (; i + 16 <= n; i += 16)
+        {
+            println("  movdqu %%xmm%d, %d(%s)", FP_TMP, disp + i, base);
+        }
+    }
+    for (; i + 8 <= n; i += 8)
+    {
+        println("  movq $0, %d(%s)", disp + i, base);
+    }
+    for (; i + 4 <= n; i += 4)
+    {
+        println("  movl $0, %d(%s)", disp + i, base);
+    }
+    for (; i + 2 <= n; i += 2)
+    {
+        println("  movw $0, %d(%s)", disp + i, base);
+    }
+    for (; i < n; i++)
+    {
+        println("  movb $0, %d(%s)", disp + i, base);
+    }
+}
+
+static void gen_memzero(IR *ir)
+{
+    if (ir->imm <= INLINE_MEM_MAX)
+    {
+        if (ir->var)
+        {
+            gen_memzero_inline(frame_reg, ir->var->offset + frame_disp, ir->imm);
+        }
+        else
+        {
+            gen_memzero_inline(addr_reg(ir->a), 0, ir->imm);
+        }
+        return;
+    }
+
+    // `rep stosb` is equivalent to `memset(%rdi, %al, %rcx)`.
+    println("  mov %%rdi, %s", reg64[GP_TMP2]);
+    if (ir->var)
+    {
+        println("  lea %s, %%rdi", frame_slot(ir->var->offset));
+    }
+    else
+    {
+        gp_get(ir->a, REG_RDI);
+    }
+    println("  mov $%ld, %%rcx", ir->imm);
+    println("  xor %%eax, %%eax");
+    println("  rep stosb");
+    println("  mov %s, %%rdi", reg64[GP_TMP2]);
+}
+
+static void gen_memcpy(IR *ir)
+{
+    int n = ir->imm;
+
+    if (n <= INLINE_MEM_MAX)
+    {
+        char *dst = addr_reg(ir->a);
+        int src = in_reg(ir->b) ? ir->b->rn : GP_TMP2;
+        gp_get(ir->b, src);
+
+        int i = 0;
+        for (; i + 16 <= n; i += 16)
+        {
+            println("  movdqu %d(%s), %%xmm%d", i, reg64[src], FP_TMP);
+            println("  movdqu %%xmm%d, %d(%s)", FP_TMP, i, dst);
+        }
+        for (int sz = 8; sz > 0; sz /= 2)
+        {
+            for (; i + sz <= n; i += sz)
+            {
+                println("  mov %d(%s), %s", i, reg64[src], gpreg(REG_RAX, sz));
+                println("  mov %s, %d(%s)", gpreg(REG_RAX, sz), i, dst);
+            }
+        }
+        return;
+    }
+
+    // `rep movsb` is equivalent to `memcpy(%rdi, %rsi, %rcx)`. Save
+    // %rdi and %rsi first and read operands living there from the
+    // saved copies.
+    println("  mov %%rdi, %s", reg64[GP_TMP1]);
+    println("  mov %%rsi, %s", reg64[GP_TMP2]);
+
+    Reg *ops[] = {ir->a, ir->b};
+    char *dst[] = {"%rdi", "%rsi"};
+    for (int i = 0; i < 2; i++)
+    {
+        char *src = opd(ops[i], 8);
+        if (ops[i]->rn == REG_RDI)
+        {
+            src = reg64[GP_TMP1];
+        }
+        else if (ops[i]->rn == REG_RSI)
+        {
+            src = reg64[GP_TMP2];
+        }
+        println("  mov %s, %s", src, dst[i]);
+    }
+    println("  mov $%d, %%ecx", n);
+    println("  rep movsb");
+    println("  mov %s, %%rdi", reg64[GP_TMP1]);
+    println("  mov %s, %%rsi", reg64[GP_TMP2]);
+}
+
+static void gen_cast(IR *ir)
+{
+    if (is_flonum(ir->from))
+    {
+        fp_get(ir->a, 0);
+    }
+    else
+    {
+        gp_get(ir->a, REG_RAX);
+    }
+
+    cast(ir->from, ir->ty);
+
+    if (is_flonum(ir->ty))
+    {
+        fp_set(ir->d, 0);
+    }
+    else
+    {
+        gp_set(ir->d, REG_RAX);
+    }
+}
+
+// Pushes the arguments of a call that do not fit in registers, from
+// right to left, and returns the number of bytes pushed. The stack is
+// padded so that it stays 16-byte aligned at the call.
+static int push_args(IR *ir)
+{
+    int gp = 0, fp = 0;
+    for (int i = 0; i < ir->nargs; i++)
+    {
+        if (ir->args[i]->is_fp)
+        {
+            fp++;
+        }
+        else
+        {
+            gp++;
+        }
+    }
+
+    int n = MAX(gp - 6, 0) + MAX(fp - 8, 0);
+    if (n % 2)
+    {
+        println("  sub $8, %%rsp");
+        n++;
+    }
+
+    for (int i = ir->nargs - 1; i >= 0; i--)
+    {
+        Reg *arg = ir->args[i];
+        if (arg->is_fp ? --fp < 8 : --gp < 6)
+        {
+            continue;
+        }
+        if (arg->is_fp && in_reg(arg))
+        {
+            println("  sub $8, %%rsp");
+            println("  movsd %s, (%%rsp)", opd(arg, 8));
+        }
+        else
+        {
+            println("  pushq %s", opd(arg, 8));
+        }
+    }
+    return n * 8;
+}
+
+// Moves the arguments of a call to argument registers. Returns the
+// number of floating-point ones.
+static int pass_args(IR *ir)
+{
+    Move moves[6];
+    int gp = 0, fp = 0;
+
+    for (int i = 0; i < ir->nargs; i++)
+    {
+        Reg *arg = ir->args[i];
+        if (arg->is_fp)
+        {
+            if (fp < 8)
+            {
+                println("  movsd %s, %%xmm%d", opd(arg, 8), fp);
+            }
+            fp++;
+            continue;
+        }
+
+        if (gp < 6)
+        {
+            Move *m = &moves[gp];
+            m->src = arg->rn;
+            m->dst = argreg[gp];
+            m->mem = in_reg(arg) ? NULL : opd(arg, 8);
+        }
+        gp++;
+    }
+    parallel_move(moves, MIN(gp, 6));
+    return MIN(fp, 8);
+}
+
+static void gen_call(IR *ir)
+{
+    int stack_size = push_args(ir);
+    println("  mov $%d, %%eax", pass_args(ir));
+    println("  call %s", ir->funcname);
+    if (stack_size)
+    {
+        println("  add $%d, %%rsp", stack_size);
+    }
+
+    if (!ir->d)
+    {
+        return;
+    }
+
+    switch (ir->ty->kind)
+    {
+    case TY_BOOL:
+        println("  movzx %%al, %%eax");
+        break;
+    case TY_CHAR:
+        println(ir->ty->is_unsigned ? "  movzbl %%al, %%eax" : "  movsbl %%al, %%eax");
+        break;
+    case TY_SHORT:
+        println(ir->ty->is_unsigned ? "  movzwl %%ax, %%eax" : "  movswl %%ax, %%eax");
+        break;
+    }
+
+    if (ir->d->is_fp)
+    {
+        fp_set(ir->d, 0);
+    }
+    else
+    {
+        gp_set(ir->d, REG_RAX);
+    }
+}
+
+// Returns the inverse of a condition code.
+static char *invert_cc(char *cc)
+{
+    static char *table[][2] = {
+        {"e", "ne"}, {"l", "ge"}, {"le", "g"}, {"b", "ae"}, {"be", "a"},
+    };
+    for (int i = 0; i < sizeof(table) / sizeof(*table); i++)
+    {
+        if (!strcmp(cc, table[i][0]))
+        {
+            return table[i][1];
+        }
+        if (!strcmp(cc, table[i][1]))
+        {
+            return table[i][0];
+        }
+    }
+    unreachable();
+}
+
+// Jumps to bb1 if a condition code holds and to bb2 otherwise,
+// falling through to whichever block comes next.
+static void gen_jcc(char *cc, BB *bb1, BB *bb2)
+{
+    if (bb2 == next_bb)
+    {
+        println("  j%s .L.bb%d", cc, bb1->label);
+    }
+    else if (bb1 == next_bb)
+    {
+        println("  j%s .L.bb%d", invert_cc(cc), bb2->label);
+    }
+    else
+    {
+        println("  j%s .L.bb%d", cc, bb1->label);
+        println("  jmp .L.bb%d", bb2->label);
+    }
+}
+
+// Compares the operands of IR_CBR or IR_SELECT and returns the
+// condition code that is true if `a cmp b` holds. Returns NULL for a
+// floating-point equality, which needs the parity flag as well.
+static char *gen_compare(IR *ir)
+{
+    if (is_flonum(ir->ty))
+    {
+        // ucomis compares its second operand to its first one. An
+        // unordered result sets ZF, PF and CF, so `a` and `ae` are
+        // false for NaNs while `e` needs an extra check of PF.
+        char *sz = (ir->ty->kind == TY_FLOAT) ? "ss" : "sd";
+        int xn = in_reg(ir->b) ? ir->b->rn : FP_TMP;
+        fp_get(ir->b, xn);
+        println("  ucomi%s %s, %%xmm%d", sz, opd(ir->a, 8), xn);
+
+        switch (ir->cmp)
+        {
+        case IR_LT:
+            return "a";
+        case IR_LE:
+            return "ae";
+        }
+        return NULL;
+    }
+
+    int sz = op_size(ir->ty);
+    int rn = in_reg(ir->a) ? ir->a->rn : GP_TMP1;
+    gp_get(ir->a, rn);
+    println("  cmp %s, %s", opd_b(ir, sz), gpreg(rn, sz));
+
+    switch (ir->cmp)
+    {
+    case IR_EQ:
+        return "e";
+    case IR_NE:
+        return "ne";
+    case IR_LT:
+        return ir->ty->is_unsigned ? "b" : "l";
+    case IR_LE:
+        return ir->ty->is_unsigned ? "be" : "le";
+    }
+    unreachable();
+}
+
+static void gen_cbr(IR *ir)
+{
+    char *cc = gen_compare(ir);
+    if (cc)
+    {
+        gen_jcc(cc, ir->bb1, ir->bb2);
+        return;
+    }
+
+    if (ir->cmp == IR_EQ)
+    {
+        println("  jne .L.bb%d", ir->bb2->label);
+        println("  jp .L.bb%d", ir->bb2->label);
+        if (ir->bb1 != next_bb)
+        {
+            println("  jmp .L.bb%d", ir->bb1->label);
+        }
+        return;
+    }
+
+    println("  jne .L.bb%d", ir->bb1->label);
+    println("  jp .L.bb%d", ir->bb1->label);
+    if (ir->bb2 != next_bb)
+    {
+        println("  jmp .L.bb%d", ir->bb2->label);
+    }
+}
+
+// Integers are chosen with cmov. Floating-point values are chosen by
+// minss or maxss if that is what the select computes, and otherwise
+// blended with the mask that cmpss leaves.
+static void gen_select(IR *ir)
+{
+    Reg *x = ir->args[0];
+    Reg *y = ir->args[1];
+
+    if (!ir->d->is_fp)
+    {
+        char *cc = gen_compare(ir);
+        int rn = gp_dest(ir->d);
+        if (x->rn == rn)
+        {
+            cc = invert_cc(cc);
+            x = y;
+            y = ir->args[0];
+        }
+        if (x->rn != rn)
+        {
+            // mov leaves the flags alone.
+            gp_get(y, rn);
+            println("  cmov%s %s, %s", cc, opd(x, 8), reg64[rn]);
+        }
+        gp_set(ir->d, rn);
+        return;
+    }
+
+    char *sz = (ir->ty->kind == TY_FLOAT) ? "ss" : "sd";
+    char p = sz[1];
+    if (ir->cmp == IR_LT && ((x == ir->a && y == ir->b) || (x == ir->b && y == ir->a)))
+    {
+        // `minss src, dst` yields `dst < src ? dst : src`, and maxss
+        // `dst > src ? dst : src`.
+        char *op = (x == ir->a) ? "min" : "max";
+        int xn = fp_dest(ir->d);
+        if (y->rn == xn && x->rn != xn)
+        {
+            xn = 0;
+        }
+        fp_get(x, xn);
+        println("  %s%s %s, %%xmm%d", op, sz, opd(y, 8), xn);
+        fp_set(ir->d, xn);
+        return;
+    }
+
+    static char *preds[] = {[IR_EQ] = "eq", [IR_NE] = "neq", [IR_LT] = "lt", [IR_LE] = "le"};
+    fp_get(ir->a, 0);
+    fp_get(ir->b, 1);
+    println("  cmp%s%s %%xmm1, %%xmm0", preds[ir->cmp], sz);
+    fp_get(x, 1);
+    println("  andp%c %%xmm0, %%xmm1", p);
+    fp_get(y, 2);
+    println("  andnp%c %%xmm2, %%xmm0", p);
+    println("  orp%c %%xmm1, %%xmm0", p);
+    fp_set(ir->d, 0);
+}
+
+static void gen_br(IR *ir)
+{
+    Reg *cond = ir->a;
+
+    if (is_flonum(ir->ty))
+    {
+        char *sz = (ir->ty->kind == TY_FLOAT) ? "ss" : "sd";
+        println("  xorp%c %%xmm%d, %%xmm%d", sz[1], FP_TMP, FP_TMP);
+        println("  ucomi%s %s, %%xmm%d", sz, opd(cond, 8), FP_TMP);
+    }
+    else
+    {
+        int sz = (is_integer(ir->ty) && ir->ty->size <= 4) ? 4 : 8;
+        println("  cmp%s $0, %s", (sz == 8) ? "q" : "l", opd(cond, sz));
+    }
+
+    gen_jcc("ne", ir->bb1, ir->bb2);
+}
+
+static void gen_jtab(IR *ir)
+{
+    static int count;
+    ir->imm = count++;
+
+    if (njump_tables == sizeof(jump_tables) / sizeof(*jump_tables))
+    {
+        error_tok(ir->tok, "too many switch statements in a function");
+    }
+    jump_tables[njump_tables++] = ir;
+
+    // Table entries are 32-bit offsets from the table itself.
+    if (op_size(ir->ty) == 8)
+    {
+        println("  mov %s, %s", opd(ir->a, 8), reg64[GP_TMP1]);
+    }
+    else
+    {
+        println("  mov %s, %s", opd(ir->a, 4), reg32[GP_TMP1]);
+    }
+    println("  lea .L.jt%ld(%%rip), %s", ir->imm, reg64[GP_TMP2]);
+    println("  movslq (%s,%s,4), %s", reg64[GP_TMP2], reg64[GP_TMP1], reg64[GP_TMP1]);
+    println("  add %s, %s", reg64[GP_TMP2], reg64[GP_TMP1]);
+    println("  jmp *%s", reg64[GP_TMP1]);
+}
+
+static void emit_jump_tables(void)
+{
+    for (int i = 0; i < njump_tables; i++)
+    {
+        IR *ir = jump_tables[i];
+        println("  .section .rodata");
+        println("  .align 4");
+        println(".L.jt%ld:", ir->imm);
+        for (int j = 0; j < ir->ntargets; j++)
+        {
+            println("  .long .L.bb%d-.L.jt%ld", ir->targets[j]->label, ir->imm);
+        }
+        println("  .text");
+    }
+    njump_tables = 0;
+}
+
+// Vectorized loops
+//
+// The kernel of IR_VLOOP runs on 16 bytes of every array at a time.
+// The arrays are addressed by pointers in rcx, rdx and r10 plus a
+// common offset in r11, which counts up to the end offset in rax.
+// Kernel values live in xmm0 to xmm7.
+
+static int vec_ptr_regs[] = {REG_RCX, REG_RDX, REG_R10};
+static Reg *vec_ptrs[3];
+static int nvec_ptrs;
+static Reg *vec_vals[8];
+static int nvec_vals;
+
+static char *vec_ptr(Reg *r)
+{
+    for (int i = 0; i < nvec_ptrs; i++)
+    {
+        if (vec_ptrs[i] == r)
+        {
+            return reg64[vec_ptr_regs[i]];
+        }
+    }
+    gp_get(r, vec_ptr_regs[nvec_ptrs]);
+    vec_ptrs[nvec_ptrs] = r;
+    return reg64[vec_ptr_regs[nvec_ptrs++]];
+}
+
+// Returns the xmm register of a kernel value, or -1.
+static int vec_find(Reg *r)
+{
+    for (int i = 0; i < nvec_vals; i++)
+    {
+        if (vec_vals[i] == r)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int vec_new(Reg *r)
+{
+    vec_vals[nvec_vals] = r;
+    return nvec_vals++;
+}
+
+static bool vec_defines(IR *kernel, Reg *r)
+{
+    for (IR *k = kernel; k; k = k->next)
+    {
+        if (k->d == r)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Copies a scalar, or the constant of IR_IMM, to every element of a
+// new kernel value.
+static void vec_broadcast(Type *ty, Reg *r, IR *imm)
+{
+    int xn = vec_new(r);
+    if (is_flonum(ty))
+    {
+        fp_get(r, xn);
+        if (ty->kind == TY_FLOAT)
+        {
+            println("  shufps $0, %%xmm%d, %%xmm%d", xn, xn);
+        }
+        else
+        {
+            println("  unpcklpd %%xmm%d, %%xmm%d", xn, xn);
+        }
+        return;
+    }
+
+    if (imm)
+    {
+        println("  mov $%ld, %s", imm->imm, reg64[GP_TMP2]);
+    }
+    else
+    {
+        gp_get(r, GP_TMP2);
+    }
+    if (ty->size == 4)
+    {
+        println("  movd %s, %%xmm%d", reg32[GP_TMP2], xn);
+        println("  pshufd $0, %%xmm%d, %%xmm%d", xn, xn);
+    }
     else
     {
-        ax = "%eax";
-        di = "%edi";
-        dx = "%edx";
+        println("  movq %s, %%xmm%d", reg64[GP_TMP2], xn);
+        println("  punpcklqdq %%xmm%d, %%xmm%d", xn, xn);
+    }
+}
+
+// Broadcasts an operand of the kernel that is computed outside of it.
+static void vec_operand(IR *ir, Reg *r)
+{
+    if (r && vec_find(r) < 0 && !vec_defines(ir->kernel, r))
+    {
+        vec_broadcast(ir->ty, r, NULL);
     }
+}
+
+static char *vec_op(IROp op, Type *ty)
+{
+    if (is_flonum(ty))
+    {
+        char *sfx = (ty->kind == TY_FLOAT) ? "ps" : "pd";
+        switch (op)
+        {
+        case IR_ADD:
+            return format("add%s", sfx);
+        case IR_SUB:
+            return format("sub%s", sfx);
+        case IR_MUL:
+            return format("mul%s", sfx);
+        case IR_DIV:
+            return format("div%s", sfx);
+        }
+    }
+
+    char *sfx = (ty->size == 4) ? "d" : "q";
+    switch (op)
+    {
+    case IR_ADD:
+        return format("padd%s", sfx);
+    case IR_SUB:
+        return format("psub%s", sfx);
+    case IR_BITAND:
+        return "pand";
+    case IR_BITOR:
+        return "por";
+    case IR_BITXOR:
+        return "pxor";
+    }
+    unreachable();
+}
+
+// Returns the instruction moving a vector of type `ty`, aligned or not.
+static char *vec_mov(Type *ty, bool aligned)
+{
+    if (ty->kind == TY_FLOAT)
+    {
+        return aligned ? "movaps" : "movups";
+    }
+    if (ty->kind == TY_DOUBLE)
+    {
+        return aligned ? "movapd" : "movupd";
+    }
+    return aligned ? "movdqa" : "movdqu";
+}
+
+// Adds the 32-bit elements of `xn` as 64-bit ones to the accumulator.
+static void vec_widen_add(IR *k, int acc, int xn)
+{
+    char *op = vec_op(k->op, k->ty);
+    println("  pxor %%xmm14, %%xmm14");
+    println("  pcmpgtd %%xmm%d, %%xmm14", xn);
+    println("  movdqa %%xmm%d, %%xmm15", xn);
+    println("  punpckldq %%xmm14, %%xmm15");
+    println("  %s %%xmm15, %%xmm%d", op, acc);
+    println("  movdqa %%xmm%d, %%xmm15", xn);
+    println("  punpckhdq %%xmm14, %%xmm15");
+    println("  %s %%xmm15, %%xmm%d", op, acc);
+}
+
+static void gen_vloop(IR *ir)
+{
+    static int count;
+    int label = count++;
+    Type *ty = ir->ty;
+    nvec_ptrs = 0;
+    nvec_vals = 0;
+
+    // The reduction, if any, starts from the identity of its operator.
+    IR *red = NULL;
+    int acc = -1;
+    if (ir->d)
+    {
+        for (red = ir->kernel; red->d != ir->d; red = red->next)
+            ;
+        acc = vec_new(ir->d);
+        if (red->op == IR_BITAND)
+        {
+            println("  pcmpeqd %%xmm%d, %%xmm%d", acc, acc);
+        }
+        else
+        {
+            println("  pxor %%xmm%d, %%xmm%d", acc, acc);
+        }
+    }
+
+    for (IR *k = ir->kernel; k; k = k->next)
+    {
+        if (k->op == IR_IMM)
+        {
+            vec_broadcast(ty, k->d, k);
+        }
+        else if (k->op == IR_STORE)
+        {
+            vec_operand(ir, k->b);
+        }
+        else if (k->op != IR_LOAD)
+        {
+            vec_operand(ir, k->a);
+            vec_operand(ir, k->b);
+        }
+    }
+
+    for (IR *k = ir->kernel; k; k = k->next)
+    {
+        if (k->op == IR_LOAD || k->op == IR_STORE)
+        {
+            vec_ptr(k->a);
+        }
+    }
+    gp_get(ir->a, REG_RAX);
+    println("  shl $%d, %%rax", (ty->size == 4) ? 2 : 3);
+    println("  xor %s, %s", reg32[GP_TMP2], reg32[GP_TMP2]);
+
+    println(".L.vloop%d:", label);
+    for (IR *k = ir->kernel; k; k = k->next)
+    {
+        switch (k->op)
+        {
+        case IR_IMM:
+            break;
+        case IR_LOAD:
+            println("  %s %ld(%s,%s), %%xmm%d", vec_mov(ty, false), k->imm, vec_ptr(k->a), reg64[GP_TMP2],
+                    vec_new(k->d));
+            break;
+        case IR_STORE:
+            println("  %s %%xmm%d, %ld(%s,%s)", vec_mov(ty, false), vec_find(k->b), k->imm, vec_ptr(k->a),
+                    reg64[GP_TMP2]);
+            break;
+        default:
+            if (k == red && k->ty->size > ty->size)
+            {
+                vec_widen_add(k, acc, vec_find(k->b));
+            }
+            else if (k == red)
+            {
+                println("  %s %%xmm%d, %%xmm%d", vec_op(k->op, k->ty), vec_find(k->b), acc);
+            }
+            else
+            {
+                int xd = vec_new(k->d);
+                println("  %s %%xmm%d, %%xmm%d", vec_mov(ty, true), vec_find(k->a), xd);
+                println("  %s %%xmm%d, %%xmm%d", vec_op(k->op, ty), vec_find(k->b), xd);
+            }
+        }
+    }
+    println("  add $16, %s", reg64[GP_TMP2]);
+    println("  cmp %%rax, %s", reg64[GP_TMP2]);
+    println("  jb .L.vloop%d", label);
+
+    if (!red)
+    {
+        return;
+    }
+
+    // Combine the elements of the accumulator. Partial differences are
+    // added up.
+    char *op = vec_op(red->op == IR_SUB ? IR_ADD : red->op, red->ty);
+    int w = gp_dest(ir->d);
+    println("  pshufd $0x4e, %%xmm%d, %%xmm14", acc);
+    println("  %s %%xmm14, %%xmm%d", op, acc);
+    if (red->ty->size == 4)
+    {
+        println("  pshufd $0xb1, %%xmm%d, %%xmm14", acc);
+        println("  %s %%xmm14, %%xmm%d", op, acc);
+        println("  movd %%xmm%d, %s", acc, reg32[w]);
+    }
+    else
+    {
+        println("  movq %%xmm%d, %s", acc, reg64[w]);
+    }
+    gp_set(ir->d, w);
+}
+
+// Restores callee-saved registers and pops the stack frame.
+static void emit_epilogue(void)
+{
+    for (int rn = 0; rn < 16; rn++)
+    {
+        if (callee_saved_offset[rn])
+        {
+            println("  mov %s, %s", frame_slot(callee_saved_offset[rn]), reg64[rn]);
+        }
+    }
+    if (!omit_fp)
+    {
+        println("  mov %%rbp, %%rsp");
+        println("  pop %%rbp");
+    }
+    else if (frame_size)
+    {
+        println("  add $%d, %%rsp", frame_size);
+    }
+}
+
+static void gen_insn(IR *ir)
+{
+    if (ir->tok && ir->tok->line_no != cur_line)
+    {
+        cur_line = ir->tok->line_no;
+        println("  .loc 1 %d", cur_line);
+    }
+
+    switch (ir->op)
+    {
+    case IR_IMM:
+    {
+        int w = gp_dest(ir->d);
+        println("  mov $%ld, %s", ir->imm, reg64[w]);
+        gp_set(ir->d, w);
+        return;
+    }
+    case IR_FIMM:
+    {
+        union
+        {
+            float f32;
+            double f64;
+            uint32_t u32;
+            uint64_t u64;
+        } u;
 
-    switch (node->kind)
-    {
-    case ND_ADD:
-        println("  add %s, %s", di, ax);
-        return;
-    case ND_SUB:
-        println("  sub %s, %s", di, ax);
-        return;
-    case ND_MUL:
-        println("  imul %s, %s", di, ax);
-        return;
-    case ND_DIV:
-    case ND_MOD:
-        if (node->ty->is_unsigned)
+        int xn = fp_dest(ir->d);
+        if (ir->ty->kind == TY_FLOAT)
         {
-            println("  mov $0, %s", dx);
-            println("  div %s", di);
+            u.f32 = ir->fimm;
+            println("  mov $%u, %s  # float %f", u.u32, reg32[GP_TMP2], ir->fimm);
         }
         else
         {
-            if (node->lhs->ty->size == 8)
-            {
-                println("  cqo");
-            }
-            else
-            {
-                println("  cdq");
-            }
-            println("  idiv %s", di);
-        }
-
-        if (node->kind == ND_MOD)
-        {
-            println("  mov %%rdx, %%rax");
+            u.f64 = ir->fimm;
+            println("  mov $%lu, %s  # double %f", u.u64, reg64[GP_TMP2], ir->fimm);
         }
+        println("  movq %s, %%xmm%d", reg64[GP_TMP2], xn);
+        fp_set(ir->d, xn);
         return;
-    case ND_BITAND:
-        println("  and %s, %s", di, ax);
-        return;
-    case ND_BITOR:
-        println("  or %s, %s", di, ax);
-        return;
-    case ND_BITXOR:
-        println("  xor %s, %s", di, ax);
-        return;
-    case ND_EQ:
-    case ND_NE:
-    case ND_LT:
-    case ND_LE:
-        println("  cmp %s, %s", di, ax);
-        if (node->kind == ND_EQ)
+    }
+    case IR_MOV:
+        if (ir->d->is_fp)
         {
-            println("  sete %%al");
+            int xn = in_reg(ir->a) ? ir->a->rn : fp_dest(ir->d);
+            fp_get(ir->a, xn);
+            fp_set(ir->d, xn);
         }
-        else if (node->kind == ND_NE)
+        else
         {
-            println("  setne %%al");
+            int rn = in_reg(ir->a) ? ir->a->rn : gp_dest(ir->d);
+            gp_get(ir->a, rn);
+            gp_set(ir->d, rn);
         }
-        else if (node->kind == ND_LT)
+        return;
+    case IR_LADDR:
+    case IR_GADDR:
+    {
+        int w = gp_dest(ir->d);
+        if (ir->op == IR_LADDR)
         {
-            if (node->lhs->ty->is_unsigned)
-            {
-                println("  setb %%al");
-            }
-            else
-            {
-                println("  setl %%al");
-            }
+            println("  lea %s, %s", frame_slot(ir->var->offset), reg64[w]);
         }
-        else if (node->kind == ND_LE)
+        else
         {
-            if (node->lhs->ty->is_unsigned)
-            {
-                println("  setbe %%al");
-            }
-            else
-            {
-                println("  setle %%al");
-            }
+            println("  lea %s(%%rip), %s", ir->var->name, reg64[w]);
         }
-
-        println("  movzb %%al, %%rax");
+        gp_set(ir->d, w);
+        return;
+    }
+    case IR_LEA:
+    {
+        int w = gp_dest(ir->d);
+        println("  lea %s, %s", mem_opd(ir), reg64[w]);
+        gp_set(ir->d, w);
         return;
-    case ND_SHL:
-        println("  mov %%rdi, %%rcx");
-        println("  shl %%cl, %s", ax);
+    }
+    case IR_LOAD:
+        gen_load(ir);
+        return;
+    case IR_STORE:
+        gen_store(ir);
         return;
-    case ND_SHR:
-        println("  mov %%rdi, %%rcx");
-        if (node->lhs->ty->is_unsigned)
+    case IR_ADD:
+        if (is_flonum(ir->ty))
         {
-            println("  shr %%cl, %s", ax);
+            gen_fp_binary(ir, "add", true);
         }
         else
         {
-            println("  sar %%cl, %s", ax);
+            gen_gp_binary(ir, "add", true);
         }
         return;
-    }
-
-    error_tok(node->tok, "invalid expression");
-}
-
-static void gen_stmt(Node *node)
-{
-    println("  .loc 1 %d", node->tok->line_no);
-    switch (node->kind)
-    {
-    case ND_IF:
-    {
-        int c = count();
-        gen_expr(node->cond);
-        cmp_zero(node->cond->ty);
-        println("  je  .L.else.%d", c);
-        gen_stmt(node->then);
-        println("  jmp .L.end.%d", c);
-        println(".L.else.%d:", c);
-        if (node->els)
+    case IR_SUB:
+        if (is_flonum(ir->ty))
+        {
+            gen_fp_binary(ir, "sub", false);
+        }
+        else
         {
-            gen_stmt(node->els);
+            gen_gp_binary(ir, "sub", false);
         }
-        println(".L.end.%d:", c);
         return;
-    }
-    case ND_LOOP:
-    {
-        int c = count();
-        if (node->init)
+    case IR_MUL:
+        if (is_flonum(ir->ty))
         {
-            gen_stmt(node->init);
+            gen_fp_binary(ir, "mul", true);
         }
-        println(".L.begin.%d:", c);
-        if (node->cond)
+        else
         {
-            gen_expr(node->cond);
-            cmp_zero(node->cond->ty);
-            println("  je %s", node->brk_label);
+            gen_gp_binary(ir, "imul", true);
         }
-        gen_stmt(node->then);
-        println("%s:", node->cont_label);
-        if (node->inc)
+        return;
+    case IR_MULH:
+        gen_mulh(ir);
+        return;
+    case IR_DIV:
+        if (is_flonum(ir->ty))
         {
-            gen_expr(node->inc);
+            gen_fp_binary(ir, "div", false);
+            return;
         }
-        println("  jmp .L.begin.%d", c);
-        println("%s:", node->brk_label);
+        gen_div(ir);
         return;
-    }
-    case ND_DO:
+    case IR_MOD:
+        gen_div(ir);
+        return;
+    case IR_BITAND:
+        gen_gp_binary(ir, "and", true);
+        return;
+    case IR_BITOR:
+        gen_gp_binary(ir, "or", true);
+        return;
+    case IR_BITXOR:
+        gen_gp_binary(ir, "xor", true);
+        return;
+    case IR_SHL:
+    case IR_SHR:
+        gen_shift(ir);
+        return;
+    case IR_EQ:
+    case IR_NE:
+    case IR_LT:
+    case IR_LE:
+        gen_cmp(ir);
+        return;
+    case IR_NEG:
+    case IR_BITNOT:
     {
-        int c = count();
-        println(".L.begin.%d:", c);
-        gen_stmt(node->then);
-        println("%s:", node->cont_label);
-        gen_expr(node->cond);
-        cmp_zero(node->cond->ty);
-        println("  jne .L.begin.%d", c);
-        println("%s:", node->brk_label);
+        int w = gp_dest(ir->d);
+        gp_get(ir->a, w);
+        println("  %s %s", (ir->op == IR_NEG) ? "neg" : "not", reg64[w]);
+        gp_set(ir->d, w);
         return;
     }
-    case ND_SWITCH:
-        gen_expr(node->cond);
-
-        for (Node *n = node->case_next; n; n = n->case_next)
+    case IR_CAST:
+        gen_cast(ir);
+        return;
+    case IR_MEMZERO:
+        gen_memzero(ir);
+        return;
+    case IR_MEMCPY:
+        gen_memcpy(ir);
+        return;
+    case IR_CALL:
+        gen_call(ir);
+        return;
+    case IR_TAILCALL:
+        println("  mov $%d, %%eax", pass_args(ir));
+        emit_epilogue();
+        println("  jmp %s", ir->funcname);
+        return;
+    case IR_RET:
+        if (ir->a)
         {
-            char *reg = (node->cond->ty->size == 8) ? "%rax" : "%eax";
-            println("  cmp $%ld, %s", n->val, reg);
-            println("  je %s", n->label);
+            if (ir->a->is_fp)
+            {
+                fp_get(ir->a, 0);
+            }
+            else
+            {
+                gp_get(ir->a, REG_RAX);
+            }
         }
-
-        if (node->default_case)
+        println("  jmp .L.return.%s", current_fn->name);
+        return;
+    case IR_JMP:
+        if (ir->bb1 != next_bb)
         {
-            println("  jmp %s", node->default_case->label);
+            println("  jmp .L.bb%d", ir->bb1->label);
         }
-
-        println("  jmp %s", node->brk_label);
-        gen_stmt(node->then);
-        println("%s:", node->brk_label);
         return;
-    case ND_CASE:
-        println("%s:", node->label);
-        gen_stmt(node->lhs);
+    case IR_BR:
+        gen_br(ir);
         return;
-    case ND_BLOCK:
-        for (Node *n = node->body; n; n = n->next)
-        {
-            gen_stmt(n);
-        }
+    case IR_CBR:
+        gen_cbr(ir);
         return;
-    case ND_GOTO:
-        println("  jmp %s", node->unique_label);
+    case IR_JTAB:
+        gen_jtab(ir);
         return;
-    case ND_LABEL:
-        println("%s:", node->unique_label);
-        gen_stmt(node->lhs);
+    case IR_VLOOP:
+        gen_vloop(ir);
         return;
-    case ND_RETURN:
-        if (node->lhs)
-        {
-            gen_expr(node->lhs);
-        }
-        println("  jmp .L.return.%s", current_fn->name);
+    case IR_SELECT:
+        gen_select(ir);
         return;
-    case ND_EXPR_STMT:
-        gen_expr(node->lhs);
+    }
+
+    error_tok(ir->tok, "invalid instruction");
+}
+
+static void assign_reg(Reg *r, int *offset, bool *used)
+{
+    if (!r)
+    {
         return;
     }
+    if (r->spill && !r->offset)
+    {
+        *offset = align_to(*offset + 8, 8);
+        r->offset = -*offset;
+    }
+    if (!r->is_fp && in_reg(r))
+    {
+        used[r->rn] = true;
+    }
+}
 
-    error_tok(node->tok, "invalid statement");
+// Assign offsets to local variables, to spilled registers and to the
+// save area of callee-saved registers. Variables living in registers
+// keep their slots so that the frame layout does not depend on -O.
+static int cmp_scope_start(const void *x, const void *y)
+{
+    Var *a = *(Var **)x;
+    Var *b = *(Var **)y;
+    if (a->scope_start != b->scope_start)
+    {
+        return a->scope_start - b->scope_start;
+    }
+    // Keep the declaration order within a scope.
+    return a->offset - b->offset;
 }
 
-// Assign offsets to local variables
-static void assign_lvar_offsets(Var *prog)
+// Lays out local variables. Locals whose lifetimes overlap get
+// disjoint slots; the others, typically those of sibling blocks, may
+// share one.
+//
+// Variables are placed outermost scope first, each one below every
+// variable already placed that is still alive when it is born.
+// Returns the size of the area.
+static int assign_local_slots(Var *fn)
 {
-    for (Var *fn = prog; fn; fn = fn->next)
+    int n = 0;
+    for (Var *var = fn->locals; var; var = var->next)
     {
-        if (!fn->is_function)
+        n++;
+    }
+
+    Var **vars = calloc(n, sizeof(Var *));
+    int *bottom = calloc(n, sizeof(int));
+    n = 0;
+    for (Var *var = fn->locals; var; var = var->next)
+    {
+        if (!var->on_stack)
         {
-            continue;
+            var->offset = n; // sort key
+            vars[n++] = var;
         }
+    }
+    qsort(vars, n, sizeof(Var *), cmp_scope_start);
+
+    int size = 0;
+    for (int i = 0; i < n; i++)
+    {
+        Var *var = vars[i];
         int offset = 0;
-        for (Var *var = fn->locals; var; var = var->next)
+        for (int j = 0; j < i; j++)
+        {
+            if (vars[j]->scope_end >= var->scope_start && offset < bottom[j])
+            {
+                offset = bottom[j];
+            }
+        }
+        offset = align_to(offset + var->ty->size, var->align);
+        var->offset = -offset;
+        bottom[i] = offset;
+        if (size < offset)
         {
-            offset += var->ty->size;
-            offset = align_to(offset, var->align);
-            var->offset = -offset;
+            size = offset;
         }
-        fn->stack_size = align_to(offset, 16);
     }
+
+    free(vars);
+    free(bottom);
+    return size;
 }
 
-static void emit_data(Var *prog)
+// Parameters past the sixth integer or the eighth floating-point one
+// are read from where the caller pushed them, above the return address.
+static void assign_stack_params(Var *fn)
 {
-    for (Var *var = prog; var; var = var->next)
+    int gp = 0, fp = 0;
+    int offset = 16;
+    for (Var *var = fn->params; var; var = var->next)
     {
-        if (var->is_function || !var->is_definition)
+        var->on_stack = is_flonum(var->ty) ? fp++ >= 8 : gp++ >= 6;
+        if (var->on_stack)
         {
-            continue;
+            var->offset = offset;
+            offset += 8;
         }
+    }
+}
 
-        if (var->is_static)
-        {
-            println("  .local %s", var->name);
-        }
-        else
+static void assign_lvar_offsets(Var *fn)
+{
+    assign_stack_params(fn);
+
+    // What the frame would take with one slot per variable
+    int unshared = 0;
+    for (Var *var = fn->locals; var; var = var->next)
+    {
+        if (!var->on_stack)
         {
-            println("  .globl %s", var->name);
+            unshared += var->ty->size;
+            unshared = align_to(unshared, var->align);
         }
-        println("  .align %d", var->align);
+    }
 
-        if (var->init_data)
-        {
-            println("  .data");
-            println("%s:", var->name);
+    int offset = assign_local_slots(fn);
+    unshared -= offset;
 
-            Relocation *rel = var->rel;
-            int pos = 0;
-            while (pos < var->ty->size)
+    bool used[16] = {};
+    memset(callee_saved_offset, 0, sizeof(callee_saved_offset));
+
+    for (BB *bb = fn->bbs; bb; bb = bb->next)
+    {
+        for (IR *ir = bb->ir; ir; ir = ir->next)
+        {
+            assign_reg(ir->d, &offset, used);
+            assign_reg(ir->a, &offset, used);
+            assign_reg(ir->b, &offset, used);
+            assign_reg(ir->index, &offset, used);
+            for (int i = 0; i < ir->nargs; i++)
             {
-                if (rel && rel->offset == pos)
-                {
-                    println("  .quad %s%+ld", rel->label, rel->addend);
-                    rel = rel->next;
-                    pos += 8;
-                }
-                else
-                {
-                    println("  .byte %d", var->init_data[pos++]);
-                }
+                assign_reg(ir->args[i], &offset, used);
             }
-            continue;
         }
-        println("  .bss");
-        println("%s:", var->name);
-        println("  .zero %d", var->ty->size);
     }
+
+    for (int rn = 0; rn < 16; rn++)
+    {
+        if (used[rn] && is_callee_saved(rn))
+        {
+            offset += 8;
+            callee_saved_offset[rn] = -offset;
+        }
+    }
+
+    fn->stack_size = align_to(offset, 16);
+    fn->unshared_stack_size = align_to(offset + unshared, 16);
 }
 
 static void store_fp(int r, int offset, int sz)
@@ -879,10 +1861,10 @@ static void store_fp(int r, int offset, int sz)
     switch (sz)
     {
     case 4:
-        println("  movss %%xmm%d, %d(%%rbp)", r, offset);
+        println("  movss %%xmm%d, %s", r, frame_slot(offset));
         return;
     case 8:
-        println("  movsd %%xmm%d, %d(%%rbp)", r, offset);
+        println("  movsd %%xmm%d, %s", r, frame_slot(offset));
         return;
     }
     unreachable();
@@ -893,21 +1875,149 @@ static void store_gp(int r, int offset, int sz)
     switch (sz)
     {
     case 1:
-        println("  mov %s, %d(%%rbp)", argreg8[r], offset);
-        return;
     case 2:
-        println("  mov %s, %d(%%rbp)", argreg16[r], offset);
-        return;
     case 4:
-        println("  mov %s, %d(%%rbp)", argreg32[r], offset);
-        return;
     case 8:
-        println("  mov %s, %d(%%rbp)", argreg64[r], offset);
+        println("  mov %s, %s", gpreg(argreg[r], sz), frame_slot(offset));
         return;
     }
     unreachable();
 }
 
+// Returns true if a function makes no calls.
+static bool is_leaf(Var *fn)
+{
+    for (BB *bb = fn->bbs; bb; bb = bb->next)
+    {
+        for (IR *ir = bb->ir; ir; ir = ir->next)
+        {
+            if (ir->op == IR_CALL)
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Returns true if the stack slot of a parameter may be read. Once the
+// address of any local escapes, every slot is conservatively assumed
+// to be reachable through it.
+static bool is_slot_used(Var *fn, Var *var)
+{
+    for (BB *bb = fn->bbs; bb; bb = bb->next)
+    {
+        for (IR *ir = bb->ir; ir; ir = ir->next)
+        {
+            if (ir->var == var || ir->op == IR_LADDR || (ir->op == IR_LEA && ir->var && ir->var->is_local))
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static void store_params(Var *fn)
+{
+    // Parameters that stay in memory
+    int gp = 0, fp = 0;
+    for (Var *var = fn->params; var; var = var->next)
+    {
+        bool used = !var->reg && !var->on_stack && is_slot_used(fn, var);
+        if (is_flonum(var->ty))
+        {
+            if (used)
+            {
+                store_fp(fp, var->offset, var->ty->size);
+            }
+            fp++;
+        }
+        else
+        {
+            if (used)
+            {
+                store_gp(gp, var->offset, var->ty->size);
+            }
+            gp++;
+        }
+    }
+
+    // Parameters promoted to registers
+    Move moves[6];
+    int n = 0;
+    gp = fp = 0;
+
+    for (Var *var = fn->params; var; var = var->next)
+    {
+        Reg *r = var->reg;
+        if (var->on_stack)
+        {
+            continue;
+        }
+        if (is_flonum(var->ty))
+        {
+            int xn = fp++;
+            if (r && (in_reg(r) || r->spill))
+            {
+                println("  movsd %%xmm%d, %s", xn, opd(r, 8));
+            }
+            continue;
+        }
+
+        int rn = argreg[gp++];
+        if (!r || (!in_reg(r) && !r->spill))
+        {
+            continue;
+        }
+
+        if (var->ty->size < 4)
+        {
+            char *insn = var->ty->is_unsigned ? "movz" : "movs";
+            char c = (var->ty->size == 1) ? 'b' : 'w';
+            println("  %s%cl %s, %s", insn, c, gpreg(rn, var->ty->size), reg32[rn]);
+        }
+
+        Move *m = &moves[n++];
+        m->src = rn;
+        m->dst = r->rn;
+        m->mem = in_reg(r) ? NULL : opd(r, 8);
+    }
+    parallel_move(moves, n);
+
+    // Parameters passed on the stack are loaded once the argument
+    // registers have been read.
+    for (Var *var = fn->params; var; var = var->next)
+    {
+        Reg *r = var->reg;
+        if (!var->on_stack || !r || (!in_reg(r) && !r->spill))
+        {
+            continue;
+        }
+
+        if (r->is_fp)
+        {
+            int xn = fp_dest(r);
+            println("  movsd %s, %%xmm%d", frame_slot(var->offset), xn);
+            fp_set(r, xn);
+            continue;
+        }
+
+        int rn = gp_dest(r);
+        if (var->ty->size < 4)
+        {
+            char *insn = var->ty->is_unsigned ? "movz" : "movs";
+            char c = (var->ty->size == 1) ? 'b' : 'w';
+            println("  %s%cl %s, %s", insn, c, frame_slot(var->offset), reg32[rn]);
+        }
+        else
+        {
+            println("  mov %s, %s", frame_slot(var->offset), reg64[rn]);
+        }
+        gp_set(r, rn);
+    }
+}
+
 static void emit_text(Var *prog)
 {
     for (Var *fn = prog; fn; fn = fn->next)
@@ -928,19 +2038,55 @@ static void emit_text(Var *prog)
         println("  .text");
         println("%s:", fn->name);
         current_fn = fn;
+        cur_line = 0;
+
+        alloc_regs(fn);
+        assign_lvar_offsets(fn);
+
+        // Prologue. A leaf function without the frame pointer keeps
+        // %rsp 8 bytes below where %rbp would be, or uses the red
+        // zone below %rsp if its frame fits in there.
+        buffering = true;
+        omit_fp = opt_fomit_frame_pointer && !fn->va_area && is_leaf(fn);
+        frame_size = 0;
+        if (omit_fp)
+        {
+            if (fn->stack_size + 8 > RED_ZONE_SIZE)
+            {
+                frame_size = fn->stack_size + 8;
+                println("  sub $%d, %%rsp", frame_size);
+            }
+            frame_reg = "%rsp";
+            frame_disp = frame_size - 8;
+        }
+        else
+        {
+            println("  push %%rbp");
+            println("  mov %%rsp, %%rbp");
+            println("  sub $%d, %%rsp", fn->stack_size);
+            frame_reg = "%rbp";
+            frame_disp = 0;
+        }
 
-        // Prologue
-        println("  push %%rbp");
-        println("  mov %%rsp, %%rbp");
-        println("  sub $%d, %%rsp", fn->stack_size);
+        for (int rn = 0; rn < 16; rn++)
+        {
+            if (callee_saved_offset[rn])
+            {
+                println("  mov %s, %s", reg64[rn], frame_slot(callee_saved_offset[rn]));
+            }
+        }
 
         // Save arg registers if function is variadic
         if (fn->va_area)
         {
-            int gp = 0, fp = 0;
+            int gp = 0, fp = 0, stack = 16;
             for (Var *var = fn->params; var; var = var->next)
             {
-                if (is_flonum(var->ty))
+                if (var->on_stack)
+                {
+                    stack += 8;
+                }
+                else if (is_flonum(var->ty))
                 {
                     fp++;
                 }
@@ -954,6 +2100,8 @@ static void emit_text(Var *prog)
             // va_elem
             println("  movl $%d, %d(%%rbp)", gp * 8, off);
             println(" movl $%d, %d(%%rbp)", fp * 8 + 48, off + 4);
+            println("  movq %%rbp, %d(%%rbp)", off + 8);
+            println("  addq $%d, %d(%%rbp)", stack, off + 8);
             println("  movq %%rbp, %d(%%rbp)", off + 16);
             println("  addq $%d, %d(%%rbp)", off + 24, off + 16);
 
@@ -974,36 +2122,45 @@ static void emit_text(Var *prog)
             println("  movsd %%xmm7, %d(%%rbp)", off + 128);
         }
 
-        // Save passed-by-register arguments to the stack
-        int gp = 0, fp = 0;
-        for (Var *var = fn->params; var; var = var->next)
+        store_params(fn);
+
+        // Emit code
+        for (BB *bb = fn->bbs; bb; bb = bb->next)
         {
-            if (is_flonum(var->ty))
-            {
-                store_fp(fp++, var->offset, var->ty->size);
-            }
-            else
+            next_bb = bb->next;
+            println(".L.bb%d:", bb->label);
+            for (IR *ir = bb->ir; ir; ir = ir->next)
             {
-                store_gp(gp++, var->offset, var->ty->size);
+                gen_insn(ir);
             }
         }
 
-        // Emit code
-        gen_stmt(fn->body);
-        assert(depth == 0);
-
         // Epilogue
         println(".L.return.%s:", fn->name);
-        println("  mov %%rbp, %%rsp");
-        println("  pop %%rbp");
+        emit_epilogue();
         println("  ret");
+        emit_jump_tables();
+        buffering = false;
+        peephole_flush(output_file);
+    }
+}
+
+void frame_report(Var *prog, FILE *out)
+{
+    fprintf(out, "%-24s %8s %8s %8s\n", "function", "unshared", "frame", "saved");
+    for (Var *fn = prog; fn; fn = fn->next)
+    {
+        if (fn->is_function && fn->is_definition)
+        {
+            fprintf(out, "%-24s %8d %8d %8d\n", fn->name, fn->unshared_stack_size,
+                    fn->stack_size, fn->unshared_stack_size - fn->stack_size);
+        }
     }
 }
 
 void codegen(Var *prog, FILE *out)
 {
     output_file = out;
-    assign_lvar_offsets(prog);
     emit_data(prog);
     emit_text(prog);
 }
\ No newline at end of file
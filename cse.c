@@ -0,0 +1,455 @@
+#include "zcc.h"
+
+// Local value numbering.
+//
+// Within a basic block, every value a register takes is given a number
+// so that two instructions computing the same operation on the same
+// numbers can be recognized. The second one is then replaced by the
+// register that already holds the result. A copy shares the number of
+// its source, and an address `[a + imm]` whose `a` was computed by a
+// `lea` is looked up in the form of that `lea`, so that different ways
+// of reaching the same element still match.
+//
+// Loads are keyed with a version of the memory they read, which a
+// store or a call changes. If no local variable of the function has
+// its address taken, a local is only changed by stores to itself, and
+// other stores and calls leave the locals alone. Otherwise any store
+// may change any memory, since a pointer to one local can reach its
+// neighbors. After a store, a load of the same address yields the
+// stored value.
+
+typedef struct
+{
+    IROp op;
+    TypeKind kind;
+    int size;
+    bool is_unsigned;
+    TypeKind from_kind;
+    int from_size;
+    bool from_unsigned;
+    int a;
+    int b;
+    int index;
+    int scale;
+    int64_t imm;
+    double fimm;
+    Var *var;
+    int mem;
+} Expr;
+
+typedef struct
+{
+    int clock;
+
+    // Per register: its value number, valid if `stamp` is the current
+    // block's, and the register that replaces it, if any.
+    int *vnum;
+    int *stamp;
+    Reg **repl;
+    int *ndefs;
+
+    // Per value number: a register holding it and its expression
+    Reg **holder;
+    Expr **expr;
+    int nvals;
+    int cap;
+
+    HashMap exprs;
+    HashMap var_mem;    // Version of the memory of a private local
+    bool frame_escapes; // The address of some local is taken
+    int mem;            // Version of all other memory
+    int version;
+} LVN;
+
+static int new_value(LVN *s, Reg *holder, Expr *e)
+{
+    if (s->nvals == s->cap)
+    {
+        s->cap = s->cap ? s->cap * 2 : 64;
+        s->holder = realloc(s->holder, s->cap * sizeof(Reg *));
+        s->expr = realloc(s->expr, s->cap * sizeof(Expr *));
+    }
+    s->holder[s->nvals] = holder;
+    s->expr[s->nvals] = e;
+    return s->nvals++;
+}
+
+static void set_value(LVN *s, Reg *r, int v)
+{
+    s->vnum[r->vn] = v;
+    s->stamp[r->vn] = s->clock;
+    if (s->vnum[s->holder[v]->vn] != v || s->stamp[s->holder[v]->vn] != s->clock)
+    {
+        s->holder[v] = r;
+    }
+}
+
+// Returns the value number of `r`. A register not yet seen in this
+// block holds a value of its own.
+static int value_of(LVN *s, Reg *r)
+{
+    if (!r)
+    {
+        return -1;
+    }
+    if (s->stamp[r->vn] != s->clock)
+    {
+        set_value(s, r, new_value(s, r, NULL));
+    }
+    return s->vnum[r->vn];
+}
+
+// Returns a register that still holds value `v`, or NULL.
+static Reg *holder_of(LVN *s, int v)
+{
+    Reg *r = s->holder[v];
+    if (s->stamp[r->vn] == s->clock && s->vnum[r->vn] == v)
+    {
+        return r;
+    }
+    return NULL;
+}
+
+static bool is_private(LVN *s, Var *var)
+{
+    return var && var->is_local && !s->frame_escapes;
+}
+
+static int mem_version(LVN *s, Var *var)
+{
+    if (is_private(s, var))
+    {
+        return (intptr_t)hashmap_get_ptr(&s->var_mem, var);
+    }
+    return s->mem;
+}
+
+// Marks the memory a store to `var` or through a pointer may change.
+static void clobber(LVN *s, Var *var)
+{
+    if (is_private(s, var))
+    {
+        hashmap_put_ptr(&s->var_mem, var, (void *)(intptr_t)++s->version);
+    }
+    else
+    {
+        s->mem = ++s->version;
+    }
+}
+
+static bool is_commutative(IROp op)
+{
+    switch (op)
+    {
+    case IR_ADD:
+    case IR_MUL:
+    case IR_MULH:
+    case IR_BITAND:
+    case IR_BITOR:
+    case IR_BITXOR:
+    case IR_EQ:
+    case IR_NE:
+        return true;
+    }
+    return false;
+}
+
+// Fills in the address operands of `e` from an instruction, looking
+// through a base register computed by another address expression.
+static void set_address(LVN *s, Expr *e, IR *ir)
+{
+    e->var = ir->var;
+    e->a = value_of(s, ir->a);
+    e->index = value_of(s, ir->index);
+    e->scale = ir->index ? ir->scale : 0;
+    e->imm = ir->imm;
+
+    if (ir->var || ir->index || !ir->a)
+    {
+        return;
+    }
+
+    Expr *base = s->expr[e->a];
+    if (!base)
+    {
+        return;
+    }
+    if (base->op == IR_LEA)
+    {
+        e->var = base->var;
+        e->a = base->a;
+        e->index = base->index;
+        e->scale = base->scale;
+        e->imm += base->imm;
+    }
+    else if (base->op == IR_LADDR || base->op == IR_GADDR)
+    {
+        e->var = base->var;
+        e->a = -1;
+    }
+}
+
+static void set_type(Expr *e, Type *ty, Type *from)
+{
+    e->kind = ty->kind;
+    e->size = ty->size;
+    e->is_unsigned = ty->is_unsigned;
+    if (from)
+    {
+        e->from_kind = from->kind;
+        e->from_size = from->size;
+        e->from_unsigned = from->is_unsigned;
+    }
+}
+
+// Returns the value number computed by `e`, or -1.
+static int lookup(LVN *s, Expr *e)
+{
+    return (intptr_t)hashmap_get2(&s->exprs, (char *)e, sizeof(Expr)) - 1;
+}
+
+static void record(LVN *s, Expr *e, int v)
+{
+    Expr *key = arena_alloc(&ir_arena, sizeof(Expr));
+    *key = *e;
+    hashmap_put2(&s->exprs, (char *)key, sizeof(Expr), (void *)(intptr_t)(v + 1));
+    if (!s->expr[v])
+    {
+        s->expr[v] = key;
+    }
+}
+
+// Builds the key of an instruction that computes a value. Returns
+// false for instructions that cannot be reused.
+static bool make_key(LVN *s, IR *ir, Expr *e)
+{
+    memset(e, 0, sizeof(Expr));
+    e->op = ir->op;
+    set_type(e, ir->ty, ir->op == IR_CAST ? ir->from : NULL);
+
+    switch (ir->op)
+    {
+    case IR_MOV:
+    case IR_CALL:
+        return false;
+    case IR_IMM:
+        e->imm = ir->imm;
+        return true;
+    case IR_FIMM:
+        e->fimm = ir->fimm;
+        return true;
+    case IR_LADDR:
+    case IR_GADDR:
+        e->var = ir->var;
+        return true;
+    case IR_LEA:
+        set_address(s, e, ir);
+        return true;
+    case IR_LOAD:
+        set_address(s, e, ir);
+        e->mem = mem_version(s, e->var);
+        return true;
+    }
+
+    if (!ir->d)
+    {
+        return false;
+    }
+
+    e->a = value_of(s, ir->a);
+    e->b = value_of(s, ir->b);
+    e->imm = ir->imm;
+    e->var = ir->var;
+    if (ir->var)
+    {
+        // The second operand is in memory.
+        e->mem = mem_version(s, ir->var);
+    }
+    if (ir->b && is_commutative(ir->op) && e->b < e->a)
+    {
+        int tmp = e->a;
+        e->a = e->b;
+        e->b = tmp;
+    }
+    return true;
+}
+
+static bool is_temp(LVN *s, Reg *r)
+{
+    return !r->var && s->ndefs[r->vn] == 1;
+}
+
+static Reg *replace(LVN *s, Reg *r)
+{
+    return (r && s->repl[r->vn]) ? s->repl[r->vn] : r;
+}
+
+static void replace_operands(LVN *s, IR *ir)
+{
+    ir->a = replace(s, ir->a);
+    ir->b = replace(s, ir->b);
+    ir->index = replace(s, ir->index);
+    for (int i = 0; i < ir->nargs; i++)
+    {
+        ir->args[i] = replace(s, ir->args[i]);
+    }
+}
+
+// Numbers the values of one block, removing redundant computations or
+// turning them into copies.
+static void number_block(LVN *s, BB *bb)
+{
+    s->clock++;
+    s->mem = 0;
+    hashmap_free(&s->exprs);
+    hashmap_free(&s->var_mem);
+
+    IR head = {.next = bb->ir};
+    for (IR *prev = &head; prev->next;)
+    {
+        IR *ir = prev->next;
+        replace_operands(s, ir);
+
+        if (ir->op == IR_STORE)
+        {
+            Expr e = {};
+            set_address(s, &e, ir);
+            clobber(s, e.var);
+
+            // A later load of the address sees the stored value. Narrow
+            // integers are left out since a register may hold them
+            // without truncation.
+            if (is_flonum(ir->ty) || ir->ty->size >= 4)
+            {
+                e.op = IR_LOAD;
+                set_type(&e, ir->ty, NULL);
+                e.mem = mem_version(s, e.var);
+                record(s, &e, value_of(s, ir->b));
+            }
+            prev = ir;
+            continue;
+        }
+
+        if (ir->op == IR_MEMZERO || ir->op == IR_MEMCPY)
+        {
+            clobber(s, ir->var);
+        }
+        else if (ir->op == IR_CALL)
+        {
+            clobber(s, NULL);
+        }
+
+        if (!ir->d)
+        {
+            prev = ir;
+            continue;
+        }
+
+        if (ir->op == IR_MOV)
+        {
+            int v = value_of(s, ir->a);
+            if (s->stamp[ir->d->vn] == s->clock && s->vnum[ir->d->vn] == v)
+            {
+                // `d` already holds the value.
+                prev->next = ir->next;
+                continue;
+            }
+            set_value(s, ir->d, v);
+            prev = ir;
+            continue;
+        }
+
+        Expr e;
+        bool keyed = make_key(s, ir, &e);
+        int v = keyed ? lookup(s, &e) : -1;
+        Reg *r = (v >= 0) ? holder_of(s, v) : NULL;
+        if (!r)
+        {
+            v = new_value(s, ir->d, NULL);
+            if (keyed)
+            {
+                record(s, &e, v);
+            }
+            set_value(s, ir->d, v);
+            prev = ir;
+            continue;
+        }
+
+        if (ir->op == IR_IMM && r != ir->d)
+        {
+            // Constants are cheaper to rematerialize than to keep in
+            // a register, but copies of them can still be removed.
+            set_value(s, ir->d, v);
+            prev = ir;
+            continue;
+        }
+
+        if (r == ir->d || (is_temp(s, ir->d) && is_temp(s, r)))
+        {
+            // Uses of the result are rewritten to `r`.
+            if (r != ir->d)
+            {
+                s->repl[ir->d->vn] = r;
+            }
+            prev->next = ir->next;
+            continue;
+        }
+
+        Reg *d = ir->d;
+        Token *tok = ir->tok;
+        Type *ty = d->is_fp ? ir->ty : ty_long;
+        *ir = (IR){.next = ir->next, .op = IR_MOV, .ty = ty, .tok = tok, .d = d, .a = r};
+        set_value(s, d, v);
+        prev = ir;
+    }
+    // Terminators define no register, so bb->last is never removed.
+    bb->ir = head.next;
+}
+
+void eliminate_common_subexprs(Var *fn)
+{
+    LVN s = {};
+    s.vnum = calloc(fn->nregs, sizeof(int));
+    s.stamp = calloc(fn->nregs, sizeof(int));
+    s.repl = calloc(fn->nregs, sizeof(Reg *));
+    s.ndefs = calloc(fn->nregs, sizeof(int));
+
+    for (BB *bb = fn->bbs; bb; bb = bb->next)
+    {
+        for (IR *ir = bb->ir; ir; ir = ir->next)
+        {
+            if (ir->d)
+            {
+                s.ndefs[ir->d->vn]++;
+            }
+            if (ir->op == IR_LADDR || (ir->op == IR_LEA && ir->var && ir->var->is_local))
+            {
+                s.frame_escapes = true;
+            }
+        }
+    }
+
+    for (BB *bb = fn->bbs; bb; bb = bb->next)
+    {
+        number_block(&s, bb);
+    }
+
+    // A replaced register may be used in a block that comes earlier in
+    // the list, such as the condition of a loop.
+    for (BB *bb = fn->bbs; bb; bb = bb->next)
+    {
+        for (IR *ir = bb->ir; ir; ir = ir->next)
+        {
+            replace_operands(&s, ir);
+        }
+    }
+
+    free(s.vnum);
+    free(s.stamp);
+    free(s.repl);
+    free(s.ndefs);
+    free(s.holder);
+    free(s.expr);
+    hashmap_free(&s.exprs);
+    hashmap_free(&s.var_mem);
+}
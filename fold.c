@@ -0,0 +1,635 @@
+#include "zcc.h"
+
+// Constant folding and algebraic simplification.
+//
+// Runs over the body of every function at -O1 before it is lowered to
+// IR. Operators and casts whose operands are constants are evaluated,
+// trivial identities such as `x*1` or `x+0` are removed, constants are
+// reassociated and moved to the right-hand side, and statements that
+// a constant condition makes unreachable are dropped.
+
+static Node *fold_expr(Node *node);
+static void fold_stmt(Node *node);
+
+static bool same_type(Type *x, Type *y)
+{
+    return x->kind == y->kind && x->size == y->size && x->is_unsigned == y->is_unsigned;
+}
+
+static bool is_int_const(Node *node)
+{
+    return node->kind == ND_NUM && is_integer(node->ty);
+}
+
+static bool is_float_const(Node *node)
+{
+    return node->kind == ND_NUM && is_flonum(node->ty);
+}
+
+// Converts an integer to a given integer type.
+static int64_t normalize(uint64_t val, Type *ty)
+{
+    if (ty->kind == TY_BOOL)
+    {
+        return val != 0;
+    }
+    switch (ty->size)
+    {
+    case 1:
+        return ty->is_unsigned ? (uint8_t)val : (int8_t)val;
+    case 2:
+        return ty->is_unsigned ? (uint16_t)val : (int16_t)val;
+    case 4:
+        return ty->is_unsigned ? (int64_t)(uint32_t)val : (int32_t)val;
+    }
+    return val;
+}
+
+// Returns the type an integer operand is promoted to. `~` and shifts
+// keep the type of their left operand in the AST, but compute on it
+// after promotion.
+static Type *promoted(Type *ty)
+{
+    return (is_integer(ty) && ty->size < 4) ? ty_int : ty;
+}
+
+static Node *new_int(uint64_t val, Type *ty, Token *tok)
+{
+    Node *node = arena_alloc(&ast_arena, sizeof(Node));
+    node->kind = ND_NUM;
+    node->tok = tok;
+    node->ty = ty;
+    node->val = normalize(val, ty);
+    return node;
+}
+
+static Node *new_float(double val, Type *ty, Token *tok)
+{
+    Node *node = arena_alloc(&ast_arena, sizeof(Node));
+    node->kind = ND_NUM;
+    node->tok = tok;
+    node->ty = ty;
+    node->fval = (ty->kind == TY_FLOAT) ? (float)val : val;
+    return node;
+}
+
+// Returns true if evaluating a given expression has no effect other
+// than computing its value.
+static bool is_pure(Node *node)
+{
+    switch (node->kind)
+    {
+    case ND_NUM:
+    case ND_VAR:
+        return true;
+    case ND_CAST:
+    case ND_NEG:
+    case ND_BITNOT:
+    case ND_NOT:
+    case ND_MEMBER:
+        return is_pure(node->lhs);
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_BITAND:
+    case ND_BITOR:
+    case ND_BITXOR:
+    case ND_SHL:
+    case ND_SHR:
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+        return is_pure(node->lhs) && is_pure(node->rhs);
+    }
+    return false;
+}
+
+// Returns true if a statement contains a label that a jump from
+// outside of it may reach.
+static bool has_labels(Node *node, bool cases)
+{
+    if (!node)
+    {
+        return false;
+    }
+    if (node->kind == ND_LABEL || (cases && node->kind == ND_CASE))
+    {
+        return true;
+    }
+
+    // Cases of a nested switch belong to it.
+    if (node->kind == ND_SWITCH)
+    {
+        cases = false;
+    }
+
+    if (has_labels(node->lhs, cases) || has_labels(node->rhs, cases) || has_labels(node->cond, cases) ||
+        has_labels(node->then, cases) || has_labels(node->els, cases) || has_labels(node->init, cases) ||
+        has_labels(node->inc, cases))
+    {
+        return true;
+    }
+    for (Node *n = node->body; n; n = n->next)
+    {
+        if (has_labels(n, cases))
+        {
+            return true;
+        }
+    }
+    for (Node *n = node->args; n; n = n->next)
+    {
+        if (has_labels(n, cases))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Evaluates a binary operator on two integer constants. Returns false
+// if the result is undefined, leaving the operation to run time.
+static bool eval_int(NodeKind kind, Type *ty, uint64_t a, uint64_t b, uint64_t *val)
+{
+    bool u = ty->is_unsigned;
+
+    switch (kind)
+    {
+    case ND_ADD:
+        *val = a + b;
+        return true;
+    case ND_SUB:
+        *val = a - b;
+        return true;
+    case ND_MUL:
+        *val = a * b;
+        return true;
+    case ND_DIV:
+    case ND_MOD:
+        if (b == 0 || (!u && (int64_t)a == INT64_MIN && (int64_t)b == -1))
+        {
+            return false;
+        }
+        if (u)
+        {
+            *val = (kind == ND_DIV) ? a / b : a % b;
+        }
+        else
+        {
+            *val = (kind == ND_DIV) ? (int64_t)a / (int64_t)b : (int64_t)a % (int64_t)b;
+        }
+        return true;
+    case ND_BITAND:
+        *val = a & b;
+        return true;
+    case ND_BITOR:
+        *val = a | b;
+        return true;
+    case ND_BITXOR:
+        *val = a ^ b;
+        return true;
+    case ND_SHL:
+    case ND_SHR:
+        if (b >= ty->size * 8)
+        {
+            return false;
+        }
+        if (kind == ND_SHL)
+        {
+            *val = a << b;
+        }
+        else
+        {
+            *val = u ? a >> b : (uint64_t)((int64_t)a >> b);
+        }
+        return true;
+    case ND_EQ:
+        *val = a == b;
+        return true;
+    case ND_NE:
+        *val = a != b;
+        return true;
+    case ND_LT:
+        *val = u ? a < b : (int64_t)a < (int64_t)b;
+        return true;
+    case ND_LE:
+        *val = u ? a <= b : (int64_t)a <= (int64_t)b;
+        return true;
+    }
+    return false;
+}
+
+static Node *fold_binary(Node *node)
+{
+    Node *lhs = node->lhs;
+    Node *rhs = node->rhs;
+    Token *tok = node->tok;
+
+    if (is_int_const(lhs) && is_int_const(rhs) && is_integer(node->ty))
+    {
+        uint64_t val;
+        if (node->kind == ND_SHL || node->kind == ND_SHR)
+        {
+            Type *ty = promoted(lhs->ty);
+            if (eval_int(node->kind, ty, lhs->val, rhs->val, &val))
+            {
+                return new_int(val, ty, tok);
+            }
+            return node;
+        }
+        if (eval_int(node->kind, lhs->ty, lhs->val, rhs->val, &val))
+        {
+            return new_int(val, node->ty, tok);
+        }
+        return node;
+    }
+
+    if (is_float_const(lhs) && is_float_const(rhs))
+    {
+        double a = lhs->fval;
+        double b = rhs->fval;
+        switch (node->kind)
+        {
+        case ND_ADD:
+            return new_float(a + b, node->ty, tok);
+        case ND_SUB:
+            return new_float(a - b, node->ty, tok);
+        case ND_MUL:
+            return new_float(a * b, node->ty, tok);
+        case ND_DIV:
+            return new_float(a / b, node->ty, tok);
+        case ND_EQ:
+            return new_int(a == b, node->ty, tok);
+        case ND_NE:
+            return new_int(a != b, node->ty, tok);
+        case ND_LT:
+            return new_int(a < b, node->ty, tok);
+        case ND_LE:
+            return new_int(a <= b, node->ty, tok);
+        }
+        return node;
+    }
+
+    if (!is_integer(node->ty))
+    {
+        // x*1.0 and x/1.0 are exact, unlike x+0.0 which turns -0.0
+        // into +0.0.
+        if (is_flonum(node->ty) && is_float_const(rhs) && rhs->fval == 1 &&
+            (node->kind == ND_MUL || node->kind == ND_DIV) && same_type(lhs->ty, node->ty))
+        {
+            return lhs;
+        }
+        return node;
+    }
+
+    // Put the constant of a commutative operator on the right, where
+    // the code generator can use it as an immediate.
+    switch (node->kind)
+    {
+    case ND_ADD:
+    case ND_MUL:
+    case ND_BITAND:
+    case ND_BITOR:
+    case ND_BITXOR:
+        if (is_int_const(lhs) && !is_int_const(rhs))
+        {
+            node->lhs = rhs;
+            node->rhs = lhs;
+            lhs = node->lhs;
+            rhs = node->rhs;
+        }
+    }
+
+    if (!is_int_const(rhs) || !same_type(lhs->ty, node->ty))
+    {
+        return node;
+    }
+    uint64_t c = rhs->val;
+
+    // Reassociate (x op c1) op c2 to x op (c1 op c2).
+    NodeKind k = node->kind;
+    NodeKind k2 = lhs->kind;
+    if (lhs->lhs && lhs->rhs && is_int_const(lhs->rhs) && same_type(lhs->ty, node->ty) &&
+        same_type(lhs->lhs->ty, node->ty))
+    {
+        uint64_t c1 = lhs->rhs->val;
+        if ((k == ND_ADD || k == ND_SUB) && (k2 == ND_ADD || k2 == ND_SUB))
+        {
+            uint64_t sum = ((k2 == ND_ADD) ? c1 : -c1) + ((k == ND_ADD) ? c : -c);
+            node->kind = ND_ADD;
+            node->lhs = lhs->lhs;
+            node->rhs = new_int(sum, node->ty, tok);
+            return fold_binary(node);
+        }
+        if (k == k2 && (k == ND_MUL || k == ND_BITAND || k == ND_BITOR || k == ND_BITXOR))
+        {
+            uint64_t val;
+            eval_int(k, node->ty, c1, c, &val);
+            node->lhs = lhs->lhs;
+            node->rhs = new_int(val, node->ty, tok);
+            return fold_binary(node);
+        }
+    }
+
+    switch (k)
+    {
+    case ND_ADD:
+    case ND_SUB:
+    case ND_BITOR:
+    case ND_BITXOR:
+    case ND_SHL:
+    case ND_SHR:
+        if (c == 0)
+        {
+            return lhs;
+        }
+        break;
+    case ND_MUL:
+        if (c == 1)
+        {
+            return lhs;
+        }
+        if (c == 0 && is_pure(lhs))
+        {
+            return rhs;
+        }
+        break;
+    case ND_DIV:
+        if (c == 1)
+        {
+            return lhs;
+        }
+        break;
+    case ND_BITAND:
+        if (c == normalize(-1, node->ty))
+        {
+            return lhs;
+        }
+        if (c == 0 && is_pure(lhs))
+        {
+            return rhs;
+        }
+        break;
+    }
+    return node;
+}
+
+static Node *fold_cast(Node *node)
+{
+    Node *lhs = node->lhs;
+    Type *ty = node->ty;
+
+    if (is_numeric(ty) && same_type(lhs->ty, ty))
+    {
+        return lhs;
+    }
+
+    if (is_int_const(lhs))
+    {
+        uint64_t val = lhs->val;
+        if (is_integer(ty))
+        {
+            return new_int(val, ty, node->tok);
+        }
+        if (ty->kind == TY_FLOAT)
+        {
+            return new_float(lhs->ty->is_unsigned ? (float)val : (float)(int64_t)val, ty, node->tok);
+        }
+        if (ty->kind == TY_DOUBLE)
+        {
+            return new_float(lhs->ty->is_unsigned ? (double)val : (double)(int64_t)val, ty, node->tok);
+        }
+        return node;
+    }
+
+    if (is_float_const(lhs))
+    {
+        double val = lhs->fval;
+        if (ty->kind == TY_BOOL)
+        {
+            return new_int(val != 0, ty, node->tok);
+        }
+        if (is_flonum(ty))
+        {
+            return new_float(val, ty, node->tok);
+        }
+
+        // Out-of-range conversions are undefined. Only fold those
+        // that any integer type can represent.
+        if (is_integer(ty) && -2147483648.0 < val && val < 2147483648.0 && (!ty->is_unsigned || val > -1))
+        {
+            return new_int((int64_t)val, ty, node->tok);
+        }
+    }
+    return node;
+}
+
+static Node *fold_expr(Node *node)
+{
+    if (!node)
+    {
+        return NULL;
+    }
+
+    switch (node->kind)
+    {
+    case ND_STMT_EXPR:
+        for (Node *n = node->body; n; n = n->next)
+        {
+            fold_stmt(n);
+        }
+        return node;
+    case ND_FUNCALL:
+        for (Node **p = &node->args; *p; p = &(*p)->next)
+        {
+            Node *next = (*p)->next;
+            *p = fold_expr(*p);
+            (*p)->next = next;
+        }
+        return node;
+    }
+
+    node->lhs = fold_expr(node->lhs);
+    node->rhs = fold_expr(node->rhs);
+    node->cond = fold_expr(node->cond);
+    node->then = fold_expr(node->then);
+    node->els = fold_expr(node->els);
+
+    Node *lhs = node->lhs;
+    Token *tok = node->tok;
+
+    switch (node->kind)
+    {
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_MOD:
+    case ND_BITAND:
+    case ND_BITOR:
+    case ND_BITXOR:
+    case ND_SHL:
+    case ND_SHR:
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+        return fold_binary(node);
+    case ND_CAST:
+        return fold_cast(node);
+    case ND_NEG:
+        if (is_int_const(lhs))
+        {
+            return new_int(-(uint64_t)lhs->val, node->ty, tok);
+        }
+        if (is_float_const(lhs))
+        {
+            return new_float(-lhs->fval, node->ty, tok);
+        }
+        return node;
+    case ND_BITNOT:
+        if (is_int_const(lhs))
+        {
+            return new_int(~lhs->val, promoted(node->ty), tok);
+        }
+        return node;
+    case ND_NOT:
+        if (is_int_const(lhs))
+        {
+            return new_int(!lhs->val, node->ty, tok);
+        }
+        if (is_float_const(lhs))
+        {
+            return new_int(!lhs->fval, node->ty, tok);
+        }
+        return node;
+    case ND_LOGAND:
+    case ND_LOGOR:
+    {
+        // The right-hand side is not evaluated if the left-hand side
+        // decides the result.
+        if (!is_int_const(lhs))
+        {
+            return node;
+        }
+        bool decides = (node->kind == ND_LOGAND) ? !lhs->val : lhs->val;
+        if (decides)
+        {
+            return new_int(node->kind == ND_LOGOR, node->ty, tok);
+        }
+        if (is_int_const(node->rhs))
+        {
+            return new_int(node->rhs->val != 0, node->ty, tok);
+        }
+        return node;
+    }
+    case ND_COND:
+    {
+        if (!is_int_const(node->cond))
+        {
+            return node;
+        }
+        Node *taken = node->cond->val ? node->then : node->els;
+        if (node->ty->kind != TY_VOID && !same_type(taken->ty, node->ty))
+        {
+            return node;
+        }
+        return taken;
+    }
+    case ND_COMMA:
+        if (lhs->kind == ND_NUM)
+        {
+            return node->rhs;
+        }
+        return node;
+    }
+    return node;
+}
+
+static void fold_stmt(Node *node)
+{
+    if (!node)
+    {
+        return;
+    }
+
+    switch (node->kind)
+    {
+    case ND_IF:
+    {
+        node->cond = fold_expr(node->cond);
+        fold_stmt(node->then);
+        fold_stmt(node->els);
+        if (!is_int_const(node->cond))
+        {
+            return;
+        }
+
+        Node *taken = node->cond->val ? node->then : node->els;
+        Node *dead = node->cond->val ? node->els : node->then;
+        if (has_labels(dead, true))
+        {
+            return;
+        }
+        node->kind = ND_BLOCK;
+        node->body = taken;
+        node->cond = node->then = node->els = NULL;
+        return;
+    }
+    case ND_LOOP:
+        fold_stmt(node->init);
+        node->cond = fold_expr(node->cond);
+        node->inc = fold_expr(node->inc);
+        fold_stmt(node->then);
+        if (!node->cond || !is_int_const(node->cond))
+        {
+            return;
+        }
+        if (node->cond->val)
+        {
+            node->cond = NULL;
+            return;
+        }
+        if (!has_labels(node->then, true))
+        {
+            // Only the initializer runs.
+            node->kind = ND_BLOCK;
+            node->body = node->init;
+            node->cond = node->init = node->inc = node->then = NULL;
+        }
+        return;
+    case ND_DO:
+        fold_stmt(node->then);
+        node->cond = fold_expr(node->cond);
+        return;
+    case ND_SWITCH:
+        node->cond = fold_expr(node->cond);
+        fold_stmt(node->then);
+        return;
+    case ND_CASE:
+    case ND_LABEL:
+        fold_stmt(node->lhs);
+        return;
+    case ND_BLOCK:
+        for (Node *n = node->body; n; n = n->next)
+        {
+            fold_stmt(n);
+        }
+        return;
+    case ND_RETURN:
+    case ND_EXPR_STMT:
+        node->lhs = fold_expr(node->lhs);
+        return;
+    }
+}
+
+void fold_constants(Var *prog)
+{
+    for (Var *fn = prog; fn; fn = fn->next)
+    {
+        if (fn->is_function && fn->is_definition)
+        {
+            fold_stmt(fn->body);
+        }
+    }
+}
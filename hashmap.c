@@ -0,0 +1,154 @@
+#include "zcc.h"
+
+// An open-addressing hash table with linear probing, keyed by strings
+// that need not be NUL-terminated, or by pointers. Pointer keys are
+// stored with keylen -1 and are hashed and compared by address, which
+// is what tables keyed by interned strings want.
+
+#define INIT_SIZE 16
+
+// Rehash if the usage exceeds 70%.
+#define HIGH_WATERMARK 70
+
+static uint64_t fnv_hash(char *s, int len)
+{
+    uint64_t hash = 0xcbf29ce484222325;
+    for (int i = 0; i < len; i++)
+    {
+        hash *= 0x100000001b3;
+        hash ^= (unsigned char)s[i];
+    }
+    return hash;
+}
+
+static uint64_t hash_key(char *key, int keylen)
+{
+    if (keylen < 0)
+    {
+        uint64_t hash = (uintptr_t)key;
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccd;
+        hash ^= hash >> 33;
+        return hash;
+    }
+    return fnv_hash(key, keylen);
+}
+
+static bool match(HashEntry *ent, char *key, int keylen)
+{
+    if (keylen < 0)
+    {
+        return ent->key == key;
+    }
+    return ent->keylen == keylen && !memcmp(ent->key, key, keylen);
+}
+
+static HashEntry *get_entry(HashMap *map, char *key, int keylen)
+{
+    if (!map->buckets)
+    {
+        return NULL;
+    }
+
+    uint64_t hash = hash_key(key, keylen);
+
+    for (int i = 0; i < map->capacity; i++)
+    {
+        HashEntry *ent = &map->buckets[(hash + i) & (map->capacity - 1)];
+        if (!ent->key)
+        {
+            return NULL;
+        }
+        if (match(ent, key, keylen))
+        {
+            return ent;
+        }
+    }
+    unreachable();
+}
+
+static void rehash(HashMap *map)
+{
+    int cap = map->capacity ? map->capacity * 2 : INIT_SIZE;
+
+    HashMap map2 = {};
+    map2.buckets = calloc(cap, sizeof(HashEntry));
+    map2.capacity = cap;
+
+    for (int i = 0; i < map->capacity; i++)
+    {
+        HashEntry *ent = &map->buckets[i];
+        if (ent->key)
+        {
+            hashmap_put2(&map2, ent->key, ent->keylen, ent->val);
+        }
+    }
+
+    free(map->buckets);
+    *map = map2;
+}
+
+static HashEntry *get_or_insert_entry(HashMap *map, char *key, int keylen)
+{
+    if (!map->buckets || map->used * 100 / map->capacity >= HIGH_WATERMARK)
+    {
+        rehash(map);
+    }
+
+    uint64_t hash = hash_key(key, keylen);
+
+    for (int i = 0; i < map->capacity; i++)
+    {
+        HashEntry *ent = &map->buckets[(hash + i) & (map->capacity - 1)];
+        if (!ent->key)
+        {
+            ent->key = key;
+            ent->keylen = keylen;
+            map->used++;
+            return ent;
+        }
+        if (match(ent, key, keylen))
+        {
+            return ent;
+        }
+    }
+    unreachable();
+}
+
+void *hashmap_get(HashMap *map, char *key)
+{
+    return hashmap_get2(map, key, strlen(key));
+}
+
+void *hashmap_get2(HashMap *map, char *key, int keylen)
+{
+    HashEntry *ent = get_entry(map, key, keylen);
+    return ent ? ent->val : NULL;
+}
+
+// Inserts or overwrites an entry. `key` must outlive the map.
+void hashmap_put(HashMap *map, char *key, void *val)
+{
+    hashmap_put2(map, key, strlen(key), val);
+}
+
+void hashmap_put2(HashMap *map, char *key, int keylen, void *val)
+{
+    get_or_insert_entry(map, key, keylen)->val = val;
+}
+
+void *hashmap_get_ptr(HashMap *map, void *key)
+{
+    return hashmap_get2(map, key, -1);
+}
+
+void hashmap_put_ptr(HashMap *map, void *key, void *val)
+{
+    hashmap_put2(map, key, -1, val);
+}
+
+void hashmap_free(HashMap *map)
+{
+    free(map->buckets);
+    *map = (HashMap){};
+}
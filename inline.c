@@ -0,0 +1,362 @@
+#include "zcc.h"
+
+// Function inliner.
+//
+// Runs on the IR after every function has been lowered. A call to a
+// small static function of the same translation unit is replaced with
+// a copy of the callee's blocks: its virtual registers are renumbered
+// and its local variables become locals of the caller. Parameters are
+// assigned from the arguments on entry, and every `return` becomes a
+// move to the call's result followed by a jump to the code after the
+// call. Block labels are unique across the whole output, so copies
+// never clash with each other.
+
+// Largest callee, in IR instructions, that is copied into a caller
+#define INLINE_MAX_INSNS 40
+
+// Limit on the instructions added to any one caller
+#define INLINE_MAX_GROWTH 2000
+
+typedef struct InlinedCall InlinedCall;
+struct InlinedCall
+{
+    InlinedCall *next;
+    char *caller;
+    char *callee;
+    Token *tok;
+    int size;
+};
+
+static InlinedCall *inlined_calls;
+
+// Maps a callee's registers, variables and blocks to their copies
+typedef struct
+{
+    Var *caller;
+    Reg **regs;
+    HashMap vars;
+    HashMap bbs;
+} Copy;
+
+// Returns the number of instructions of a function, or INT32_MAX if
+// it cannot be copied. Jump tables are left alone since a function
+// can only have so many of them.
+static int count_insns(Var *fn)
+{
+    int n = 0;
+    for (BB *bb = fn->bbs; bb; bb = bb->next)
+    {
+        for (IR *ir = bb->ir; ir; ir = ir->next)
+        {
+            if (ir->op == IR_JTAB)
+            {
+                return INT32_MAX;
+            }
+            n++;
+        }
+    }
+    return n;
+}
+
+static bool is_scalar(Type *ty)
+{
+    return is_numeric(ty) || ty->kind == TY_PTR;
+}
+
+static bool can_inline(Var *caller, Var *callee, IR *call)
+{
+    if (!callee || callee == caller || !callee->is_function || !callee->is_definition ||
+        !callee->is_static || !callee->bbs)
+    {
+        return false;
+    }
+
+    Type *ty = callee->ty;
+    if (ty->is_variadic || (ty->return_ty->kind != TY_VOID && !is_scalar(ty->return_ty)))
+    {
+        return false;
+    }
+
+    // The arguments must match the parameters one to one.
+    int i = 0;
+    for (Var *param = callee->params; param; param = param->next, i++)
+    {
+        if (i == call->nargs || !is_scalar(param->ty) || is_flonum(param->ty) != call->args[i]->is_fp)
+        {
+            return false;
+        }
+    }
+    return i == call->nargs && count_insns(callee) <= INLINE_MAX_INSNS;
+}
+
+static Reg *copy_reg(Copy *c, Reg *r)
+{
+    if (!r)
+    {
+        return NULL;
+    }
+    if (!c->regs[r->vn])
+    {
+        c->regs[r->vn] = add_reg(c->caller, r->is_fp);
+    }
+    return c->regs[r->vn];
+}
+
+static Var *copy_var(Copy *c, Var *var)
+{
+    if (!var || !var->is_local)
+    {
+        return var;
+    }
+    return hashmap_get_ptr(&c->vars, var);
+}
+
+// Makes the locals of `callee` locals of the caller. They live as long
+// as the whole caller, so they never share a stack slot with another
+// variable.
+static void copy_locals(Copy *c, Var *callee)
+{
+    Var head = {};
+    Var *cur = &head;
+
+    for (Var *var = callee->locals; var; var = var->next)
+    {
+        Var *var2 = arena_alloc(&ir_arena, sizeof(Var));
+        *var2 = *var;
+        var2->offset = 0;
+        var2->scope_start = 0;
+        var2->scope_end = INT32_MAX;
+        if (var->reg)
+        {
+            var2->reg = copy_reg(c, var->reg);
+            var2->reg->var = var2;
+        }
+        hashmap_put_ptr(&c->vars, var, var2);
+        cur = cur->next = var2;
+    }
+
+    // Keep the callee's layout.
+    cur->next = c->caller->locals;
+    c->caller->locals = head.next;
+}
+
+static IR *copy_insn(Copy *c, IR *ir)
+{
+    IR *ir2 = arena_alloc(&ir_arena, sizeof(IR));
+    *ir2 = *ir;
+    ir2->next = NULL;
+    ir2->d = copy_reg(c, ir->d);
+    ir2->a = copy_reg(c, ir->a);
+    ir2->b = copy_reg(c, ir->b);
+    ir2->index = copy_reg(c, ir->index);
+    ir2->var = copy_var(c, ir->var);
+    ir2->bb1 = hashmap_get_ptr(&c->bbs, ir->bb1);
+    ir2->bb2 = hashmap_get_ptr(&c->bbs, ir->bb2);
+
+    if (ir->ntargets)
+    {
+        ir2->targets = arena_alloc(&ir_arena, ir->ntargets * sizeof(BB *));
+        for (int i = 0; i < ir->ntargets; i++)
+        {
+            ir2->targets[i] = hashmap_get_ptr(&c->bbs, ir->targets[i]);
+        }
+    }
+
+    if (ir->nargs)
+    {
+        ir2->args = arena_alloc(&ir_arena, ir->nargs * sizeof(Reg *));
+        for (int i = 0; i < ir->nargs; i++)
+        {
+            ir2->args[i] = copy_reg(c, ir->args[i]);
+        }
+    }
+    return ir2;
+}
+
+// Replaces `call`, the instruction after `prev` in `bb`, with the body
+// of `callee`. Returns the last block of the copy.
+static BB *inline_call(Var *caller, Var *callee, BB *bb, IR *prev, IR *call)
+{
+    Copy c = {.caller = caller};
+    c.regs = calloc(callee->nregs, sizeof(Reg *));
+    copy_locals(&c, callee);
+
+    // The code after the call moves to a block of its own.
+    BB *cont = new_bb();
+    cont->ir = call->next;
+    cont->last = bb->last;
+    cont->next = bb->next;
+
+    if (prev)
+    {
+        prev->next = NULL;
+        bb->last = prev;
+    }
+    else
+    {
+        bb->ir = bb->last = NULL;
+    }
+
+    for (BB *b = callee->bbs; b; b = b->next)
+    {
+        hashmap_put_ptr(&c.bbs, b, new_bb());
+    }
+
+    // Pass arguments.
+    int i = 0;
+    for (Var *param = callee->params; param; param = param->next, i++)
+    {
+        Var *var = copy_var(&c, param);
+        IR *ir;
+        if (var->reg)
+        {
+            ir = alloc_ir(IR_MOV, param->ty, call->tok);
+            ir->d = var->reg;
+            ir->a = call->args[i];
+        }
+        else
+        {
+            ir = alloc_ir(IR_STORE, param->ty, call->tok);
+            ir->var = var;
+            ir->b = call->args[i];
+        }
+        append_ir(bb, ir);
+    }
+
+    IR *jmp = alloc_ir(IR_JMP, ty_void, call->tok);
+    jmp->bb1 = hashmap_get_ptr(&c.bbs, callee->bbs);
+    append_ir(bb, jmp);
+
+    // Copy the body.
+    BB *last = bb;
+    for (BB *b = callee->bbs; b; b = b->next)
+    {
+        BB *b2 = hashmap_get_ptr(&c.bbs, b);
+        for (IR *ir = b->ir; ir; ir = ir->next)
+        {
+            if (ir->op != IR_RET)
+            {
+                append_ir(b2, copy_insn(&c, ir));
+                continue;
+            }
+
+            if (call->d && ir->a)
+            {
+                IR *mov = alloc_ir(IR_MOV, call->ty, ir->tok);
+                mov->d = call->d;
+                mov->a = copy_reg(&c, ir->a);
+                append_ir(b2, mov);
+            }
+            IR *jmp = alloc_ir(IR_JMP, ty_void, ir->tok);
+            jmp->bb1 = cont;
+            append_ir(b2, jmp);
+        }
+        last = last->next = b2;
+    }
+    last->next = cont;
+
+    free(c.regs);
+    hashmap_free(&c.vars);
+    hashmap_free(&c.bbs);
+    return last;
+}
+
+static void inline_calls(Var *fn, HashMap *funcs)
+{
+    int growth = 0;
+
+    for (BB *bb = fn->bbs; bb; bb = bb->next)
+    {
+        for (IR *prev = NULL, *ir = bb->ir; ir; prev = ir, ir = ir->next)
+        {
+            if (ir->op != IR_CALL)
+            {
+                continue;
+            }
+
+            Var *callee = hashmap_get(funcs, ir->funcname);
+            if (!can_inline(fn, callee, ir))
+            {
+                continue;
+            }
+
+            int size = count_insns(callee);
+            if (growth + size > INLINE_MAX_GROWTH)
+            {
+                continue;
+            }
+            growth += size;
+
+            InlinedCall *rec = arena_alloc(&ir_arena, sizeof(InlinedCall));
+            rec->caller = fn->name;
+            rec->callee = callee->name;
+            rec->tok = ir->tok;
+            rec->size = size;
+            rec->next = inlined_calls;
+            inlined_calls = rec;
+
+            // Calls in the copy are not inlined again, so that a
+            // recursive callee cannot expand without bound. The scan
+            // resumes at the code after the call.
+            bb = inline_call(fn, callee, bb, prev, ir);
+            break;
+        }
+    }
+}
+
+void inline_functions(Var *prog)
+{
+    HashMap funcs = {};
+    int n = 0;
+    for (Var *fn = prog; fn; fn = fn->next)
+    {
+        if (fn->is_function && fn->is_definition)
+        {
+            hashmap_put(&funcs, fn->name, fn);
+            n++;
+        }
+    }
+
+    // `prog` lists functions in reverse. Visit them in the order they
+    // are defined so that helpers are expanded before their callers.
+    Var **fns = calloc(n, sizeof(Var *));
+    int i = n;
+    for (Var *fn = prog; fn; fn = fn->next)
+    {
+        if (fn->is_function && fn->is_definition)
+        {
+            fns[--i] = fn;
+        }
+    }
+    for (i = 0; i < n; i++)
+    {
+        inline_calls(fns[i], &funcs);
+    }
+
+    free(fns);
+    hashmap_free(&funcs);
+}
+
+void inline_report(FILE *out)
+{
+    // Records were prepended, so print them back to front.
+    int n = 0;
+    for (InlinedCall *rec = inlined_calls; rec; rec = rec->next)
+    {
+        n++;
+    }
+    InlinedCall **recs = calloc(n, sizeof(InlinedCall *));
+    int i = n;
+    for (InlinedCall *rec = inlined_calls; rec; rec = rec->next)
+    {
+        recs[--i] = rec;
+    }
+
+    fprintf(out, "%-24s %-24s %6s %6s\n", "caller", "callee", "line", "insns");
+    for (i = 0; i < n; i++)
+    {
+        fprintf(out, "%-24s %-24s %6d %6d\n", recs[i]->caller, recs[i]->callee, recs[i]->tok->line_no,
+                recs[i]->size);
+    }
+    free(recs);
+}
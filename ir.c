@@ -0,0 +1,1733 @@
+#include "zcc.h"
+
+// This file lowers the AST of a function to a list of basic blocks
+// of three-address instructions operating on an unlimited number of
+// virtual registers. The register allocator then maps the virtual
+// registers to real ones.
+//
+// With -O1, scalar local variables whose address is never taken are
+// kept in virtual registers for their whole lifetime instead of in
+// memory.
+
+static Var *current_fn;
+static BB *out;
+static BB *last_bb;
+static int nregs;
+static HashMap labels;
+
+static Reg *gen_expr(Node *node);
+static Reg *gen_addr(Node *node);
+static void gen_stmt(Node *node);
+static void gen_cond(Node *node, BB *then, BB *els);
+
+static Reg *new_reg(bool is_fp)
+{
+    Reg *r = arena_alloc(&ir_arena, sizeof(Reg));
+    r->vn = nregs++;
+    r->is_fp = is_fp;
+    r->rn = -1;
+    return r;
+}
+
+static Reg *new_reg_for(Type *ty)
+{
+    return new_reg(is_flonum(ty));
+}
+
+BB *new_bb(void)
+{
+    static int label = 1;
+    BB *bb = arena_alloc(&ir_arena, sizeof(BB));
+    bb->label = label++;
+    return bb;
+}
+
+static bool is_terminated(BB *bb)
+{
+    if (!bb->last)
+    {
+        return false;
+    }
+    IROp op = bb->last->op;
+    return op == IR_JMP || op == IR_BR || op == IR_CBR || op == IR_JTAB || op == IR_RET || op == IR_TAILCALL;
+}
+
+// The following helpers are for passes that rewrite the IR of a
+// function after it has been lowered.
+
+// Returns a new virtual register of a lowered function.
+Reg *add_reg(Var *fn, bool is_fp)
+{
+    Reg *r = arena_alloc(&ir_arena, sizeof(Reg));
+    r->vn = fn->nregs++;
+    r->is_fp = is_fp;
+    r->rn = -1;
+    return r;
+}
+
+IR *alloc_ir(IROp op, Type *ty, Token *tok)
+{
+    IR *ir = arena_alloc(&ir_arena, sizeof(IR));
+    ir->op = op;
+    ir->ty = ty;
+    ir->tok = tok;
+    return ir;
+}
+
+void append_ir(BB *bb, IR *ir)
+{
+    if (bb->last)
+    {
+        bb->last->next = ir;
+    }
+    else
+    {
+        bb->ir = ir;
+    }
+    bb->last = ir;
+}
+
+static IR *new_ir(IROp op, Token *tok)
+{
+    IR *ir = arena_alloc(&ir_arena, sizeof(IR));
+    ir->op = op;
+    ir->tok = tok;
+
+    if (out->last)
+    {
+        out->last = out->last->next = ir;
+    }
+    else
+    {
+        out->ir = out->last = ir;
+    }
+    return ir;
+}
+
+static IR *emit(IROp op, Type *ty, Reg *d, Reg *a, Reg *b, Token *tok)
+{
+    IR *ir = new_ir(op, tok);
+    ir->ty = ty;
+    ir->d = d;
+    ir->a = a;
+    ir->b = b;
+    return ir;
+}
+
+static void jmp(BB *bb, Token *tok)
+{
+    IR *ir = new_ir(IR_JMP, tok);
+    ir->bb1 = bb;
+}
+
+static void br(Reg *cond, Type *ty, BB *then, BB *els, Token *tok)
+{
+    IR *ir = emit(IR_BR, ty, NULL, cond, NULL, tok);
+    ir->bb1 = then;
+    ir->bb2 = els;
+}
+
+// Branches on a comparison without materializing its result.
+static IR *cbr(IROp cmp, Type *ty, Reg *a, Reg *b, BB *then, BB *els, Token *tok)
+{
+    IR *ir = emit(IR_CBR, ty, NULL, a, b, tok);
+    ir->cmp = cmp;
+    ir->bb1 = then;
+    ir->bb2 = els;
+    return ir;
+}
+
+static bool is_imm32(int64_t val)
+{
+    return val == (int32_t)val;
+}
+
+// Emits `d = a op val` with an immediate operand.
+static IR *emit_imm(IROp op, Type *ty, Reg *d, Reg *a, int64_t val, Token *tok)
+{
+    IR *ir = emit(op, ty, d, a, NULL, tok);
+    ir->imm = val;
+    return ir;
+}
+
+// Starts emitting instructions to a given basic block. If the current
+// block has no terminator, it falls through to the new one.
+static void set_bb(BB *bb, Token *tok)
+{
+    if (!is_terminated(out))
+    {
+        jmp(bb, tok);
+    }
+    last_bb = last_bb->next = bb;
+    out = bb;
+}
+
+// Returns the basic block for a label such as a goto target or a
+// break/continue destination.
+static BB *label_bb(char *label)
+{
+    BB *bb = hashmap_get_ptr(&labels, label);
+    if (!bb)
+    {
+        bb = new_bb();
+        hashmap_put_ptr(&labels, label, bb);
+    }
+    return bb;
+}
+
+static Reg *imm(int64_t val, Token *tok)
+{
+    Reg *r = new_reg(false);
+    IR *ir = emit(IR_IMM, ty_long, r, NULL, NULL, tok);
+    ir->imm = val;
+    return r;
+}
+
+static Reg *zero(Type *ty, Token *tok)
+{
+    if (is_flonum(ty))
+    {
+        Reg *r = new_reg(true);
+        IR *ir = emit(IR_FIMM, ty, r, NULL, NULL, tok);
+        ir->fimm = 0;
+        return r;
+    }
+    return imm(0, tok);
+}
+
+static bool is_scalar(Type *ty)
+{
+    return is_numeric(ty) || ty->kind == TY_PTR;
+}
+
+// Arguments are evaluated from right to left.
+static void gen_args(Node *arg, Reg **args)
+{
+    if (arg)
+    {
+        gen_args(arg->next, args + 1);
+        *args = gen_expr(arg);
+    }
+}
+
+static Reg *gen_funcall(Node *node)
+{
+    int nargs = 0;
+    for (Node *arg = node->args; arg; arg = arg->next)
+    {
+        nargs++;
+    }
+
+    Reg **args = arena_alloc(&ir_arena, nargs * sizeof(Reg *));
+    gen_args(node->args, args);
+
+    Reg *d = (node->ty->kind == TY_VOID) ? NULL : new_reg_for(node->ty);
+    IR *ir = emit(IR_CALL, node->ty, d, NULL, NULL, node->tok);
+    ir->funcname = node->funcname;
+    ir->args = args;
+    ir->nargs = nargs;
+    return d;
+}
+
+static IROp binary_op(NodeKind kind)
+{
+    switch (kind)
+    {
+    case ND_ADD:
+        return IR_ADD;
+    case ND_SUB:
+        return IR_SUB;
+    case ND_MUL:
+        return IR_MUL;
+    case ND_DIV:
+        return IR_DIV;
+    case ND_MOD:
+        return IR_MOD;
+    case ND_BITAND:
+        return IR_BITAND;
+    case ND_BITOR:
+        return IR_BITOR;
+    case ND_BITXOR:
+        return IR_BITXOR;
+    case ND_SHL:
+        return IR_SHL;
+    case ND_SHR:
+        return IR_SHR;
+    case ND_EQ:
+        return IR_EQ;
+    case ND_NE:
+        return IR_NE;
+    case ND_LT:
+        return IR_LT;
+    case ND_LE:
+        return IR_LE;
+    }
+    return -1;
+}
+
+// Returns true if integers of two types of the same size have the same
+// bits in a register. A char or short is kept extended to 32 bits
+// according to its own signedness, so changing that needs a cast.
+static bool same_repr(Type *from, Type *to)
+{
+    return from->size == to->size && (from->size >= 4 || from->is_unsigned == to->is_unsigned);
+}
+
+// Returns true if a value of type `from` is already a valid value of
+// type `to`. 32-bit operations ignore the upper half of a register,
+// so truncating a 64-bit value to 32 bits is free.
+static bool is_nop_cast(Type *from, Type *to)
+{
+    if (is_flonum(from) || is_flonum(to))
+    {
+        return from->kind == to->kind;
+    }
+    if (to->kind == TY_BOOL)
+    {
+        return false;
+    }
+    if (!is_scalar(from))
+    {
+        return to->size == 8;
+    }
+    return same_repr(from, to) || (from->size == 8 && to->size == 4);
+}
+
+// Returns true if a given expression is an integer constant. Its
+// value, converted to the type of the expression, is set to `val`.
+static bool const_operand(Node *node, int64_t *val)
+{
+    switch (node->kind)
+    {
+    case ND_NUM:
+        if (!is_integer(node->ty))
+        {
+            return false;
+        }
+        *val = node->val;
+        break;
+    case ND_SUB:
+    {
+        // Unary minus is parsed as `0 - x`.
+        int64_t lhs, rhs;
+        if (!is_integer(node->ty) || !const_operand(node->lhs, &lhs) || !const_operand(node->rhs, &rhs))
+        {
+            return false;
+        }
+        *val = (uint64_t)lhs - (uint64_t)rhs;
+        break;
+    }
+    case ND_CAST:
+        if (!const_operand(node->lhs, val))
+        {
+            return false;
+        }
+        break;
+    default:
+        return false;
+    }
+
+    Type *ty = node->ty;
+    if (ty->kind == TY_BOOL)
+    {
+        *val = (*val != 0);
+        return true;
+    }
+    if (!is_integer(ty) && ty->kind != TY_PTR)
+    {
+        return false;
+    }
+    switch (ty->size)
+    {
+    case 1:
+        *val = ty->is_unsigned ? (uint8_t)*val : (int8_t)*val;
+        break;
+    case 2:
+        *val = ty->is_unsigned ? (uint16_t)*val : (int16_t)*val;
+        break;
+    case 4:
+        *val = ty->is_unsigned ? (int64_t)(uint32_t)*val : (int32_t)*val;
+        break;
+    }
+    return true;
+}
+
+// Returns the local variable holding a given variable or member
+// access in memory, or NULL if it is not one. `offset` is set to the
+// offset of the value within the variable.
+static Var *mem_operand(Node *node, int *offset)
+{
+    switch (node->kind)
+    {
+    case ND_CAST:
+        // A cast that does not change bits
+        if ((is_integer(node->ty) || node->ty->kind == TY_PTR) &&
+            (is_integer(node->lhs->ty) || node->lhs->ty->kind == TY_PTR) &&
+            node->ty->kind != TY_BOOL && same_repr(node->lhs->ty, node->ty))
+        {
+            return mem_operand(node->lhs, offset);
+        }
+        return NULL;
+    case ND_VAR:
+        if (!node->var->is_local || node->var->reg)
+        {
+            return NULL;
+        }
+        *offset = 0;
+        return node->var;
+    case ND_MEMBER:
+    {
+        Var *var = mem_operand(node->lhs, offset);
+        if (var)
+        {
+            *offset += node->member->offset;
+        }
+        return var;
+    }
+    }
+    return NULL;
+}
+
+// Memory address of the form `base + index * scale + disp`, where
+// the base is either a register or a variable.
+typedef struct
+{
+    Reg *base;
+    Var *var;
+    Reg *index;
+    int scale;
+    int64_t disp;
+} Addr;
+
+static Addr gen_ptr_addr(Node *node);
+static IR *emit_binary(IROp op, Type *ty, Reg *d, Reg *a, Node *rhs, Token *tok);
+
+static IR *emit_mem(IROp op, Type *ty, Reg *d, Addr m, Reg *val, Token *tok)
+{
+    IR *ir = emit(op, ty, d, m.base, val, tok);
+    ir->var = m.var;
+    ir->index = m.index;
+    ir->scale = m.scale;
+    ir->imm = m.disp;
+    return ir;
+}
+
+// Computes an address into a register.
+static Reg *lea(Addr m, Token *tok)
+{
+    if (!m.var && !m.index && m.disp == 0)
+    {
+        return m.base;
+    }
+
+    Reg *r = new_reg(false);
+    if (m.var && !m.index && m.disp == 0)
+    {
+        IR *ir = emit(m.var->is_local ? IR_LADDR : IR_GADDR, ty_long, r, NULL, NULL, tok);
+        ir->var = m.var;
+        return r;
+    }
+    emit_mem(IR_LEA, ty_long, r, m, NULL, tok);
+    return r;
+}
+
+// Loads a value of a given type from an address. Arrays, structs and
+// unions are represented by their addresses, so nothing is loaded.
+static Reg *load(Addr m, Type *ty, Token *tok)
+{
+    if (!is_scalar(ty))
+    {
+        return lea(m, tok);
+    }
+
+    Reg *r = new_reg_for(ty);
+    emit_mem(IR_LOAD, ty, r, m, NULL, tok);
+    return r;
+}
+
+static void store(Addr m, Reg *val, Type *ty, Token *tok)
+{
+    if (ty->kind == TY_STRUCT || ty->kind == TY_UNION)
+    {
+        IR *ir = emit(IR_MEMCPY, ty, NULL, lea(m, tok), val, tok);
+        ir->imm = ty->size;
+        return;
+    }
+    emit_mem(IR_STORE, ty, NULL, m, val, tok);
+}
+
+// Returns the address of an lvalue without computing it into a
+// register, so that it can be used as a memory operand.
+static Addr gen_lvalue_addr(Node *node)
+{
+    switch (node->kind)
+    {
+    case ND_VAR:
+        if (node->var->reg)
+        {
+            error_tok(node->tok, "internal error: address of a register variable");
+        }
+        return (Addr){.var = node->var};
+    case ND_DEREF:
+        return gen_ptr_addr(node->lhs);
+    case ND_COMMA:
+        gen_expr(node->lhs);
+        return gen_lvalue_addr(node->rhs);
+    case ND_MEMBER:
+    {
+        Addr m = gen_lvalue_addr(node->lhs);
+        m.disp += node->member->offset;
+        return m;
+    }
+    }
+
+    error_tok(node->tok, "not an lvalue");
+}
+
+static Reg *gen_addr(Node *node)
+{
+    return lea(gen_lvalue_addr(node), node->tok);
+}
+
+// Skips casts that do not change a 64-bit value, such as the ones
+// between pointers and longs.
+static Node *skip_addr_casts(Node *node)
+{
+    while (node->kind == ND_CAST && node->ty->size == 8 && !is_flonum(node->ty) &&
+           (node->lhs->ty->kind == TY_ARRAY || (node->lhs->ty->size == 8 && !is_flonum(node->lhs->ty))))
+    {
+        node = node->lhs;
+    }
+    return node;
+}
+
+// Returns the address a pointer expression evaluates to. Pointer
+// arithmetic `p + i * size` becomes a scaled index if the size is 1,
+// 2, 4 or 8, and constant offsets are folded into the displacement.
+static Addr gen_ptr_addr(Node *node)
+{
+    node = skip_addr_casts(node);
+
+    // The value of an array is its address.
+    if (node->ty->kind == TY_ARRAY &&
+        (node->kind == ND_VAR || node->kind == ND_MEMBER || node->kind == ND_DEREF))
+    {
+        return gen_lvalue_addr(node);
+    }
+
+    if ((node->kind == ND_ADD || node->kind == ND_SUB) && node->ty->base)
+    {
+        Node *rhs = skip_addr_casts(node->rhs);
+        int64_t size, val;
+
+        if (rhs->kind == ND_MUL && const_operand(rhs->rhs, &size))
+        {
+            Addr m = gen_ptr_addr(node->lhs);
+            bool is_const = const_operand(rhs->lhs, &val);
+
+            if (is_const && is_imm32(val) && is_imm32(val * size))
+            {
+                int64_t disp = m.disp + ((node->kind == ND_ADD) ? val * size : -val * size);
+                if (is_imm32(disp))
+                {
+                    m.disp = disp;
+                    return m;
+                }
+            }
+            else if (node->kind == ND_ADD && !is_const &&
+                     (size == 1 || size == 2 || size == 4 || size == 8))
+            {
+                // An index can only be added to a register or a local
+                // variable.
+                if (m.index || (m.var && !m.var->is_local))
+                {
+                    m = (Addr){.base = lea(m, node->tok)};
+                }
+                m.index = gen_expr(rhs->lhs);
+                m.scale = size;
+                return m;
+            }
+
+            Reg *base = lea(m, node->tok);
+            Reg *r = new_reg(false);
+            emit(binary_op(node->kind), ty_long, r, base, gen_expr(rhs), node->tok);
+            return (Addr){.base = r};
+        }
+
+        Reg *a = gen_expr(node->lhs);
+        Reg *r = new_reg(false);
+        emit_binary(binary_op(node->kind), ty_long, r, a, node->rhs, node->tok);
+        return (Addr){.base = r};
+    }
+
+    return (Addr){.base = gen_expr(node)};
+}
+
+// Emits `d = a op rhs` where `ty` is the type of both operands. A
+// constant or a local variable on the right-hand side is used as an
+// operand directly instead of being loaded into a register first.
+static IR *emit_binary(IROp op, Type *ty, Reg *d, Reg *a, Node *rhs, Token *tok)
+{
+    bool is_div = (op == IR_DIV || op == IR_MOD);
+    bool is_shift = (op == IR_SHL || op == IR_SHR);
+    bool is_cmp = (op == IR_EQ || op == IR_NE || op == IR_LT || op == IR_LE || op == IR_CBR);
+
+    int64_t val;
+    if (!is_div && !is_flonum(ty) && const_operand(rhs, &val))
+    {
+        // A 32-bit operation only sees the lower half of the constant.
+        if (ty->size <= 4)
+        {
+            val = (int32_t)val;
+        }
+        if (is_imm32(val))
+        {
+            return emit_imm(op, ty, d, a, val, tok);
+        }
+    }
+
+    // ucomis takes its memory operand on the other side, and shifts
+    // count by %cl only.
+    int offset;
+    Var *var = mem_operand(rhs, &offset);
+    if (var && !is_shift && !(is_cmp && is_flonum(ty)) && is_scalar(rhs->ty) &&
+        rhs->ty->size == ty->size && is_flonum(rhs->ty) == is_flonum(ty))
+    {
+        IR *ir = emit_imm(op, ty, d, a, offset, tok);
+        ir->var = var;
+        return ir;
+    }
+
+    return emit(op, ty, d, a, gen_expr(rhs), tok);
+}
+
+// Emits `a op val` into a new register.
+static Reg *binary_imm(IROp op, Type *ty, Reg *a, int64_t val, Token *tok)
+{
+    Reg *r = new_reg(false);
+    if (is_imm32(val))
+    {
+        emit_imm(op, ty, r, a, val, tok);
+    }
+    else
+    {
+        emit(op, ty, r, a, imm(val, tok), tok);
+    }
+    return r;
+}
+
+static Reg *binary_reg(IROp op, Type *ty, Reg *a, Reg *b, Token *tok)
+{
+    Reg *r = new_reg(false);
+    emit(op, ty, r, a, b, tok);
+    return r;
+}
+
+// Computes the magic number and the shift amount for signed division
+// by `d` at `bits` bits (Hacker's Delight, Figure 10-1). All values
+// are kept modulo 2^bits.
+static void signed_magic(int64_t d, int bits, int64_t *magic, int *shift)
+{
+    uint64_t mask = (bits == 64) ? ~0ULL : (1ULL << bits) - 1;
+    uint64_t two = 1ULL << (bits - 1);
+    uint64_t ad = (d < 0) ? -(uint64_t)d & mask : d;
+    uint64_t t = two + ((uint64_t)d >> 63);
+    uint64_t anc = t - 1 - t % ad;
+    uint64_t q1 = two / anc, r1 = two - q1 * anc;
+    uint64_t q2 = two / ad, r2 = two - q2 * ad;
+    uint64_t delta;
+    int p = bits - 1;
+
+    do
+    {
+        p++;
+        q1 = (2 * q1) & mask;
+        r1 = (2 * r1) & mask;
+        if (r1 >= anc)
+        {
+            q1 = (q1 + 1) & mask;
+            r1 = (r1 - anc) & mask;
+        }
+        q2 = (2 * q2) & mask;
+        r2 = (2 * r2) & mask;
+        if (r2 >= ad)
+        {
+            q2 = (q2 + 1) & mask;
+            r2 = (r2 - ad) & mask;
+        }
+        delta = (ad - r2) & mask;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+
+    uint64_t m = (d < 0) ? -(q2 + 1) & mask : (q2 + 1) & mask;
+    *magic = (bits == 64) ? (int64_t)m : (int32_t)m;
+    *shift = p - bits;
+}
+
+// Computes the magic number and the shift amount for unsigned
+// division by `d` at `bits` bits (Hacker's Delight, Figure 10-2).
+// `add` is set if the magic number does not fit in `bits` bits.
+static void unsigned_magic(uint64_t d, int bits, int64_t *magic, int *shift, bool *add)
+{
+    uint64_t mask = (bits == 64) ? ~0ULL : (1ULL << bits) - 1;
+    uint64_t two = 1ULL << (bits - 1);
+    uint64_t nc = (mask - (-d & mask) % d) & mask;
+    uint64_t q1 = two / nc, r1 = two - q1 * nc;
+    uint64_t q2 = (two - 1) / d, r2 = (two - 1) - q2 * d;
+    uint64_t delta;
+    int p = bits - 1;
+    *add = false;
+
+    do
+    {
+        p++;
+        if (r1 >= nc - r1)
+        {
+            q1 = (2 * q1 + 1) & mask;
+            r1 = (2 * r1 - nc) & mask;
+        }
+        else
+        {
+            q1 = (2 * q1) & mask;
+            r1 = (2 * r1) & mask;
+        }
+        if (r2 + 1 >= d - r2)
+        {
+            if (q2 >= two - 1)
+            {
+                *add = true;
+            }
+            q2 = (2 * q2 + 1) & mask;
+            r2 = (2 * r2 + 1 - d) & mask;
+        }
+        else
+        {
+            if (q2 >= two)
+            {
+                *add = true;
+            }
+            q2 = (2 * q2) & mask;
+            r2 = (2 * r2 + 1) & mask;
+        }
+        delta = (d - 1 - r2) & mask;
+    } while (p < 2 * bits && (q1 < delta || (q1 == delta && r1 == 0)));
+
+    *magic = (int64_t)((q2 + 1) & mask);
+    *shift = p - bits;
+}
+
+// Lowers division and modulo by a nonzero constant. Powers of two
+// become shifts and masks, and other divisors become a multiplication
+// by a magic number, keeping the high half of the product.
+static Reg *gen_div_const(IROp op, Type *ty, Reg *x, int64_t d, Token *tok)
+{
+    int bits = ty->size * 8;
+    Type *sty = (ty->size == 8) ? ty_long : ty_int;
+    Type *uty = (ty->size == 8) ? ty_ulong : ty_uint;
+    uint64_t ad = (!ty->is_unsigned && d < 0) ? -(uint64_t)d : d;
+    if (bits == 32)
+    {
+        ad = (uint32_t)ad;
+    }
+
+    // x / 1, x % 1, x / -1 and x % -1
+    if (ad == 1)
+    {
+        if (op == IR_MOD)
+        {
+            return imm(0, tok);
+        }
+        return (d < 0 && !ty->is_unsigned) ? binary_reg(IR_NEG, ty, x, NULL, tok) : x;
+    }
+
+    if ((ad & (ad - 1)) == 0)
+    {
+        int k = __builtin_ctzll(ad);
+
+        if (ty->is_unsigned)
+        {
+            if (op == IR_DIV)
+            {
+                return binary_imm(IR_SHR, uty, x, k, tok);
+            }
+            return binary_imm(IR_BITAND, uty, x, (int64_t)(ad - 1), tok);
+        }
+
+        // Negative dividends are rounded toward zero by adding
+        // 2^k - 1 before shifting.
+        Reg *t = (k == 1) ? x : binary_imm(IR_SHR, sty, x, k - 1, tok);
+        t = binary_imm(IR_SHR, uty, t, bits - k, tok);
+        t = binary_reg(IR_ADD, sty, x, t, tok);
+
+        if (op == IR_MOD)
+        {
+            t = binary_imm(IR_BITAND, sty, t, -(int64_t)ad, tok);
+            return binary_reg(IR_SUB, sty, x, t, tok);
+        }
+        Reg *q = binary_imm(IR_SHR, sty, t, k, tok);
+        return (d < 0) ? binary_reg(IR_NEG, sty, q, NULL, tok) : q;
+    }
+
+    int64_t magic;
+    int shift;
+    Reg *q;
+
+    if (ty->is_unsigned)
+    {
+        bool add;
+        unsigned_magic(ad, bits, &magic, &shift, &add);
+        Reg *t = binary_reg(IR_MULH, uty, x, imm(magic, tok), tok);
+
+        if (add)
+        {
+            q = binary_reg(IR_SUB, uty, x, t, tok);
+            q = binary_imm(IR_SHR, uty, q, 1, tok);
+            q = binary_reg(IR_ADD, uty, q, t, tok);
+            q = binary_imm(IR_SHR, uty, q, shift - 1, tok);
+        }
+        else
+        {
+            q = shift ? binary_imm(IR_SHR, uty, t, shift, tok) : t;
+        }
+    }
+    else
+    {
+        signed_magic(d, bits, &magic, &shift);
+        q = binary_reg(IR_MULH, sty, x, imm(magic, tok), tok);
+
+        if (d > 0 && magic < 0)
+        {
+            q = binary_reg(IR_ADD, sty, q, x, tok);
+        }
+        else if (d < 0 && magic > 0)
+        {
+            q = binary_reg(IR_SUB, sty, q, x, tok);
+        }
+        if (shift)
+        {
+            q = binary_imm(IR_SHR, sty, q, shift, tok);
+        }
+
+        // Add one to a negative quotient to round it toward zero.
+        Reg *t = binary_imm(IR_SHR, uty, q, bits - 1, tok);
+        q = binary_reg(IR_ADD, sty, q, t, tok);
+    }
+
+    if (op == IR_DIV)
+    {
+        return q;
+    }
+    Reg *t = binary_imm(IR_MUL, ty, q, d, tok);
+    return binary_reg(IR_SUB, ty, x, t, tok);
+}
+
+static Reg *gen_expr(Node *node)
+{
+    Token *tok = node->tok;
+
+    switch (node->kind)
+    {
+    case ND_NULL_EXPR:
+        return NULL;
+    case ND_NUM:
+    {
+        if (is_flonum(node->ty))
+        {
+            Reg *r = new_reg(true);
+            IR *ir = emit(IR_FIMM, node->ty, r, NULL, NULL, tok);
+            ir->fimm = node->fval;
+            return r;
+        }
+        return imm(node->val, tok);
+    }
+    case ND_NEG:
+    {
+        Reg *val = gen_expr(node->lhs);
+        Reg *r = new_reg_for(node->ty);
+        if (is_flonum(node->ty))
+        {
+            emit(IR_SUB, node->ty, r, zero(node->ty, tok), val, tok);
+        }
+        else
+        {
+            emit(IR_NEG, node->ty, r, val, NULL, tok);
+        }
+        return r;
+    }
+    case ND_BITNOT:
+    {
+        Reg *r = new_reg(false);
+        emit(IR_BITNOT, node->ty, r, gen_expr(node->lhs), NULL, tok);
+        return r;
+    }
+    case ND_VAR:
+        if (node->var->reg)
+        {
+            return node->var->reg;
+        }
+        return load(gen_lvalue_addr(node), node->ty, tok);
+    case ND_MEMBER:
+    case ND_DEREF:
+        return load(gen_lvalue_addr(node), node->ty, tok);
+    case ND_ADDR:
+        return gen_addr(node->lhs);
+    case ND_ADD:
+    case ND_SUB:
+        if (node->ty->base)
+        {
+            return lea(gen_ptr_addr(node), tok);
+        }
+        break;
+    case ND_ASSIGN:
+    {
+        if (node->lhs->kind == ND_VAR && node->lhs->var->reg)
+        {
+            Reg *val = gen_expr(node->rhs);
+            emit(IR_MOV, node->ty, node->lhs->var->reg, val, NULL, tok);
+            return val;
+        }
+
+        Addr m = gen_lvalue_addr(node->lhs);
+        Reg *val = gen_expr(node->rhs);
+        store(m, val, node->ty, tok);
+        return val;
+    }
+    case ND_STMT_EXPR:
+        for (Node *n = node->body; n; n = n->next)
+        {
+            if (!n->next && n->kind == ND_EXPR_STMT)
+            {
+                return gen_expr(n->lhs);
+            }
+            gen_stmt(n);
+        }
+        return NULL;
+    case ND_COMMA:
+        gen_expr(node->lhs);
+        return gen_expr(node->rhs);
+    case ND_CAST:
+    {
+        Reg *val = gen_expr(node->lhs);
+        if (node->ty->kind == TY_VOID)
+        {
+            return NULL;
+        }
+        if (is_nop_cast(node->lhs->ty, node->ty))
+        {
+            return val;
+        }
+        Reg *r = new_reg_for(node->ty);
+        IR *ir = emit(IR_CAST, node->ty, r, val, NULL, tok);
+        ir->from = node->lhs->ty;
+        return r;
+    }
+    case ND_MEMZERO:
+    {
+        Var *var = node->var;
+        if (var->reg)
+        {
+            emit(IR_MOV, var->ty, var->reg, zero(var->ty, tok), NULL, tok);
+            return NULL;
+        }
+
+        IR *ir = emit(IR_MEMZERO, var->ty, NULL, NULL, NULL, tok);
+        ir->var = var;
+        ir->imm = var->ty->size;
+        return NULL;
+    }
+    case ND_COND:
+    {
+        BB *then = new_bb();
+        BB *els = new_bb();
+        BB *end = new_bb();
+        Reg *r = (node->ty->kind == TY_VOID) ? NULL : new_reg_for(node->ty);
+
+        gen_cond(node->cond, then, els);
+
+        set_bb(then, tok);
+        Reg *val = gen_expr(node->then);
+        if (r)
+        {
+            emit(IR_MOV, node->ty, r, val, NULL, tok);
+        }
+        jmp(end, tok);
+
+        set_bb(els, tok);
+        val = gen_expr(node->els);
+        if (r)
+        {
+            emit(IR_MOV, node->ty, r, val, NULL, tok);
+        }
+
+        set_bb(end, tok);
+        return r;
+    }
+    case ND_NOT:
+    {
+        Reg *val = gen_expr(node->lhs);
+        Reg *r = new_reg(false);
+        emit(IR_EQ, node->lhs->ty, r, val, zero(node->lhs->ty, tok), tok);
+        return r;
+    }
+    case ND_LOGAND:
+    case ND_LOGOR:
+    {
+        BB *t = new_bb();
+        BB *f = new_bb();
+        BB *end = new_bb();
+        Reg *r = new_reg(false);
+
+        gen_cond(node, t, f);
+
+        set_bb(t, tok);
+        emit(IR_IMM, ty_int, r, NULL, NULL, tok)->imm = 1;
+        jmp(end, tok);
+
+        set_bb(f, tok);
+        emit(IR_IMM, ty_int, r, NULL, NULL, tok)->imm = 0;
+
+        set_bb(end, tok);
+        return r;
+    }
+    case ND_FUNCALL:
+        return gen_funcall(node);
+    }
+
+    IROp op = binary_op(node->kind);
+    if (op == -1)
+    {
+        error_tok(tok, "invalid expression");
+    }
+
+    int64_t d;
+    if ((op == IR_DIV || op == IR_MOD) && is_integer(node->ty) && const_operand(node->rhs, &d) && d)
+    {
+        return gen_div_const(op, node->lhs->ty, gen_expr(node->lhs), d, tok);
+    }
+
+    Reg *a = gen_expr(node->lhs);
+    Reg *r = new_reg_for(node->ty);
+    emit_binary(op, node->lhs->ty, r, a, node->rhs, tok);
+    return r;
+}
+
+// Jumps to `then` if a given expression is true and to `els`
+// otherwise. Comparisons and logical operators become conditional
+// jumps instead of values.
+static void gen_cond(Node *node, BB *then, BB *els)
+{
+    Token *tok = node->tok;
+
+    switch (node->kind)
+    {
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+    {
+        // Build the comparison as a binary operator and then turn it
+        // into a branch so that its operands are folded alike.
+        Reg *a = gen_expr(node->lhs);
+        IR *ir = emit_binary(IR_CBR, node->lhs->ty, NULL, a, node->rhs, tok);
+        ir->cmp = binary_op(node->kind);
+        ir->bb1 = then;
+        ir->bb2 = els;
+        return;
+    }
+    case ND_NUM:
+        jmp((is_flonum(node->ty) ? node->fval != 0 : node->val != 0) ? then : els, tok);
+        return;
+    case ND_NOT:
+        gen_cond(node->lhs, els, then);
+        return;
+    case ND_LOGAND:
+    {
+        BB *rhs = new_bb();
+        gen_cond(node->lhs, rhs, els);
+        set_bb(rhs, tok);
+        gen_cond(node->rhs, then, els);
+        return;
+    }
+    case ND_LOGOR:
+    {
+        BB *rhs = new_bb();
+        gen_cond(node->lhs, then, rhs);
+        set_bb(rhs, tok);
+        gen_cond(node->rhs, then, els);
+        return;
+    }
+    }
+
+    br(gen_expr(node), node->ty, then, els, tok);
+}
+
+typedef struct
+{
+    int64_t val;
+    BB *bb;
+} Case;
+
+static bool is_unsigned_switch;
+
+static int cmp_case(const void *x, const void *y)
+{
+    int64_t a = ((Case *)x)->val;
+    int64_t b = ((Case *)y)->val;
+    if (is_unsigned_switch)
+    {
+        return ((uint64_t)a > (uint64_t)b) - ((uint64_t)a < (uint64_t)b);
+    }
+    return (a > b) - (a < b);
+}
+
+// Branches on a comparison against a constant.
+static void cbr_const(IROp cmp, Type *ty, Reg *a, int64_t val, BB *then, BB *els, Token *tok)
+{
+    // A 32-bit comparison only sees the lower half of the constant.
+    if (ty->size == 4)
+    {
+        val = (int32_t)val;
+    }
+    IR *ir = cbr(cmp, ty, a, is_imm32(val) ? NULL : imm(val, tok), then, els, tok);
+    ir->imm = val;
+}
+
+// Compares `cond` against each case in turn.
+static void gen_case_chain(Reg *cond, Type *ty, Case *cases, int n, BB *dflt, Token *tok)
+{
+    for (int i = 0; i < n; i++)
+    {
+        BB *next = new_bb();
+        cbr_const(IR_EQ, ty, cond, cases[i].val, cases[i].bb, next, tok);
+        set_bb(next, tok);
+    }
+    jmp(dflt, tok);
+}
+
+// Dispatches over sorted cases with a balanced tree of compares.
+static void gen_case_tree(Reg *cond, Type *ty, Case *cases, int n, BB *dflt, Token *tok)
+{
+    if (n <= 3)
+    {
+        gen_case_chain(cond, ty, cases, n, dflt, tok);
+        return;
+    }
+
+    int mid = n / 2;
+    BB *lo = new_bb();
+    BB *hi = new_bb();
+
+    cbr_const(IR_LT, ty, cond, cases[mid].val, lo, hi, tok);
+
+    set_bb(lo, tok);
+    gen_case_tree(cond, ty, cases, mid, dflt, tok);
+    set_bb(hi, tok);
+    gen_case_tree(cond, ty, cases + mid, n - mid, dflt, tok);
+}
+
+// Dispatches over sorted cases through a table indexed by
+// `cond - min`. Values in the range without a case go to `dflt`.
+static void gen_jump_table(Reg *cond, Type *ty, Case *cases, int n, BB *dflt, Token *tok)
+{
+    int64_t min = cases[0].val;
+    int range = cases[n - 1].val - min + 1;
+
+    Reg *idx = new_reg(false);
+    if (is_imm32(min))
+    {
+        emit_imm(IR_SUB, ty, idx, cond, min, tok);
+    }
+    else
+    {
+        emit(IR_SUB, ty, idx, cond, imm(min, tok), tok);
+    }
+
+    // A single unsigned compare checks both ends of the range.
+    Type *uty = (ty->size == 8) ? ty_ulong : ty_uint;
+    BB *table = new_bb();
+    cbr_const(IR_LE, uty, idx, range - 1, table, dflt, tok);
+    set_bb(table, tok);
+
+    BB **targets = arena_alloc(&ir_arena, range * sizeof(BB *));
+    for (int i = 0; i < range; i++)
+    {
+        targets[i] = dflt;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        targets[cases[i].val - min] = cases[i].bb;
+    }
+
+    IR *ir = emit(IR_JTAB, ty, NULL, idx, NULL, tok);
+    ir->targets = targets;
+    ir->ntargets = range;
+}
+
+// Lowers a switch statement. Small switches compare against each
+// case, dense ones use a jump table and sparse ones do a binary
+// search.
+static void gen_switch(Node *node)
+{
+    Token *tok = node->tok;
+    Type *ty = node->cond->ty;
+    Reg *cond = gen_expr(node->cond);
+    BB *dflt = label_bb(node->default_case ? node->default_case->label : node->brk_label);
+
+    int n = 0;
+    for (Node *c = node->case_next; c; c = c->case_next)
+    {
+        n++;
+    }
+
+    Case *cases = calloc(n, sizeof(Case));
+    int i = 0;
+    for (Node *c = node->case_next; c; c = c->case_next, i++)
+    {
+        // Case values are converted to the type of the condition.
+        if (ty->size == 4)
+        {
+            cases[i].val = ty->is_unsigned ? (int64_t)(uint32_t)c->val : (int32_t)c->val;
+        }
+        else
+        {
+            cases[i].val = c->val;
+        }
+        cases[i].bb = label_bb(c->label);
+    }
+
+    is_unsigned_switch = ty->is_unsigned;
+    qsort(cases, n, sizeof(Case), cmp_case);
+
+    if (n < 4)
+    {
+        gen_case_chain(cond, ty, cases, n, dflt, tok);
+    }
+    else
+    {
+        uint64_t span = (uint64_t)cases[n - 1].val - (uint64_t)cases[0].val;
+        if (span < 3 * (uint64_t)n && span < 65536)
+        {
+            gen_jump_table(cond, ty, cases, n, dflt, tok);
+        }
+        else
+        {
+            gen_case_tree(cond, ty, cases, n, dflt, tok);
+        }
+    }
+    free(cases);
+
+    set_bb(new_bb(), tok);
+    gen_stmt(node->then);
+    set_bb(label_bb(node->brk_label), tok);
+}
+
+static void gen_stmt(Node *node)
+{
+    Token *tok = node->tok;
+
+    switch (node->kind)
+    {
+    case ND_IF:
+    {
+        BB *then = new_bb();
+        BB *els = new_bb();
+        BB *end = new_bb();
+
+        gen_cond(node->cond, then, els);
+
+        set_bb(then, tok);
+        gen_stmt(node->then);
+        jmp(end, tok);
+
+        set_bb(els, tok);
+        if (node->els)
+        {
+            gen_stmt(node->els);
+        }
+
+        set_bb(end, tok);
+        return;
+    }
+    case ND_LOOP:
+    {
+        BB *begin = new_bb();
+        BB *body = new_bb();
+        BB *cont = label_bb(node->cont_label);
+        BB *brk = label_bb(node->brk_label);
+
+        if (node->init)
+        {
+            gen_stmt(node->init);
+        }
+
+        set_bb(begin, tok);
+        if (node->cond)
+        {
+            gen_cond(node->cond, body, brk);
+        }
+
+        set_bb(body, tok);
+        gen_stmt(node->then);
+
+        set_bb(cont, tok);
+        if (node->inc)
+        {
+            gen_expr(node->inc);
+        }
+        jmp(begin, tok);
+
+        set_bb(brk, tok);
+        return;
+    }
+    case ND_DO:
+    {
+        BB *begin = new_bb();
+        BB *cont = label_bb(node->cont_label);
+        BB *brk = label_bb(node->brk_label);
+
+        set_bb(begin, tok);
+        gen_stmt(node->then);
+
+        set_bb(cont, tok);
+        gen_cond(node->cond, begin, brk);
+
+        set_bb(brk, tok);
+        return;
+    }
+    case ND_SWITCH:
+        gen_switch(node);
+        return;
+    case ND_CASE:
+        set_bb(label_bb(node->label), tok);
+        gen_stmt(node->lhs);
+        return;
+    case ND_BLOCK:
+        for (Node *n = node->body; n; n = n->next)
+        {
+            gen_stmt(n);
+        }
+        return;
+    case ND_GOTO:
+        jmp(label_bb(node->unique_label), tok);
+        set_bb(new_bb(), tok);
+        return;
+    case ND_LABEL:
+        set_bb(label_bb(node->unique_label), tok);
+        gen_stmt(node->lhs);
+        return;
+    case ND_RETURN:
+    {
+        Reg *val = node->lhs ? gen_expr(node->lhs) : NULL;
+        emit(IR_RET, node->lhs ? node->lhs->ty : ty_void, NULL, val, NULL, tok);
+        set_bb(new_bb(), tok);
+        return;
+    }
+    case ND_EXPR_STMT:
+        gen_expr(node->lhs);
+        return;
+    }
+
+    error_tok(tok, "invalid statement");
+}
+
+// Returns the variable an lvalue expression designates, if any.
+static Var *lvalue_var(Node *node)
+{
+    for (;;)
+    {
+        switch (node->kind)
+        {
+        case ND_COMMA:
+            node = node->rhs;
+            continue;
+        case ND_MEMBER:
+            node = node->lhs;
+            continue;
+        case ND_VAR:
+            return node->var;
+        }
+        return NULL;
+    }
+}
+
+// Set if the function does pointer arithmetic on the address of a
+// variable, which may be used to reach neighbouring variables.
+static bool walks_frame;
+
+// Collects local variables whose address may escape.
+static void find_addr_taken(Node *node, HashMap *vars)
+{
+    if (!node)
+    {
+        return;
+    }
+
+    Var *var = NULL;
+    if (node->kind == ND_ADDR)
+    {
+        var = lvalue_var(node->lhs);
+    }
+    else if ((node->kind == ND_ADD || node->kind == ND_SUB) && node->lhs->kind == ND_ADDR)
+    {
+        walks_frame = true;
+    }
+    else if (node->kind == ND_ASSIGN && node->lhs->kind != ND_VAR)
+    {
+        var = lvalue_var(node->lhs);
+    }
+
+    if (var)
+    {
+        hashmap_put_ptr(vars, var, var);
+    }
+
+    find_addr_taken(node->lhs, vars);
+    find_addr_taken(node->rhs, vars);
+    find_addr_taken(node->cond, vars);
+    find_addr_taken(node->then, vars);
+    find_addr_taken(node->els, vars);
+    find_addr_taken(node->init, vars);
+    find_addr_taken(node->inc, vars);
+
+    for (Node *n = node->body; n; n = n->next)
+    {
+        find_addr_taken(n, vars);
+    }
+    for (Node *n = node->args; n; n = n->next)
+    {
+        find_addr_taken(n, vars);
+    }
+}
+
+// Decides which local variables can live in registers.
+static void promote_locals(Var *fn)
+{
+    HashMap addr_taken = {};
+    walks_frame = false;
+    find_addr_taken(fn->body, &addr_taken);
+
+    for (Var *var = fn->locals; var; var = var->next)
+    {
+        var->reg = NULL;
+        if (walks_frame || var == fn->va_area || !is_scalar(var->ty))
+        {
+            continue;
+        }
+        if (hashmap_get_ptr(&addr_taken, var))
+        {
+            continue;
+        }
+        var->reg = new_reg_for(var->ty);
+        var->reg->var = var;
+    }
+
+    hashmap_free(&addr_taken);
+}
+
+static void gen_fn(Var *fn)
+{
+    current_fn = fn;
+    nregs = 0;
+
+    BB head = {};
+    last_bb = &head;
+    out = new_bb();
+    last_bb = last_bb->next = out;
+
+    if (opt_O)
+    {
+        promote_locals(fn);
+    }
+    gen_stmt(fn->body);
+
+    if (!is_terminated(out))
+    {
+        emit(IR_RET, ty_void, NULL, NULL, NULL, fn->body->tok);
+    }
+
+    fn->bbs = head.next;
+    fn->nregs = nregs;
+    hashmap_free(&labels);
+}
+
+void gen_ir(Var *prog)
+{
+    for (Var *fn = prog; fn; fn = fn->next)
+    {
+        if (fn->is_function && fn->is_definition)
+        {
+            gen_fn(fn);
+        }
+    }
+}
+
+//
+// IR dump
+//
+
+static char *op_names[] = {
+    [IR_IMM] = "imm",
+    [IR_FIMM] = "fimm",
+    [IR_MOV] = "mov",
+    [IR_LADDR] = "laddr",
+    [IR_GADDR] = "gaddr",
+    [IR_LEA] = "lea",
+    [IR_LOAD] = "load",
+    [IR_STORE] = "store",
+    [IR_ADD] = "add",
+    [IR_SUB] = "sub",
+    [IR_MUL] = "mul",
+    [IR_MULH] = "mulh",
+    [IR_DIV] = "div",
+    [IR_MOD] = "mod",
+    [IR_BITAND] = "and",
+    [IR_BITOR] = "or",
+    [IR_BITXOR] = "xor",
+    [IR_SHL] = "shl",
+    [IR_SHR] = "shr",
+    [IR_EQ] = "eq",
+    [IR_NE] = "ne",
+    [IR_LT] = "lt",
+    [IR_LE] = "le",
+    [IR_NEG] = "neg",
+    [IR_BITNOT] = "not",
+    [IR_CAST] = "cast",
+    [IR_MEMZERO] = "memzero",
+    [IR_MEMCPY] = "memcpy",
+    [IR_CALL] = "call",
+    [IR_RET] = "ret",
+    [IR_JMP] = "jmp",
+    [IR_BR] = "br",
+    [IR_CBR] = "cbr",
+    [IR_JTAB] = "jtab",
+    [IR_TAILCALL] = "tailcall",
+    [IR_VLOOP] = "vloop",
+    [IR_SELECT] = "select",
+};
+
+static char *type_name(Type *ty)
+{
+    switch (ty->kind)
+    {
+    case TY_VOID:
+        return "void";
+    case TY_BOOL:
+        return "i1";
+    case TY_FLOAT:
+        return "f32";
+    case TY_DOUBLE:
+        return "f64";
+    case TY_PTR:
+    case TY_ARRAY:
+        return "ptr";
+    case TY_STRUCT:
+    case TY_UNION:
+        return "mem";
+    }
+
+    switch (ty->size)
+    {
+    case 1:
+        return ty->is_unsigned ? "u8" : "i8";
+    case 2:
+        return ty->is_unsigned ? "u16" : "i16";
+    case 4:
+        return ty->is_unsigned ? "u32" : "i32";
+    }
+    return ty->is_unsigned ? "u64" : "i64";
+}
+
+static char *var_name(Var *var)
+{
+    return *var->name ? var->name : "<tmp>";
+}
+
+// Prints the second operand of a binary operator.
+static void dump_operand(IR *ir, FILE *out)
+{
+    if (ir->b)
+    {
+        fprintf(out, "v%d", ir->b->vn);
+    }
+    else if (ir->var)
+    {
+        fprintf(out, "[%s%+ld]", var_name(ir->var), ir->imm);
+    }
+    else
+    {
+        fprintf(out, "%ld", ir->imm);
+    }
+}
+
+// Prints the address of IR_LEA, IR_LOAD or IR_STORE.
+static void dump_addr(IR *ir, FILE *out)
+{
+    fprintf(out, " [");
+    if (ir->var)
+    {
+        fprintf(out, "%s", var_name(ir->var));
+    }
+    else
+    {
+        fprintf(out, "v%d", ir->a->vn);
+    }
+    if (ir->index)
+    {
+        fprintf(out, " + v%d*%d", ir->index->vn, ir->scale);
+    }
+    if (ir->imm)
+    {
+        fprintf(out, " %c %ld", (ir->imm < 0) ? '-' : '+', labs(ir->imm));
+    }
+    fprintf(out, "]");
+}
+
+static void dump_insn(IR *ir, FILE *out)
+{
+    fprintf(out, "  ");
+    if (ir->d)
+    {
+        fprintf(out, "v%d = ", ir->d->vn);
+    }
+    fprintf(out, "%s", op_names[ir->op]);
+
+    switch (ir->op)
+    {
+    case IR_IMM:
+        fprintf(out, " %ld\n", ir->imm);
+        return;
+    case IR_FIMM:
+        fprintf(out, ".%s %g\n", type_name(ir->ty), ir->fimm);
+        return;
+    case IR_LADDR:
+    case IR_GADDR:
+        fprintf(out, " %s\n", var_name(ir->var));
+        return;
+    case IR_CAST:
+        fprintf(out, ".%s.%s v%d\n", type_name(ir->from), type_name(ir->ty), ir->a->vn);
+        return;
+    case IR_LEA:
+        dump_addr(ir, out);
+        fprintf(out, "\n");
+        return;
+    case IR_LOAD:
+        fprintf(out, ".%s", type_name(ir->ty));
+        dump_addr(ir, out);
+        fprintf(out, "\n");
+        return;
+    case IR_STORE:
+        fprintf(out, ".%s", type_name(ir->ty));
+        dump_addr(ir, out);
+        fprintf(out, ", v%d\n", ir->b->vn);
+        return;
+    case IR_MEMZERO:
+        if (ir->var)
+        {
+            fprintf(out, " &%s, %ld\n", var_name(ir->var), ir->imm);
+        }
+        else
+        {
+            fprintf(out, " v%d, %ld\n", ir->a->vn, ir->imm);
+        }
+        return;
+    case IR_MEMCPY:
+        fprintf(out, " v%d, v%d, %ld\n", ir->a->vn, ir->b->vn, ir->imm);
+        return;
+    case IR_CALL:
+    case IR_TAILCALL:
+        fprintf(out, " %s(", ir->funcname);
+        for (int i = 0; i < ir->nargs; i++)
+        {
+            fprintf(out, "%sv%d", i ? ", " : "", ir->args[i]->vn);
+        }
+        fprintf(out, ")\n");
+        return;
+    case IR_VLOOP:
+        fprintf(out, ".%s v%d, (", type_name(ir->ty), ir->a->vn);
+        for (int i = 0; i < ir->nargs; i++)
+        {
+            fprintf(out, "%sv%d", i ? ", " : "", ir->args[i]->vn);
+        }
+        fprintf(out, ") {\n");
+        for (IR *k = ir->kernel; k; k = k->next)
+        {
+            fprintf(out, "  ");
+            dump_insn(k, out);
+        }
+        fprintf(out, "  }\n");
+        return;
+    case IR_SELECT:
+        fprintf(out, ".%s.%s v%d, ", op_names[ir->cmp], type_name(ir->ty), ir->a->vn);
+        dump_operand(ir, out);
+        fprintf(out, " ? v%d : v%d\n", ir->args[0]->vn, ir->args[1]->vn);
+        return;
+    case IR_JMP:
+        fprintf(out, " bb%d\n", ir->bb1->label);
+        return;
+    case IR_BR:
+        fprintf(out, " v%d, bb%d, bb%d\n", ir->a->vn, ir->bb1->label, ir->bb2->label);
+        return;
+    case IR_CBR:
+        fprintf(out, ".%s.%s v%d, ", op_names[ir->cmp], type_name(ir->ty), ir->a->vn);
+        dump_operand(ir, out);
+        fprintf(out, ", bb%d, bb%d\n", ir->bb1->label, ir->bb2->label);
+        return;
+    case IR_JTAB:
+        fprintf(out, " v%d, [", ir->a->vn);
+        for (int i = 0; i < ir->ntargets; i++)
+        {
+            fprintf(out, "%sbb%d", i ? ", " : "", ir->targets[i]->label);
+        }
+        fprintf(out, "]\n");
+        return;
+    }
+
+    if (ir->ty && ir->op != IR_RET)
+    {
+        fprintf(out, ".%s", type_name(ir->ty));
+    }
+    if (ir->a)
+    {
+        fprintf(out, " v%d", ir->a->vn);
+    }
+    if (IR_ADD <= ir->op && ir->op <= IR_LE)
+    {
+        fprintf(out, ", ");
+        dump_operand(ir, out);
+    }
+    else if (ir->b)
+    {
+        fprintf(out, ", v%d", ir->b->vn);
+    }
+    fprintf(out, "\n");
+}
+
+// Prints the IR of all functions in a human-readable form.
+void dump_ir(Var *prog, FILE *out)
+{
+    for (Var *fn = prog; fn; fn = fn->next)
+    {
+        if (!fn->is_function || !fn->is_definition)
+        {
+            continue;
+        }
+
+        fprintf(out, "%s:\n", fn->name);
+        for (Var *var = fn->locals; var; var = var->next)
+        {
+            if (var->reg)
+            {
+                fprintf(out, "  # %s in v%d\n", var_name(var), var->reg->vn);
+            }
+        }
+
+        for (BB *bb = fn->bbs; bb; bb = bb->next)
+        {
+            fprintf(out, "bb%d:\n", bb->label);
+            for (IR *ir = bb->ir; ir; ir = ir->next)
+            {
+                dump_insn(ir, out);
+            }
+        }
+        fprintf(out, "\n");
+    }
+}
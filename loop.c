@@ -0,0 +1,1940 @@
+#include "zcc.h"
+
+// Loop optimizations.
+//
+// Loops are found as the natural loops of back edges, that is, edges
+// to a block that dominates their source. Every loop gets a preheader,
+// a block that runs once before the loop is entered, and loops are
+// processed from the innermost out.
+//
+// Loop-invariant code motion moves a computation whose operands do not
+// change inside the loop to the preheader. Loads and divisions are only
+// moved out of the header, which runs whenever the loop is entered, and
+// loads only if nothing in the loop may write memory.
+//
+// Strength reduction looks for induction variables, which are changed
+// only by adding a constant once per iteration, and for values computed
+// from them as `base + i * k`. Such a value is kept in a register of
+// its own that is initialized in the preheader and bumped wherever the
+// induction variable is, so an array access `a[i]` becomes an access
+// through a pointer and the multiplication disappears.
+//
+// Finally, an innermost loop `for (; i < n; i++)` whose body applies
+// the same operations to elements `i` of int, long, float or double
+// arrays is vectorized. While at least a vector's worth of iterations
+// is left, IR_VLOOP runs them 16 bytes at a time with SSE2, and the
+// original loop does the rest. An array written to must not overlap
+// the others, which is known if they are different variables or if
+// one of them is accessed through a restrict pointer. An integer may
+// be reduced with `+=`, `-=`, `&=`, `|=` or `^=`; floating-point sums
+// are not, since adding in another order changes the result.
+//
+// With -funroll-loops, a counted loop that is not vectorized is
+// preceded by a loop whose body is several copies of the original one.
+// It runs while that many iterations are left, testing the condition
+// once per round, and the original loop does the remaining ones.
+
+// An induction variable
+typedef struct IV IV;
+struct IV
+{
+    IV *next;
+    Reg *reg;
+    IR *update; // The only instruction in the loop that changes `reg`
+    int64_t step;
+    bool narrow; // A 32-bit int
+    int version; // Incremented when `update` is passed in a block
+};
+
+// A value `base + var + iv * mul + add`, computed in the current block
+// after the last update of `iv`. A narrow value is a 32-bit int that
+// is only good as the operand of a widening cast.
+typedef struct
+{
+    IV *iv;
+    int version;
+    Reg *base;
+    Var *var;
+    int64_t mul;
+    int64_t add;
+    bool narrow;
+    int cost; // Instructions needed to compute the value from `iv`
+} Affine;
+
+// A register that tracks `base + var + iv * mul`
+typedef struct Shadow Shadow;
+struct Shadow
+{
+    Shadow *next;
+    IV *iv;
+    Reg *base;
+    Var *var;
+    int64_t mul;
+    Reg *reg;
+};
+
+typedef struct Loop Loop;
+struct Loop
+{
+    Loop *next;
+    BB *header;
+    HashMap body;
+    int nblocks;
+    BB *preheader;
+    IV *ivs;
+    Shadow *shadows;
+};
+
+typedef struct
+{
+    Var *fn;
+    BB **bbs;
+    int nbbs;
+    HashMap index; // Block to its position in `bbs` plus one
+    int *idom;
+    int *ndefs;      // Definitions of each register in the function
+    int *loop_defs;  // Definitions of each register in the current loop
+    Affine *affine; // Per register, valid if `aff_stamp` is `stamp`
+    int *aff_stamp;
+    int stamp;
+    Loop *loops;
+} LoopOpt;
+
+static int bb_index(LoopOpt *s, BB *bb)
+{
+    return (intptr_t)hashmap_get_ptr(&s->index, bb) - 1;
+}
+
+static BB **successors(IR *ir, BB **buf, int *n)
+{
+    switch (ir->op)
+    {
+    case IR_JMP:
+        buf[0] = ir->bb1;
+        *n = 1;
+        return buf;
+    case IR_BR:
+    case IR_CBR:
+        buf[0] = ir->bb1;
+        buf[1] = ir->bb2;
+        *n = 2;
+        return buf;
+    case IR_JTAB:
+        *n = ir->ntargets;
+        return ir->targets;
+    }
+    *n = 0;
+    return buf;
+}
+
+static void postorder(LoopOpt *s, BB *bb, bool *seen, BB **order, int *n)
+{
+    int i = bb_index(s, bb);
+    if (seen[i])
+    {
+        return;
+    }
+    seen[i] = true;
+
+    BB *buf[2];
+    int nsucc;
+    BB **succ = successors(bb->last, buf, &nsucc);
+    for (int j = 0; j < nsucc; j++)
+    {
+        postorder(s, succ[j], seen, order, n);
+    }
+    order[(*n)++] = bb;
+}
+
+// Computes immediate dominators with the algorithm of Cooper, Harvey
+// and Kennedy. Blocks are compared by their postorder numbers.
+static void compute_dominators(LoopOpt *s)
+{
+    bool *seen = calloc(s->nbbs, sizeof(bool));
+    BB **order = calloc(s->nbbs, sizeof(BB *));
+    int n = 0;
+    postorder(s, s->fn->bbs, seen, order, &n);
+
+    int *po = calloc(s->nbbs, sizeof(int));
+    for (int i = 0; i < n; i++)
+    {
+        po[bb_index(s, order[i])] = i;
+    }
+
+    // Predecessors, by postorder number
+    int *npreds = calloc(n, sizeof(int));
+    int **preds = calloc(n, sizeof(int *));
+    for (int i = 0; i < n; i++)
+    {
+        BB *buf[2];
+        int nsucc;
+        BB **succ = successors(order[i]->last, buf, &nsucc);
+        for (int j = 0; j < nsucc; j++)
+        {
+            int k = po[bb_index(s, succ[j])];
+            preds[k] = realloc(preds[k], (npreds[k] + 1) * sizeof(int));
+            preds[k][npreds[k]++] = i;
+        }
+    }
+
+    int *idom = calloc(n, sizeof(int));
+    for (int i = 0; i < n; i++)
+    {
+        idom[i] = -1;
+    }
+    idom[n - 1] = n - 1;
+
+    for (bool changed = true; changed;)
+    {
+        changed = false;
+        for (int i = n - 2; i >= 0; i--)
+        {
+            int d = -1;
+            for (int j = 0; j < npreds[i]; j++)
+            {
+                int p = preds[i][j];
+                if (idom[p] < 0)
+                {
+                    continue;
+                }
+                if (d < 0)
+                {
+                    d = p;
+                    continue;
+                }
+                int x = p;
+                while (x != d)
+                {
+                    while (x < d)
+                    {
+                        x = idom[x];
+                    }
+                    while (d < x)
+                    {
+                        d = idom[d];
+                    }
+                }
+            }
+            if (idom[i] != d)
+            {
+                idom[i] = d;
+                changed = true;
+            }
+        }
+    }
+
+    // Store them by block index. Unreachable blocks dominate nothing.
+    s->idom = calloc(s->nbbs, sizeof(int));
+    for (int i = 0; i < s->nbbs; i++)
+    {
+        s->idom[i] = -1;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        s->idom[bb_index(s, order[i])] = bb_index(s, order[idom[i]]);
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        free(preds[i]);
+    }
+    free(preds);
+    free(npreds);
+    free(idom);
+    free(po);
+    free(order);
+    free(seen);
+}
+
+static bool dominates(LoopOpt *s, BB *x, BB *y)
+{
+    int i = bb_index(s, x);
+    int j = bb_index(s, y);
+    if (s->idom[j] < 0)
+    {
+        return false;
+    }
+    for (;;)
+    {
+        if (i == j)
+        {
+            return true;
+        }
+        if (s->idom[j] == j)
+        {
+            return false;
+        }
+        j = s->idom[j];
+    }
+}
+
+static bool in_loop(Loop *loop, BB *bb)
+{
+    return hashmap_get_ptr(&loop->body, bb);
+}
+
+static void add_to_loop(Loop *loop, BB *bb)
+{
+    if (!in_loop(loop, bb))
+    {
+        hashmap_put_ptr(&loop->body, bb, bb);
+        loop->nblocks++;
+    }
+}
+
+// Adds the blocks that reach `bb` without passing the header.
+static void add_body(LoopOpt *s, Loop *loop, BB *bb, int **preds, int *npreds)
+{
+    if (in_loop(loop, bb))
+    {
+        return;
+    }
+    add_to_loop(loop, bb);
+
+    int i = bb_index(s, bb);
+    for (int j = 0; j < npreds[i]; j++)
+    {
+        add_body(s, loop, s->bbs[preds[i][j]], preds, npreds);
+    }
+}
+
+static void find_loops(LoopOpt *s)
+{
+    int *npreds = calloc(s->nbbs, sizeof(int));
+    int **preds = calloc(s->nbbs, sizeof(int *));
+    for (int i = 0; i < s->nbbs; i++)
+    {
+        BB *buf[2];
+        int nsucc;
+        BB **succ = successors(s->bbs[i]->last, buf, &nsucc);
+        for (int j = 0; j < nsucc; j++)
+        {
+            int k = bb_index(s, succ[j]);
+            preds[k] = realloc(preds[k], (npreds[k] + 1) * sizeof(int));
+            preds[k][npreds[k]++] = i;
+        }
+    }
+
+    for (int i = 0; i < s->nbbs; i++)
+    {
+        BB *bb = s->bbs[i];
+        BB *buf[2];
+        int nsucc;
+        BB **succ = successors(bb->last, buf, &nsucc);
+        for (int j = 0; j < nsucc; j++)
+        {
+            BB *header = succ[j];
+            if (!dominates(s, header, bb))
+            {
+                continue;
+            }
+
+            // Back edges to the same header make one loop.
+            Loop *loop = s->loops;
+            while (loop && loop->header != header)
+            {
+                loop = loop->next;
+            }
+            if (!loop)
+            {
+                loop = calloc(1, sizeof(Loop));
+                loop->header = header;
+                add_to_loop(loop, header);
+                loop->next = s->loops;
+                s->loops = loop;
+            }
+            add_body(s, loop, bb, preds, npreds);
+        }
+    }
+
+    for (int i = 0; i < s->nbbs; i++)
+    {
+        free(preds[i]);
+    }
+    free(preds);
+    free(npreds);
+
+    // Sort innermost first.
+    Loop *sorted = NULL;
+    while (s->loops)
+    {
+        Loop *loop = s->loops;
+        s->loops = loop->next;
+
+        Loop **p = &sorted;
+        while (*p && (*p)->nblocks <= loop->nblocks)
+        {
+            p = &(*p)->next;
+        }
+        loop->next = *p;
+        *p = loop;
+    }
+    s->loops = sorted;
+}
+
+static void retarget(IR *ir, BB *from, BB *to)
+{
+    if (ir->bb1 == from)
+    {
+        ir->bb1 = to;
+    }
+    if (ir->bb2 == from)
+    {
+        ir->bb2 = to;
+    }
+    for (int i = 0; i < ir->ntargets; i++)
+    {
+        if (ir->targets[i] == from)
+        {
+            ir->targets[i] = to;
+        }
+    }
+}
+
+// Inserts a block before the header that all entries to the loop go
+// through.
+static void add_preheader(LoopOpt *s, Loop *loop)
+{
+    BB *header = loop->header;
+    BB *pre = new_bb();
+    IR *jmp = alloc_ir(IR_JMP, ty_void, header->ir->tok);
+    jmp->bb1 = header;
+    append_ir(pre, jmp);
+
+    BB *prev = NULL;
+    for (BB *bb = s->fn->bbs; bb; bb = bb->next)
+    {
+        if (bb->next == header)
+        {
+            prev = bb;
+        }
+        if (!in_loop(loop, bb))
+        {
+            retarget(bb->last, header, pre);
+        }
+    }
+
+    if (prev)
+    {
+        prev->next = pre;
+    }
+    else
+    {
+        s->fn->bbs = pre;
+    }
+    pre->next = header;
+    loop->preheader = pre;
+
+    // The preheader belongs to the loops around this one.
+    for (Loop *outer = loop->next; outer; outer = outer->next)
+    {
+        if (in_loop(outer, header))
+        {
+            add_to_loop(outer, pre);
+        }
+    }
+}
+
+// Appends an instruction to the preheader before its jump.
+static void add_to_preheader(Loop *loop, IR *ir)
+{
+    BB *pre = loop->preheader;
+    IR head = {.next = pre->ir};
+    IR *prev = &head;
+    while (prev->next != pre->last)
+    {
+        prev = prev->next;
+    }
+    ir->next = pre->last;
+    prev->next = ir;
+    pre->ir = head.next;
+}
+
+static bool is_invariant(LoopOpt *s, Reg *r)
+{
+    return !r || !s->loop_defs[r->vn];
+}
+
+static bool writes_memory(Loop *loop, Var *fn)
+{
+    for (BB *bb = fn->bbs; bb; bb = bb->next)
+    {
+        if (!in_loop(loop, bb))
+        {
+            continue;
+        }
+        for (IR *ir = bb->ir; ir; ir = ir->next)
+        {
+            switch (ir->op)
+            {
+            case IR_STORE:
+            case IR_MEMZERO:
+            case IR_MEMCPY:
+            case IR_CALL:
+            case IR_TAILCALL:
+            case IR_VLOOP:
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static bool can_hoist(LoopOpt *s, Loop *loop, BB *bb, IR *ir, bool mem_written)
+{
+    if (!ir->d || ir->d->var || s->ndefs[ir->d->vn] != 1)
+    {
+        return false;
+    }
+    if (!is_invariant(s, ir->a) || !is_invariant(s, ir->b) || !is_invariant(s, ir->index))
+    {
+        return false;
+    }
+
+    switch (ir->op)
+    {
+    case IR_IMM:
+    case IR_MOV:
+    case IR_CALL:
+    case IR_VLOOP:
+        // Constants and copies are cheaper to redo than to keep in a
+        // register across the loop.
+        return false;
+    case IR_LADDR:
+    case IR_GADDR:
+    case IR_LEA:
+    case IR_FIMM:
+        return true;
+    case IR_LOAD:
+        return bb == loop->header && !mem_written;
+    case IR_DIV:
+    case IR_MOD:
+        if (bb != loop->header)
+        {
+            return false;
+        }
+        break;
+    }
+
+    // The second operand may be in memory.
+    return !ir->var || (bb == loop->header && !mem_written);
+}
+
+static void hoist_invariants(LoopOpt *s, Loop *loop)
+{
+    bool mem_written = writes_memory(loop, s->fn);
+
+    for (bool changed = true; changed;)
+    {
+        changed = false;
+        for (BB *bb = s->fn->bbs; bb; bb = bb->next)
+        {
+            if (!in_loop(loop, bb))
+            {
+                continue;
+            }
+
+            IR head = {.next = bb->ir};
+            for (IR *prev = &head; prev->next;)
+            {
+                IR *ir = prev->next;
+                if (!can_hoist(s, loop, bb, ir, mem_written))
+                {
+                    prev = ir;
+                    continue;
+                }
+                prev->next = ir->next;
+                add_to_preheader(loop, ir);
+                s->loop_defs[ir->d->vn]--;
+                changed = true;
+            }
+            bb->ir = head.next;
+        }
+    }
+}
+
+static bool fits_int32(int64_t val)
+{
+    return INT32_MIN <= val && val <= INT32_MAX;
+}
+
+static bool is_temp(LoopOpt *s, Reg *r)
+{
+    return !r->var && !r->is_fp && s->ndefs[r->vn] == 1;
+}
+
+// Returns the constant `iv` is incremented by at `ir`, which is either
+// `i = add i, c` or `i = mov t` following `t = add i, c` in the same
+// block.
+static bool get_step(LoopOpt *s, BB *bb, IR *ir, IV *iv)
+{
+    Reg *i = ir->d;
+    IR *add = ir;
+    if (ir->op == IR_MOV)
+    {
+        if (!is_temp(s, ir->a))
+        {
+            return false;
+        }
+        add = bb->ir;
+        while (add != ir && add->d != ir->a)
+        {
+            add = add->next;
+        }
+    }
+
+    if ((add->op != IR_ADD && add->op != IR_SUB) || add->a != i || add->b || add->var)
+    {
+        return false;
+    }
+
+    // A 32-bit induction variable is only followed through casts to
+    // 64 bits, which is exact since signed overflow is undefined.
+    Type *ty = add->ty;
+    if (!is_integer(ty) || ty->size < 4 || (ty->size == 4 && ty->is_unsigned))
+    {
+        return false;
+    }
+    iv->step = (add->op == IR_ADD) ? add->imm : -add->imm;
+    iv->narrow = (ty->size == 4);
+    return true;
+}
+
+static IV *find_ivs(LoopOpt *s, Loop *loop)
+{
+    IV *ivs = NULL;
+    for (BB *bb = s->fn->bbs; bb; bb = bb->next)
+    {
+        if (!in_loop(loop, bb))
+        {
+            continue;
+        }
+        for (IR *ir = bb->ir; ir; ir = ir->next)
+        {
+            if (!ir->d || ir->d->is_fp || s->loop_defs[ir->d->vn] != 1)
+            {
+                continue;
+            }
+            IV iv = {.reg = ir->d, .update = ir};
+            if (get_step(s, bb, ir, &iv))
+            {
+                IV *p = calloc(1, sizeof(IV));
+                *p = iv;
+                p->next = ivs;
+                ivs = p;
+            }
+        }
+    }
+    return ivs;
+}
+
+// Returns the affine form of a register at the current instruction:
+// either a value computed earlier in this block or an induction
+// variable itself.
+static Affine *get_affine(LoopOpt *s, IV *ivs, Reg *r, Affine *buf)
+{
+    if (!r)
+    {
+        return NULL;
+    }
+    if (s->aff_stamp[r->vn] == s->stamp)
+    {
+        Affine *aff = &s->affine[r->vn];
+        return (aff->iv->version == aff->version) ? aff : NULL;
+    }
+    for (IV *iv = ivs; iv; iv = iv->next)
+    {
+        if (iv->reg == r)
+        {
+            *buf = (Affine){.iv = iv, .version = iv->version, .mul = 1, .narrow = iv->narrow};
+            return buf;
+        }
+    }
+    return NULL;
+}
+
+static bool is_linear(Affine *aff)
+{
+    return !aff->base && !aff->var && !aff->narrow;
+}
+
+// Computes the affine form of the value an instruction defines.
+static bool derive(LoopOpt *s, IV *ivs, IR *ir, Affine *out)
+{
+    if (!ir->d || !is_temp(s, ir->d) || (ir->var && ir->op != IR_LEA))
+    {
+        return false;
+    }
+
+    Affine buf_a, buf_b;
+    Affine *a = get_affine(s, ivs, ir->a, &buf_a);
+    Affine *b = get_affine(s, ivs, ir->b, &buf_b);
+
+    switch (ir->op)
+    {
+    case IR_CAST:
+        // Sign extension from int to long
+        if (!a || !a->narrow || !is_integer(ir->ty) || ir->ty->size != 8 || ir->from->size != 4 ||
+            ir->from->is_unsigned)
+        {
+            return false;
+        }
+        *out = *a;
+        out->narrow = false;
+        break;
+    case IR_ADD:
+    case IR_SUB:
+        if (!ir->b)
+        {
+            if (!a || (ir->ty->size == 4) != a->narrow)
+            {
+                return false;
+            }
+            *out = *a;
+            out->add += (ir->op == IR_ADD) ? ir->imm : -ir->imm;
+            break;
+        }
+        if (ir->op == IR_SUB || ir->ty->size != 8)
+        {
+            return false;
+        }
+        if (a && !b && is_linear(a) && is_invariant(s, ir->b))
+        {
+            *out = *a;
+            out->base = ir->b;
+        }
+        else if (b && !a && is_linear(b) && is_invariant(s, ir->a))
+        {
+            *out = *b;
+            out->base = ir->a;
+        }
+        else
+        {
+            return false;
+        }
+        break;
+    case IR_MUL:
+    case IR_SHL:
+    {
+        if (!a || ir->b || !is_linear(a) || ir->imm < 0 || ir->imm > (ir->op == IR_MUL ? INT32_MAX : 30))
+        {
+            return false;
+        }
+        int64_t k = (ir->op == IR_MUL) ? ir->imm : (int64_t)1 << ir->imm;
+        *out = *a;
+        out->mul *= k;
+        out->add *= k;
+        break;
+    }
+    case IR_LEA:
+    {
+        Affine buf_i;
+        Affine *idx = get_affine(s, ivs, ir->index, &buf_i);
+        if (idx && is_linear(idx) && (ir->var ? ir->var->is_local : is_invariant(s, ir->a)))
+        {
+            *out = *idx;
+            out->base = ir->var ? NULL : ir->a;
+            out->var = ir->var;
+            out->mul *= ir->scale;
+            out->add = out->add * ir->scale + ir->imm;
+        }
+        else if (a && !a->narrow && !ir->index && !ir->var)
+        {
+            *out = *a;
+            out->add += ir->imm;
+        }
+        else
+        {
+            return false;
+        }
+        break;
+    }
+    default:
+        return false;
+    }
+
+    out->version = out->iv->version;
+    out->cost++;
+    return fits_int32(out->mul) && fits_int32(out->add);
+}
+
+// Computes the affine form of the address of a load or store.
+static bool derive_address(LoopOpt *s, IV *ivs, IR *ir, Affine *out)
+{
+    Affine buf;
+    if (ir->index)
+    {
+        Affine *idx = get_affine(s, ivs, ir->index, &buf);
+        if (!idx || !is_linear(idx) || (ir->var ? !ir->var->is_local : !is_invariant(s, ir->a)))
+        {
+            return false;
+        }
+        *out = *idx;
+        out->base = ir->var ? NULL : ir->a;
+        out->var = ir->var;
+        out->mul *= ir->scale;
+        out->add = out->add * ir->scale + ir->imm;
+    }
+    else
+    {
+        Affine *a = get_affine(s, ivs, ir->a, &buf);
+        if (!a || a->narrow || ir->var)
+        {
+            return false;
+        }
+        *out = *a;
+        out->add += ir->imm;
+    }
+
+    // Addressing modes make a plain `a[i]` with a long `i` free.
+    return out->cost > 0 && fits_int32(out->mul) && fits_int32(out->add);
+}
+
+// Returns a register that holds `base + var + iv * mul` throughout the
+// loop, or NULL.
+static Reg *get_shadow(LoopOpt *s, Loop *loop, Affine *aff)
+{
+    for (Shadow *sh = loop->shadows; sh; sh = sh->next)
+    {
+        if (sh->iv == aff->iv && sh->base == aff->base && sh->var == aff->var && sh->mul == aff->mul)
+        {
+            return sh->reg;
+        }
+    }
+
+    IV *iv = aff->iv;
+    int64_t bump = aff->mul * iv->step;
+    if (!fits_int32(bump))
+    {
+        return NULL;
+    }
+
+    Var *fn = s->fn;
+    Token *tok = iv->update->tok;
+    Reg *r = add_reg(fn, false);
+
+    // Compute the initial value from the induction variable on entry.
+    Reg *x = iv->reg;
+    if (iv->narrow)
+    {
+        IR *cast = alloc_ir(IR_CAST, ty_long, tok);
+        cast->from = ty_int;
+        cast->d = x = add_reg(fn, false);
+        cast->a = iv->reg;
+        add_to_preheader(loop, cast);
+    }
+
+    bool has_base = aff->base || aff->var;
+    bool scalable = aff->mul == 1 || aff->mul == 2 || aff->mul == 4 || aff->mul == 8;
+    if (has_base && !scalable)
+    {
+        IR *mul = alloc_ir(IR_MUL, ty_long, tok);
+        mul->d = add_reg(fn, false);
+        mul->a = x;
+        mul->imm = aff->mul;
+        add_to_preheader(loop, mul);
+        x = mul->d;
+    }
+
+    IR *init;
+    if (has_base)
+    {
+        init = alloc_ir(IR_LEA, ty_long, tok);
+        init->a = aff->base;
+        init->var = aff->var;
+        init->index = x;
+        init->scale = scalable ? aff->mul : 1;
+    }
+    else if (aff->mul == 1)
+    {
+        init = alloc_ir(IR_MOV, ty_long, tok);
+        init->a = x;
+    }
+    else
+    {
+        init = alloc_ir(IR_MUL, ty_long, tok);
+        init->a = x;
+        init->imm = aff->mul;
+    }
+    init->d = r;
+    add_to_preheader(loop, init);
+
+    // Bump it right after the induction variable changes.
+    IR *add = alloc_ir(IR_ADD, ty_long, tok);
+    add->d = add->a = r;
+    add->imm = bump;
+    add->next = iv->update->next;
+    iv->update->next = add;
+
+    Shadow *sh = calloc(1, sizeof(Shadow));
+    sh->iv = iv;
+    sh->base = aff->base;
+    sh->var = aff->var;
+    sh->mul = aff->mul;
+    sh->reg = r;
+    sh->next = loop->shadows;
+    loop->shadows = sh;
+    return r;
+}
+
+static void count_use(Reg *r, int *uses)
+{
+    if (r)
+    {
+        uses[r->vn]++;
+    }
+}
+
+static void reduce_strength(LoopOpt *s, Loop *loop)
+{
+    IV *ivs = loop->ivs = find_ivs(s, loop);
+    if (!ivs)
+    {
+        return;
+    }
+
+    // Find the values and addresses computed from induction variables.
+    // An affine form is valid until the next update of its variable.
+    HashMap values = {};
+    HashMap addrs = {};
+    for (BB *bb = s->fn->bbs; bb; bb = bb->next)
+    {
+        if (!in_loop(loop, bb))
+        {
+            continue;
+        }
+        s->stamp++;
+
+        for (IR *ir = bb->ir; ir; ir = ir->next)
+        {
+            Affine aff;
+            if ((ir->op == IR_LOAD || ir->op == IR_STORE) && derive_address(s, ivs, ir, &aff))
+            {
+                Affine *p = arena_alloc(&ir_arena, sizeof(Affine));
+                *p = aff;
+                hashmap_put_ptr(&addrs, ir, p);
+            }
+            else if (derive(s, ivs, ir, &aff))
+            {
+                Affine *p = arena_alloc(&ir_arena, sizeof(Affine));
+                *p = aff;
+                hashmap_put_ptr(&values, ir, p);
+                s->affine[ir->d->vn] = aff;
+                s->aff_stamp[ir->d->vn] = s->stamp;
+            }
+
+            for (IV *iv = ivs; iv; iv = iv->next)
+            {
+                if (iv->update == ir)
+                {
+                    iv->version++;
+                }
+            }
+        }
+    }
+
+    // A value only used to compute other such values or addresses
+    // needs no register of its own.
+    int *uses = calloc(s->fn->nregs, sizeof(int));
+    for (BB *bb = s->fn->bbs; bb; bb = bb->next)
+    {
+        for (IR *ir = bb->ir; ir; ir = ir->next)
+        {
+            if (hashmap_get_ptr(&values, ir))
+            {
+                continue;
+            }
+            if (!hashmap_get_ptr(&addrs, ir))
+            {
+                count_use(ir->a, uses);
+                count_use(ir->index, uses);
+            }
+            count_use(ir->b, uses);
+            for (int i = 0; i < ir->nargs; i++)
+            {
+                count_use(ir->args[i], uses);
+            }
+        }
+    }
+
+    for (BB *bb = s->fn->bbs; bb; bb = bb->next)
+    {
+        if (!in_loop(loop, bb))
+        {
+            continue;
+        }
+
+        for (IR *ir = bb->ir; ir; ir = ir->next)
+        {
+            Affine *aff = hashmap_get_ptr(&addrs, ir);
+            Reg *r;
+            if (aff && (r = get_shadow(s, loop, aff)))
+            {
+                ir->a = r;
+                ir->var = NULL;
+                ir->index = NULL;
+                ir->scale = 0;
+                ir->imm = aff->add;
+                continue;
+            }
+
+            // A value that takes a multiplication or more than one
+            // instruction to compute is taken from a shadow instead.
+            aff = hashmap_get_ptr(&values, ir);
+            if (aff && aff->cost > 1 && !aff->narrow && (aff->mul != 1 || !is_linear(aff)) && uses[ir->d->vn] &&
+                (r = get_shadow(s, loop, aff)))
+            {
+                *ir = (IR){.next = ir->next, .op = IR_LEA, .ty = ty_long, .tok = ir->tok, .d = ir->d, .a = r,
+                           .imm = aff->add};
+                if (!aff->add)
+                {
+                    ir->op = IR_MOV;
+                }
+            }
+        }
+    }
+
+    free(uses);
+    hashmap_free(&values);
+    hashmap_free(&addrs);
+}
+
+// Returns the induction variable of a loop whose header does nothing
+// but test `i < n` or `i <= n` for an invariant `n`, and that counts
+// `i` up.
+static IV *counted_loop(LoopOpt *s, Loop *loop)
+{
+    IR *cbr = loop->header->ir;
+    if (cbr != loop->header->last || cbr->op != IR_CBR || (cbr->cmp != IR_LT && cbr->cmp != IR_LE) ||
+        !is_integer(cbr->ty) || cbr->ty->is_unsigned || cbr->var || !is_invariant(s, cbr->b) ||
+        !in_loop(loop, cbr->bb1) || in_loop(loop, cbr->bb2))
+    {
+        return NULL;
+    }
+
+    IV *iv = loop->ivs;
+    while (iv && iv->reg != cbr->a)
+    {
+        iv = iv->next;
+    }
+    if (!iv || iv->step <= 0 || iv->narrow != (cbr->ty->size == 4))
+    {
+        return NULL;
+    }
+    return iv;
+}
+
+// Counts the uses of each register in the function and in the loop.
+static void count_uses(LoopOpt *s, Loop *loop, int *uses, int *loop_uses)
+{
+    for (BB *bb = s->fn->bbs; bb; bb = bb->next)
+    {
+        bool inside = in_loop(loop, bb);
+        for (IR *ir = bb->ir; ir; ir = ir->next)
+        {
+            Reg *rs[] = {ir->a, ir->b, ir->index};
+            for (int j = 0; j < 3; j++)
+            {
+                count_use(rs[j], uses);
+                if (inside)
+                {
+                    count_use(rs[j], loop_uses);
+                }
+            }
+            for (int j = 0; j < ir->nargs; j++)
+            {
+                count_use(ir->args[j], uses);
+                if (inside)
+                {
+                    count_use(ir->args[j], loop_uses);
+                }
+            }
+        }
+    }
+}
+
+// An array accessed by a vectorized loop, either through a shadow or
+// at `base + var + i * size`
+typedef struct
+{
+    Reg *shadow;
+    Reg *base;
+    Var *var;
+    int64_t imm;  // Offset of the first access
+    bool shifted; // Accessed at another offset, too
+    bool stored;
+    Reg *ptr; // Address of the current element
+} Stream;
+
+#define VEC_SIZE 16
+#define MAX_STREAMS 3
+#define MAX_VEC_VALUES 8
+
+typedef struct
+{
+    IV *iv;
+    Type *ty; // Element type
+    int *uses;
+    int *loop_uses;
+    Stream streams[MAX_STREAMS];
+    int nstreams;
+    Reg *args[MAX_VEC_VALUES + MAX_STREAMS];
+    int nargs;
+    int nvalues; // Vector registers needed
+
+    IR head;
+    IR *cur;
+
+    // A reduction `var = var op value`
+    Reg *red_var;
+    IR *red;
+    IR *red_mov; // Copy of the result to `var`, if any
+    IR *wide;    // Sign extension of the reduced value, if any
+} Vectorizer;
+
+static bool same_shape(Type *x, Type *y)
+{
+    if (is_flonum(x) || is_flonum(y))
+    {
+        return x->kind == y->kind;
+    }
+    return is_integer(x) && is_integer(y) && x->size == y->size;
+}
+
+static bool set_elem_type(Vectorizer *v, Type *ty)
+{
+    if (!v->ty)
+    {
+        if (!is_flonum(ty) && (!is_integer(ty) || ty->size < 4))
+        {
+            return false;
+        }
+        v->ty = ty;
+    }
+    return same_shape(v->ty, ty);
+}
+
+static bool in_kernel(Vectorizer *v, Reg *r)
+{
+    for (IR *k = v->head.next; k; k = k->next)
+    {
+        if (k->d == r)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void add_to_kernel(Vectorizer *v, IR *k)
+{
+    v->cur = v->cur->next = k;
+    if (k->d)
+    {
+        v->nvalues++;
+    }
+}
+
+// Checks that an operand is a kernel value or an invariant, which is
+// passed to the kernel.
+static bool use_operand(LoopOpt *s, Vectorizer *v, Reg *r)
+{
+    if (in_kernel(v, r))
+    {
+        return true;
+    }
+    if (!is_invariant(s, r) || r->is_fp != is_flonum(v->ty))
+    {
+        return false;
+    }
+    for (int i = 0; i < v->nargs; i++)
+    {
+        if (v->args[i] == r)
+        {
+            return true;
+        }
+    }
+    v->args[v->nargs++] = r;
+    v->nvalues++;
+    return v->nargs < MAX_VEC_VALUES;
+}
+
+// A kernel value must not be needed outside of the loop.
+static bool is_kernel_temp(LoopOpt *s, Vectorizer *v, Reg *r)
+{
+    return !r->var && s->ndefs[r->vn] == 1 && v->uses[r->vn] == v->loop_uses[r->vn];
+}
+
+static bool is_bump(Loop *loop, IV *iv, IR *ir)
+{
+    if (ir->op != IR_ADD || ir->d != ir->a || ir->b)
+    {
+        return false;
+    }
+    for (Shadow *sh = loop->shadows; sh; sh = sh->next)
+    {
+        if (sh->reg == ir->d && sh->iv == iv)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool add_access(LoopOpt *s, Loop *loop, Vectorizer *v, IR *ir)
+{
+    IV *iv = v->iv;
+    if (!set_elem_type(v, ir->ty))
+    {
+        return false;
+    }
+
+    Stream st = {.imm = ir->imm};
+    if (!ir->index && !ir->var)
+    {
+        Shadow *sh = loop->shadows;
+        while (sh && (sh->reg != ir->a || sh->iv != iv || sh->mul != ir->ty->size))
+        {
+            sh = sh->next;
+        }
+        if (!sh)
+        {
+            return false;
+        }
+        st.shadow = st.ptr = sh->reg;
+        st.base = sh->base;
+        st.var = sh->var;
+    }
+    else if (ir->index == iv->reg && !iv->narrow && ir->scale == ir->ty->size &&
+             (ir->var ? ir->var->is_local : is_invariant(s, ir->a)))
+    {
+        st.base = ir->var ? NULL : ir->a;
+        st.var = ir->var;
+    }
+    else
+    {
+        return false;
+    }
+
+    Stream *p = v->streams;
+    while (p < v->streams + v->nstreams && (p->shadow != st.shadow || p->base != st.base || p->var != st.var))
+    {
+        p++;
+    }
+    if (p == v->streams + v->nstreams)
+    {
+        if (v->nstreams == MAX_STREAMS)
+        {
+            return false;
+        }
+        if (!st.ptr)
+        {
+            st.ptr = add_reg(s->fn, false);
+        }
+        *p = st;
+        v->nstreams++;
+    }
+    p->shifted |= (p->imm != ir->imm);
+
+    IR *k = alloc_ir(ir->op, ir->ty, ir->tok);
+    k->a = p->ptr;
+    k->imm = ir->imm;
+    if (ir->op == IR_LOAD)
+    {
+        k->d = ir->d;
+        add_to_kernel(v, k);
+        return is_kernel_temp(s, v, ir->d);
+    }
+    p->stored = true;
+    k->b = ir->b;
+    add_to_kernel(v, k);
+    return use_operand(s, v, ir->b);
+}
+
+// Recognizes `var = var op x` or `t = var op x; var = mov t`, where
+// `var` is used nowhere else in the loop.
+static bool add_reduction(LoopOpt *s, Vectorizer *v, IR *ir)
+{
+    Reg *var = ir->a;
+    Reg *x = ir->b;
+    if (ir->op != IR_SUB && x && x->var && !(var && var->var))
+    {
+        var = ir->b;
+        x = ir->a;
+    }
+    if (!var || !x || !var->var || var->is_fp || var == v->iv->reg || s->loop_defs[var->vn] != 1 ||
+        v->loop_uses[var->vn] != 1 || v->red)
+    {
+        return false;
+    }
+
+    IR *mov = NULL;
+    if (ir->d != var)
+    {
+        mov = ir->next;
+        if (mov->op != IR_MOV || mov->a != ir->d || mov->d != var || v->uses[ir->d->vn] != 1)
+        {
+            return false;
+        }
+    }
+
+    switch (ir->op)
+    {
+    case IR_ADD:
+    case IR_SUB:
+    case IR_BITAND:
+    case IR_BITOR:
+    case IR_BITXOR:
+        break;
+    default:
+        return false;
+    }
+
+    // A long sum of ints is widened in the kernel.
+    if (v->wide && x == v->wide->d)
+    {
+        if ((ir->op != IR_ADD && ir->op != IR_SUB) || !is_integer(ir->ty) || ir->ty->size != 8)
+        {
+            return false;
+        }
+        x = v->wide->a;
+    }
+    else if (!set_elem_type(v, ir->ty) || !is_integer(ir->ty) || !use_operand(s, v, x))
+    {
+        return false;
+    }
+
+    IR *k = alloc_ir(ir->op, ir->ty, ir->tok);
+    k->d = k->a = add_reg(s->fn, false);
+    k->b = x;
+    add_to_kernel(v, k);
+    v->red_var = var;
+    v->red = k;
+    v->red_mov = mov;
+    return true;
+}
+
+static bool add_insn(LoopOpt *s, Loop *loop, Vectorizer *v, IR *ir)
+{
+    switch (ir->op)
+    {
+    case IR_LOAD:
+    case IR_STORE:
+        return add_access(s, loop, v, ir);
+    case IR_CAST:
+        // Sign extension of an int to be summed up as a long
+        if (v->wide || !is_integer(ir->ty) || ir->ty->size != 8 || !is_integer(ir->from) || ir->from->size != 4 ||
+            ir->from->is_unsigned || !v->ty || !same_shape(v->ty, ir->from) || !in_kernel(v, ir->a) ||
+            !is_kernel_temp(s, v, ir->d) || v->uses[ir->d->vn] != 1)
+        {
+            return false;
+        }
+        v->wide = ir;
+        return true;
+    case IR_ADD:
+    case IR_SUB:
+    case IR_MUL:
+    case IR_DIV:
+    case IR_BITAND:
+    case IR_BITOR:
+    case IR_BITXOR:
+        break;
+    default:
+        return false;
+    }
+
+    if (ir->var)
+    {
+        return false;
+    }
+    if (ir->d->var || (ir->next->op == IR_MOV && ir->next->a == ir->d && ir->next->d->var))
+    {
+        return add_reduction(s, v, ir);
+    }
+
+    // SSE2 has no multiplication of 32-bit integers, nor division of
+    // integers.
+    if (!set_elem_type(v, ir->ty) || !is_kernel_temp(s, v, ir->d) ||
+        (!is_flonum(ir->ty) && (ir->op == IR_MUL || ir->op == IR_DIV)) ||
+        (is_flonum(ir->ty) && ir->op >= IR_BITAND))
+    {
+        return false;
+    }
+
+    IR *k = alloc_ir(ir->op, ir->ty, ir->tok);
+    k->d = ir->d;
+    k->a = ir->a;
+    k->b = ir->b;
+    if (!ir->b)
+    {
+        if (is_flonum(ir->ty))
+        {
+            return false;
+        }
+        IR *imm = alloc_ir(IR_IMM, ir->ty, ir->tok);
+        imm->d = k->b = add_reg(s->fn, false);
+        imm->imm = ir->imm;
+        add_to_kernel(v, imm);
+    }
+    if (!use_operand(s, v, ir->a) || !use_operand(s, v, k->b))
+    {
+        return false;
+    }
+    add_to_kernel(v, k);
+    return true;
+}
+
+// Returns the variable an address is based on, if known.
+static Var *object_of(LoopOpt *s, Stream *st)
+{
+    if (st->var)
+    {
+        return st->var;
+    }
+    if (s->ndefs[st->base->vn] != 1)
+    {
+        return NULL;
+    }
+    for (BB *bb = s->fn->bbs; bb; bb = bb->next)
+    {
+        for (IR *ir = bb->ir; ir; ir = ir->next)
+        {
+            if (ir->d == st->base)
+            {
+                return (ir->op == IR_LADDR || ir->op == IR_GADDR) ? ir->var : NULL;
+            }
+        }
+    }
+    return NULL;
+}
+
+static bool is_restrict(Reg *r)
+{
+    return r && r->var && r->var->ty->kind == TY_PTR && r->var->ty->is_restrict;
+}
+
+// Returns true if two arrays are known not to overlap. An object
+// accessed through a restrict pointer is not accessed through any
+// other variable.
+static bool disjoint(LoopOpt *s, Stream *x, Stream *y)
+{
+    Var *vx = object_of(s, x);
+    Var *vy = object_of(s, y);
+    if (vx && vy)
+    {
+        return vx != vy;
+    }
+    if (!is_restrict(x->base))
+    {
+        Stream *tmp = x;
+        x = y;
+        y = tmp;
+        Var *vtmp = vx;
+        vx = vy;
+        vy = vtmp;
+    }
+    if (!is_restrict(x->base))
+    {
+        return false;
+    }
+    return vy || (y->base->var && y->base->var != x->base->var);
+}
+
+// Walks the body of a loop from the header's successor back to the
+// header, translating each instruction to the kernel.
+static bool build_kernel(LoopOpt *s, Loop *loop, Vectorizer *v)
+{
+    IV *iv = v->iv;
+    BB *header = loop->header;
+    int nblocks = 1;
+    bool updated = false;
+    for (BB *bb = header->last->bb1; bb != header; bb = bb->last->bb1)
+    {
+        if (!in_loop(loop, bb) || bb->last->op != IR_JMP || ++nblocks > loop->nblocks)
+        {
+            return false;
+        }
+        for (IR *ir = bb->ir; ir != bb->last; ir = ir->next)
+        {
+            // The kernel addresses every array as of the start of an
+            // iteration, so it must come before the update of `i`.
+            if (ir == iv->update)
+            {
+                updated = true;
+                continue;
+            }
+            if (ir == v->red_mov || is_bump(loop, iv, ir) || (iv->update->op == IR_MOV && ir->d == iv->update->a))
+            {
+                continue;
+            }
+            if (updated || !add_insn(s, loop, v, ir))
+            {
+                return false;
+            }
+        }
+    }
+    if (nblocks != loop->nblocks || !v->ty || !v->nstreams)
+    {
+        return false;
+    }
+    if (v->wide && (!v->red || v->red->b != v->wide->a))
+    {
+        return false;
+    }
+
+    for (int i = 0; i < v->nstreams; i++)
+    {
+        Stream *x = &v->streams[i];
+        if (x->stored && x->shifted)
+        {
+            return false;
+        }
+        for (int j = i + 1; j < v->nstreams; j++)
+        {
+            Stream *y = &v->streams[j];
+            if ((x->stored || y->stored) && !disjoint(s, x, y))
+            {
+                return false;
+            }
+        }
+    }
+    return v->nvalues + (v->red != NULL) <= MAX_VEC_VALUES;
+}
+
+// Returns a register holding a 32-bit value, or a constant if `r` is
+// NULL, as a long.
+static Reg *to_long(Var *fn, BB *bb, Reg *r, int64_t imm, bool narrow, Token *tok)
+{
+    if (r && !narrow)
+    {
+        return r;
+    }
+    IR *ir;
+    if (r)
+    {
+        ir = alloc_ir(IR_CAST, ty_long, tok);
+        ir->from = ty_int;
+        ir->a = r;
+    }
+    else
+    {
+        ir = alloc_ir(IR_IMM, ty_long, tok);
+        ir->imm = imm;
+    }
+    ir->d = add_reg(fn, false);
+    append_ir(bb, ir);
+    return ir->d;
+}
+
+static IR *append_binary(Var *fn, BB *bb, IROp op, Reg *d, Reg *a, Reg *b, int64_t imm, Token *tok)
+{
+    IR *ir = alloc_ir(op, ty_long, tok);
+    ir->d = d ? d : add_reg(fn, false);
+    ir->a = a;
+    ir->b = b;
+    ir->imm = imm;
+    append_ir(bb, ir);
+    return ir;
+}
+
+// Runs the vectorized loop before the original one, which does the
+// remaining iterations.
+static void emit_vloop(LoopOpt *s, Loop *loop, Vectorizer *v)
+{
+    Var *fn = s->fn;
+    IV *iv = v->iv;
+    IR *cbr = loop->header->last;
+    Token *tok = cbr->tok;
+    int width = VEC_SIZE / v->ty->size;
+
+    // Enter it if at least `width` iterations are left.
+    BB *check = new_bb();
+    Reg *end = to_long(fn, check, cbr->b, cbr->imm, iv->narrow, tok);
+    Reg *i = to_long(fn, check, iv->reg, 0, iv->narrow, tok);
+    Reg *left = append_binary(fn, check, IR_SUB, NULL, end, i, 0, tok)->d;
+    IR *br = alloc_ir(IR_CBR, ty_long, tok);
+    br->cmp = IR_LT;
+    br->a = left;
+    br->imm = width;
+    br->bb1 = loop->header;
+    append_ir(check, br);
+
+    BB *body = new_bb();
+    br->bb2 = body;
+    Reg *count = append_binary(fn, body, IR_BITAND, NULL, left, NULL, -width, tok)->d;
+    for (int j = 0; j < v->nstreams; j++)
+    {
+        Stream *st = &v->streams[j];
+        if (!st->shadow)
+        {
+            IR *lea = alloc_ir(IR_LEA, ty_long, tok);
+            lea->d = st->ptr;
+            lea->a = st->base;
+            lea->var = st->var;
+            lea->index = iv->reg;
+            lea->scale = v->ty->size;
+            append_ir(body, lea);
+        }
+    }
+
+    IR *vloop = alloc_ir(IR_VLOOP, v->ty, tok);
+    vloop->a = count;
+    vloop->d = v->red ? v->red->d : NULL;
+    vloop->kernel = v->head.next;
+    vloop->args = arena_alloc(&ir_arena, (v->nstreams + v->nargs) * sizeof(Reg *));
+    for (int j = 0; j < v->nstreams; j++)
+    {
+        vloop->args[vloop->nargs++] = v->streams[j].ptr;
+    }
+    for (int j = 0; j < v->nargs; j++)
+    {
+        vloop->args[vloop->nargs++] = v->args[j];
+    }
+    append_ir(body, vloop);
+
+    // Skip the iterations done.
+    append_binary(fn, body, IR_ADD, iv->reg, iv->reg, count, 0, tok)->ty = iv->narrow ? ty_int : ty_long;
+    for (Shadow *sh = loop->shadows; sh; sh = sh->next)
+    {
+        if (sh->iv != iv)
+        {
+            continue;
+        }
+        if (sh->mul == 1 || sh->mul == 2 || sh->mul == 4 || sh->mul == 8)
+        {
+            IR *lea = alloc_ir(IR_LEA, ty_long, tok);
+            lea->d = lea->a = sh->reg;
+            lea->index = count;
+            lea->scale = sh->mul;
+            append_ir(body, lea);
+        }
+        else
+        {
+            Reg *t = append_binary(fn, body, IR_MUL, NULL, count, NULL, sh->mul, tok)->d;
+            append_binary(fn, body, IR_ADD, sh->reg, sh->reg, t, 0, tok);
+        }
+    }
+    if (v->red)
+    {
+        IROp op = (v->red->op == IR_SUB) ? IR_ADD : v->red->op;
+        append_binary(fn, body, op, v->red_var, v->red_var, v->red->d, 0, tok)->ty = v->red->ty;
+    }
+    IR *jmp = alloc_ir(IR_JMP, ty_void, tok);
+    jmp->bb1 = loop->header;
+    append_ir(body, jmp);
+
+    BB *pre = loop->preheader;
+    pre->last->bb1 = check;
+    pre->next = check;
+    check->next = body;
+    body->next = loop->header;
+    for (Loop *outer = loop->next; outer; outer = outer->next)
+    {
+        if (in_loop(outer, loop->header))
+        {
+            add_to_loop(outer, check);
+            add_to_loop(outer, body);
+        }
+    }
+}
+
+static bool vectorize(LoopOpt *s, Loop *loop)
+{
+    IV *iv = counted_loop(s, loop);
+    if (!iv || iv->step != 1 || loop->header->last->cmp != IR_LT)
+    {
+        return false;
+    }
+
+    Vectorizer v = {.iv = iv};
+    v.cur = &v.head;
+    v.uses = calloc(s->fn->nregs, sizeof(int));
+    v.loop_uses = calloc(s->fn->nregs, sizeof(int));
+    count_uses(s, loop, v.uses, v.loop_uses);
+
+    bool ok = build_kernel(s, loop, &v);
+    if (ok)
+    {
+        emit_vloop(s, loop, &v);
+    }
+    free(v.uses);
+    free(v.loop_uses);
+    return ok;
+}
+
+// Unrolling stops at bodies of this many instructions in all.
+#define UNROLL_MAX_INSNS 64
+
+static bool is_innermost(LoopOpt *s, Loop *loop)
+{
+    for (Loop *other = s->loops; other; other = other->next)
+    {
+        if (other != loop && in_loop(loop, other->header))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static Reg *rename_reg(Reg **map, Reg *r)
+{
+    return (r && map[r->vn]) ? map[r->vn] : r;
+}
+
+// Copies the blocks of a loop body once, with fresh registers for the
+// temporaries defined in it. Edges back to the header go to `next`.
+static void copy_body(LoopOpt *s, Loop *loop, BB **body, BB **copy, int n, BB *next, Reg **map, int nregs,
+                      int *uses, int *loop_uses)
+{
+    memset(map, 0, nregs * sizeof(Reg *));
+    for (int j = 0; j < n; j++)
+    {
+        copy[j] = new_bb();
+    }
+
+    for (int j = 0; j < n; j++)
+    {
+        for (IR *ir = body[j]->ir; ir; ir = ir->next)
+        {
+            IR *k = alloc_ir(ir->op, ir->ty, ir->tok);
+            *k = *ir;
+            k->next = NULL;
+            k->a = rename_reg(map, ir->a);
+            k->b = rename_reg(map, ir->b);
+            k->index = rename_reg(map, ir->index);
+            if (ir->nargs)
+            {
+                k->args = arena_alloc(&ir_arena, ir->nargs * sizeof(Reg *));
+                for (int i = 0; i < ir->nargs; i++)
+                {
+                    k->args[i] = rename_reg(map, ir->args[i]);
+                }
+            }
+
+            Reg *d = ir->d;
+            if (d && !d->var && s->ndefs[d->vn] == 1 && uses[d->vn] == loop_uses[d->vn])
+            {
+                k->d = map[d->vn] = add_reg(s->fn, d->is_fp);
+            }
+            append_ir(copy[j], k);
+        }
+
+        IR *last = copy[j]->last;
+        BB *succ[] = {last->bb1, last->bb2};
+        for (int i = 0; i < 2; i++)
+        {
+            if (succ[i] == loop->header)
+            {
+                retarget(last, succ[i], next);
+                continue;
+            }
+            for (int m = 0; m < n; m++)
+            {
+                if (succ[i] == body[m])
+                {
+                    retarget(last, succ[i], copy[m]);
+                }
+            }
+        }
+    }
+}
+
+// Runs `factor` iterations of a counted loop per test of the condition
+// while enough of them are left. The original loop does the rest.
+static void unroll(LoopOpt *s, Loop *loop)
+{
+    IV *iv = counted_loop(s, loop);
+    if (!iv || !is_innermost(s, loop))
+    {
+        return;
+    }
+
+    int n = loop->nblocks - 1;
+    int ninsns = 0;
+    BB **body = calloc(n, sizeof(BB *));
+    int j = 0;
+    for (BB *bb = s->fn->bbs; bb; bb = bb->next)
+    {
+        if (bb == loop->header || !in_loop(loop, bb))
+        {
+            continue;
+        }
+        if (bb->last->op == IR_JTAB)
+        {
+            free(body);
+            return;
+        }
+        body[j++] = bb;
+        for (IR *ir = bb->ir; ir; ir = ir->next)
+        {
+            ninsns++;
+        }
+    }
+
+    int factor = MIN(opt_funroll_loops, UNROLL_MAX_INSNS / ninsns);
+    int64_t min_left = (factor - 1) * iv->step;
+    if (factor < 2 || !fits_int32(min_left))
+    {
+        free(body);
+        return;
+    }
+
+    Var *fn = s->fn;
+    IR *cbr = loop->header->last;
+    Token *tok = cbr->tok;
+
+    // Enter the unrolled loop if `i + (factor - 1) * step` still passes
+    // the test.
+    BB *check = new_bb();
+    Reg *end = to_long(fn, check, cbr->b, cbr->imm, iv->narrow, tok);
+    Reg *i = to_long(fn, check, iv->reg, 0, iv->narrow, tok);
+    Reg *left = append_binary(fn, check, IR_SUB, NULL, end, i, 0, tok)->d;
+    IR *br = alloc_ir(IR_CBR, ty_long, tok);
+    br->cmp = (cbr->cmp == IR_LT) ? IR_LE : IR_LT;
+    br->a = left;
+    br->imm = min_left;
+    br->bb1 = loop->header;
+    append_ir(check, br);
+
+    int nregs = fn->nregs;
+    int *uses = calloc(nregs, sizeof(int));
+    int *loop_uses = calloc(nregs, sizeof(int));
+    count_uses(s, loop, uses, loop_uses);
+    Reg **map = calloc(nregs, sizeof(Reg *));
+    BB **copies = calloc(factor * n, sizeof(BB *));
+
+    // Make the copies from the last one, which jumps back to the check.
+    BB *next = check;
+    int entry = 0;
+    while (body[entry] != cbr->bb1)
+    {
+        entry++;
+    }
+    for (int c = factor - 1; c >= 0; c--)
+    {
+        copy_body(s, loop, body, copies + c * n, n, next, map, nregs, uses, loop_uses);
+        next = copies[c * n + entry];
+    }
+    br->bb2 = next;
+
+    BB *pre = loop->preheader;
+    pre->last->bb1 = check;
+    pre->next = check;
+    BB *prev = check;
+    for (int k = 0; k < factor * n; k++)
+    {
+        prev = prev->next = copies[k];
+    }
+    prev->next = loop->header;
+
+    for (Loop *outer = loop->next; outer; outer = outer->next)
+    {
+        if (in_loop(outer, loop->header))
+        {
+            add_to_loop(outer, check);
+            for (int k = 0; k < factor * n; k++)
+            {
+                add_to_loop(outer, copies[k]);
+            }
+        }
+    }
+
+    free(copies);
+    free(map);
+    free(uses);
+    free(loop_uses);
+    free(body);
+}
+
+static void count_defs(LoopOpt *s, Loop *loop)
+{
+    int nregs = s->fn->nregs;
+    free(s->ndefs);
+    free(s->loop_defs);
+    free(s->affine);
+    free(s->aff_stamp);
+    s->ndefs = calloc(nregs, sizeof(int));
+    s->loop_defs = calloc(nregs, sizeof(int));
+    s->affine = calloc(nregs, sizeof(Affine));
+    s->aff_stamp = calloc(nregs, sizeof(int));
+    s->stamp = 0;
+
+    for (BB *bb = s->fn->bbs; bb; bb = bb->next)
+    {
+        bool inside = in_loop(loop, bb);
+        for (IR *ir = bb->ir; ir; ir = ir->next)
+        {
+            if (ir->d)
+            {
+                s->ndefs[ir->d->vn]++;
+                if (inside)
+                {
+                    s->loop_defs[ir->d->vn]++;
+                }
+            }
+        }
+    }
+}
+
+void optimize_loops(Var *fn)
+{
+    LoopOpt s = {.fn = fn};
+    for (BB *bb = fn->bbs; bb; bb = bb->next)
+    {
+        s.nbbs++;
+    }
+    s.bbs = calloc(s.nbbs, sizeof(BB *));
+    int i = 0;
+    for (BB *bb = fn->bbs; bb; bb = bb->next, i++)
+    {
+        s.bbs[i] = bb;
+        hashmap_put_ptr(&s.index, bb, (void *)(intptr_t)(i + 1));
+    }
+
+    compute_dominators(&s);
+    find_loops(&s);
+
+    for (Loop *loop = s.loops; loop; loop = loop->next)
+    {
+        add_preheader(&s, loop);
+        count_defs(&s, loop);
+        hoist_invariants(&s, loop);
+        reduce_strength(&s, loop);
+
+        // Drop the computations strength reduction made unused.
+        remove_dead_insns(fn);
+        count_defs(&s, loop);
+        if (!vectorize(&s, loop) && opt_funroll_loops > 1)
+        {
+            unroll(&s, loop);
+        }
+    }
+
+    while (s.loops)
+    {
+        Loop *loop = s.loops;
+        s.loops = loop->next;
+        while (loop->ivs)
+        {
+            IV *iv = loop->ivs;
+            loop->ivs = iv->next;
+            free(iv);
+        }
+        while (loop->shadows)
+        {
+            Shadow *sh = loop->shadows;
+            loop->shadows = sh->next;
+            free(sh);
+        }
+        hashmap_free(&loop->body);
+        free(loop);
+    }
+    free(s.bbs);
+    free(s.idom);
+    free(s.ndefs);
+    free(s.loop_defs);
+    free(s.affine);
+    free(s.aff_stamp);
+    hashmap_free(&s.index);
+}
@@ -0,0 +1,376 @@
+#include "zcc.h"
+
+// Optimizations on the IR. They run at -O1 after every function has
+// been lowered and before registers are allocated.
+
+static bool same_type(Type *x, Type *y)
+{
+    return x->kind == y->kind && x->size == y->size && x->is_unsigned == y->is_unsigned;
+}
+
+// Returns true if the address of a local variable may escape, in
+// which case a callee may still refer to the frame of `fn`.
+static bool frame_escapes(Var *fn)
+{
+    for (BB *bb = fn->bbs; bb; bb = bb->next)
+    {
+        for (IR *ir = bb->ir; ir; ir = ir->next)
+        {
+            if (ir->op == IR_LADDR || (ir->op == IR_LEA && ir->var && ir->var->is_local))
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Returns true if a call passes some arguments on the stack. The
+// stack arguments of a tail call would have to go where the caller's
+// own arguments are, which may be too small to hold them.
+static bool has_stack_args(IR *call)
+{
+    int gp = 0, fp = 0;
+    for (int i = 0; i < call->nargs; i++)
+    {
+        if (call->args[i]->is_fp)
+        {
+            fp++;
+        }
+        else
+        {
+            gp++;
+        }
+    }
+    return gp > 6 || fp > 8;
+}
+
+// Replaces a call of `fn` to itself with assignments to the
+// parameters and a jump back to the entry block.
+static void self_tail_call(Var *fn, BB *bb, IR *prev, IR *call)
+{
+    IR head = {};
+    IR *cur = &head;
+
+    // An argument may be read after the parameter it comes from has
+    // been assigned, so such arguments are copied first.
+    Reg **args = arena_alloc(&ir_arena, call->nargs * sizeof(Reg *));
+    for (int i = 0; i < call->nargs; i++)
+    {
+        args[i] = call->args[i];
+        if (args[i]->var)
+        {
+            IR *ir = cur = cur->next = alloc_ir(IR_MOV, args[i]->var->ty, call->tok);
+            ir->d = args[i] = add_reg(fn, args[i]->is_fp);
+            ir->a = call->args[i];
+        }
+    }
+
+    int i = 0;
+    for (Var *param = fn->params; param; param = param->next, i++)
+    {
+        IR *ir;
+        if (param->reg)
+        {
+            ir = cur = cur->next = alloc_ir(IR_MOV, param->ty, call->tok);
+            ir->d = param->reg;
+            ir->a = args[i];
+        }
+        else
+        {
+            ir = cur = cur->next = alloc_ir(IR_STORE, param->ty, call->tok);
+            ir->var = param;
+            ir->b = args[i];
+        }
+    }
+
+    IR *jmp = cur = cur->next = alloc_ir(IR_JMP, ty_void, call->tok);
+    jmp->bb1 = fn->bbs;
+
+    if (prev)
+    {
+        prev->next = head.next;
+    }
+    else
+    {
+        bb->ir = head.next;
+    }
+    bb->last = jmp;
+}
+
+// Turns `d = call f(...); ret d` into a tail call, which reuses the
+// frame of the caller. This is only safe if nothing in the callee can
+// point into that frame.
+static void tail_calls(Var *fn)
+{
+    if (fn->va_area || frame_escapes(fn))
+    {
+        return;
+    }
+
+    int nparams = 0;
+    for (Var *param = fn->params; param; param = param->next)
+    {
+        nparams++;
+    }
+
+    for (BB *bb = fn->bbs; bb; bb = bb->next)
+    {
+        IR *prev = NULL;
+        IR *call = bb->ir;
+        if (!call || call == bb->last)
+        {
+            continue;
+        }
+        while (call->next != bb->last)
+        {
+            prev = call;
+            call = call->next;
+        }
+
+        IR *ret = bb->last;
+        if (call->op != IR_CALL || ret->op != IR_RET)
+        {
+            continue;
+        }
+        if (ret->a && (ret->a != call->d || !same_type(ret->ty, call->ty)))
+        {
+            continue;
+        }
+
+        if (!strcmp(call->funcname, fn->name) && call->nargs == nparams)
+        {
+            self_tail_call(fn, bb, prev, call);
+            continue;
+        }
+
+        if (has_stack_args(call))
+        {
+            continue;
+        }
+
+        call->op = IR_TAILCALL;
+        call->d = NULL;
+        call->next = NULL;
+        bb->last = call;
+    }
+}
+
+static void mark_bb(BB *bb, HashMap *live)
+{
+    if (hashmap_get_ptr(live, bb))
+    {
+        return;
+    }
+    hashmap_put_ptr(live, bb, bb);
+
+    IR *ir = bb->last;
+    if (ir->bb1)
+    {
+        mark_bb(ir->bb1, live);
+    }
+    if (ir->bb2)
+    {
+        mark_bb(ir->bb2, live);
+    }
+    for (int i = 0; i < ir->ntargets; i++)
+    {
+        mark_bb(ir->targets[i], live);
+    }
+}
+
+// Removes blocks that cannot be reached from the entry, such as code
+// after a return or a goto.
+static void remove_dead_blocks(Var *fn)
+{
+    HashMap live = {};
+    mark_bb(fn->bbs, &live);
+
+    for (BB *bb = fn->bbs; bb->next;)
+    {
+        if (hashmap_get_ptr(&live, bb->next))
+        {
+            bb = bb->next;
+        }
+        else
+        {
+            bb->next = bb->next->next;
+        }
+    }
+    hashmap_free(&live);
+}
+
+static void count_use(Reg *r, int *uses)
+{
+    if (r)
+    {
+        uses[r->vn]++;
+    }
+}
+
+static void drop_use(Reg *r, int *uses)
+{
+    if (r)
+    {
+        uses[r->vn]--;
+    }
+}
+
+// Returns true if an instruction does nothing but define `d`. Loads
+// are kept since the type system does not track `volatile`.
+static bool is_pure(IR *ir)
+{
+    switch (ir->op)
+    {
+    case IR_LOAD:
+    case IR_STORE:
+    case IR_MEMZERO:
+    case IR_MEMCPY:
+    case IR_CALL:
+    case IR_VLOOP:
+        return false;
+    }
+    return ir->d;
+}
+
+// Removes instructions whose results are never used, such as the old
+// value computed by a postfix increment in a statement of its own.
+void remove_dead_insns(Var *fn)
+{
+    int *uses = calloc(fn->nregs, sizeof(int));
+    for (BB *bb = fn->bbs; bb; bb = bb->next)
+    {
+        for (IR *ir = bb->ir; ir; ir = ir->next)
+        {
+            count_use(ir->a, uses);
+            count_use(ir->b, uses);
+            count_use(ir->index, uses);
+            for (int i = 0; i < ir->nargs; i++)
+            {
+                count_use(ir->args[i], uses);
+            }
+        }
+    }
+
+    // Removing an instruction may make the ones computing its operands
+    // dead, so repeat until nothing changes.
+    for (bool changed = true; changed;)
+    {
+        changed = false;
+        for (BB *bb = fn->bbs; bb; bb = bb->next)
+        {
+            IR head = {.next = bb->ir};
+            for (IR *prev = &head; prev->next;)
+            {
+                IR *ir = prev->next;
+                if (!is_pure(ir) || uses[ir->d->vn])
+                {
+                    prev = ir;
+                    continue;
+                }
+                drop_use(ir->a, uses);
+                drop_use(ir->b, uses);
+                drop_use(ir->index, uses);
+                prev->next = ir->next;
+                changed = true;
+            }
+            bb->ir = head.next;
+        }
+    }
+    free(uses);
+}
+
+static void mark_function(char *name, HashMap *funcs, HashMap *live)
+{
+    Var *fn = hashmap_get(funcs, name);
+    if (!fn || hashmap_get_ptr(live, fn))
+    {
+        return;
+    }
+    hashmap_put_ptr(live, fn, fn);
+
+    for (BB *bb = fn->bbs; bb; bb = bb->next)
+    {
+        for (IR *ir = bb->ir; ir; ir = ir->next)
+        {
+            if (ir->funcname)
+            {
+                mark_function(ir->funcname, funcs, live);
+            }
+            if (ir->var && ir->var->is_function)
+            {
+                mark_function(ir->var->name, funcs, live);
+            }
+        }
+    }
+}
+
+// Removes static functions that no other function reaches. Functions
+// with external linkage are roots, and so are the functions whose
+// addresses are stored in global variables.
+static Var *remove_dead_functions(Var *prog)
+{
+    HashMap funcs = {};
+    for (Var *fn = prog; fn; fn = fn->next)
+    {
+        if (fn->is_function && fn->is_definition)
+        {
+            hashmap_put(&funcs, fn->name, fn);
+        }
+    }
+
+    HashMap live = {};
+    for (Var *var = prog; var; var = var->next)
+    {
+        if (var->is_function && var->is_definition && !var->is_static)
+        {
+            mark_function(var->name, &funcs, &live);
+        }
+        for (Relocation *rel = var->rel; rel; rel = rel->next)
+        {
+            mark_function(rel->label, &funcs, &live);
+        }
+    }
+
+    Var head = {};
+    Var *cur = &head;
+    for (Var *var = prog; var; var = var->next)
+    {
+        if (!var->is_function || !var->is_definition || hashmap_get_ptr(&live, var))
+        {
+            cur = cur->next = var;
+        }
+    }
+    cur->next = NULL;
+
+    hashmap_free(&funcs);
+    hashmap_free(&live);
+    return head.next;
+}
+
+Var *optimize_ir(Var *prog)
+{
+    for (Var *fn = prog; fn; fn = fn->next)
+    {
+        if (fn->is_function && fn->is_definition)
+        {
+            remove_dead_blocks(fn);
+        }
+    }
+
+    inline_functions(prog);
+
+    for (Var *fn = prog; fn; fn = fn->next)
+    {
+        if (fn->is_function && fn->is_definition)
+        {
+            tail_calls(fn);
+            eliminate_common_subexprs(fn);
+            optimize_loops(fn);
+            convert_to_selects(fn);
+            remove_dead_blocks(fn);
+            remove_dead_insns(fn);
+        }
+    }
+    return remove_dead_functions(prog);
+}
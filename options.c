@@ -0,0 +1,9 @@
+#include "zcc.h"
+
+// Command-line options that the compiler passes read. They live apart
+// from the driver in zcc.c so that programs linking the passes without
+// it, such as bench/tokenize, get them too.
+
+int opt_O;
+bool opt_fomit_frame_pointer;
+int opt_funroll_loops;
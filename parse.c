@@ -4,7 +4,6 @@
 typedef struct VarScope VarScope;
 struct VarScope
 {
-    VarScope *next;
     char *name;
     int depth;
     Var *var;
@@ -17,7 +16,6 @@ struct VarScope
 typedef struct TagScope TagScope;
 struct TagScope
 {
-    TagScope *next;
     char *name;
     int depth;
     Type *ty;
@@ -25,13 +23,19 @@ struct TagScope
     int enum_val;
 };
 
-// Represents a block scope.
+// Represents a block scope. Names declared in a scope are looked up
+// through per-scope hash tables, so a lookup costs one probe per
+// enclosing scope regardless of how many names each scope has.
 typedef struct Scope Scope;
 struct Scope
 {
     Scope *next;
-    VarScope *vars;
-    TagScope *tags;
+    HashMap vars;
+    HashMap tags;
+
+    // Lifetime bookkeeping for local variables
+    int start;   // value of scope_clock when the scope was entered
+    Var *locals; // head of `locals` when the scope was entered
 };
 
 // Variable attributes such as typedef or extern.
@@ -80,6 +84,11 @@ static Var *globals;
 
 static Scope *scope = &(Scope){};
 static int scope_depth;
+
+// Ticks on every scope entry and exit. Local variables are stamped
+// with it so that the code generator can tell which ones may share
+// a stack slot.
+static int scope_clock;
 static Var *current_fn;
 
 // Lists of all goto statements and labels in the curent function.
@@ -139,14 +148,30 @@ static Token *global_variable(Token *tok, Type *basety, VarAttr *attr);
 
 static void enter_scope(void)
 {
-    Scope *sc = calloc(1, sizeof(Scope));
+    Scope *sc = arena_alloc(&ast_arena, sizeof(Scope));
     sc->next = scope;
+    sc->start = ++scope_clock;
+    sc->locals = locals;
     scope = sc;
     scope_depth++;
 }
 
 static void leave_scope(void)
 {
+    // Nothing refers to the names of a closed scope anymore.
+    hashmap_free(&scope->vars);
+    hashmap_free(&scope->tags);
+
+    // Variables declared in this scope die here. Those of inner
+    // scopes have already been closed.
+    scope_clock++;
+    for (Var *var = locals; var != scope->locals; var = var->next)
+    {
+        if (!var->scope_end)
+        {
+            var->scope_end = scope_clock;
+        }
+    }
     scope = scope->next;
     scope_depth--;
 }
@@ -154,14 +179,17 @@ static void leave_scope(void)
 // Find a variable by name.
 static VarScope *find_var(Token *tok)
 {
+    if (!tok->ident)
+    {
+        return NULL;
+    }
+
     for (Scope *sc = scope; sc; sc = sc->next)
     {
-        for (VarScope *sc2 = sc->vars; sc2; sc2 = sc2->next)
+        VarScope *sc2 = hashmap_get_ptr(&sc->vars, tok->ident);
+        if (sc2)
         {
-            if (equal(tok, sc2->name))
-            {
-                return sc2;
-            }
+            return sc2;
         }
     }
     return NULL;
@@ -169,14 +197,17 @@ static VarScope *find_var(Token *tok)
 
 static TagScope *find_tag(Token *tok)
 {
+    if (!tok->ident)
+    {
+        return NULL;
+    }
+
     for (Scope *sc = scope; sc; sc = sc->next)
     {
-        for (TagScope *sc2 = sc->tags; sc2; sc2 = sc2->next)
+        TagScope *sc2 = hashmap_get_ptr(&sc->tags, tok->ident);
+        if (sc2)
         {
-            if (equal(tok, sc2->name))
-            {
-                return sc2;
-            }
+            return sc2;
         }
     }
     return NULL;
@@ -184,7 +215,7 @@ static TagScope *find_tag(Token *tok)
 
 static Node *new_node(NodeKind kind, Token *tok)
 {
-    Node *node = calloc(1, sizeof(Node));
+    Node *node = arena_alloc(&ast_arena, sizeof(Node));
     node->kind = kind;
     node->tok = tok;
     return node;
@@ -239,7 +270,7 @@ Node *new_cast(Node *expr, Type *ty)
 {
     add_type(expr);
 
-    Node *node = calloc(1, sizeof(Node));
+    Node *node = arena_alloc(&ast_arena, sizeof(Node));
     node->kind = ND_CAST;
     node->tok = expr->tok;
     node->lhs = expr;
@@ -249,17 +280,16 @@ Node *new_cast(Node *expr, Type *ty)
 
 static VarScope *push_scope(char *name)
 {
-    VarScope *sc = calloc(1, sizeof(VarScope));
+    VarScope *sc = arena_alloc(&ast_arena, sizeof(VarScope));
     sc->name = name;
     sc->depth = scope_depth;
-    sc->next = scope->vars;
-    scope->vars = sc;
+    hashmap_put_ptr(&scope->vars, name, sc);
     return sc;
 }
 
 static Initializer *new_initializer(Type *ty, bool is_flexible)
 {
-    Initializer *init = calloc(1, sizeof(Initializer));
+    Initializer *init = arena_alloc(&ast_arena, sizeof(Initializer));
     init->ty = ty;
 
     if (ty->kind == TY_ARRAY)
@@ -269,7 +299,7 @@ static Initializer *new_initializer(Type *ty, bool is_flexible)
             init->is_flexible = true;
             return init;
         }
-        init->children = calloc(ty->array_len, sizeof(Initializer *));
+        init->children = arena_alloc(&ast_arena, ty->array_len * sizeof(Initializer *));
         for (int i = 0; i < ty->array_len; i++)
         {
             init->children[i] = new_initializer(ty->base, false);
@@ -285,13 +315,13 @@ static Initializer *new_initializer(Type *ty, bool is_flexible)
             len++;
         }
 
-        init->children = calloc(len, sizeof(Initializer *));
+        init->children = arena_alloc(&ast_arena, len * sizeof(Initializer *));
 
         for (Member *mem = ty->members; mem; mem = mem->next)
         {
             if (is_flexible && ty->is_flexible && !mem->next)
             {
-                Initializer *child = calloc(1, sizeof(Initializer));
+                Initializer *child = arena_alloc(&ast_arena, sizeof(Initializer));
                 child->ty = mem->ty;
                 child->is_flexible = true;
                 init->children[mem->idx] = child;
@@ -309,7 +339,7 @@ static Initializer *new_initializer(Type *ty, bool is_flexible)
 
 static Var *new_var(char *name, Type *ty)
 {
-    Var *var = calloc(1, sizeof(Var));
+    Var *var = arena_alloc(&ast_arena, sizeof(Var));
     var->name = name;
     var->ty = ty;
     var->align = ty->align;
@@ -321,6 +351,7 @@ static Var *new_lvar(char *name, Type *ty)
 {
     Var *var = new_var(name, ty);
     var->is_local = true;
+    var->scope_start = scope->start;
     var->next = locals;
     locals = var;
     return var;
@@ -360,7 +391,7 @@ static char *get_ident(Token *tok)
     {
         error_tok(tok, "expected an identifier");
     }
-    return strndup(tok->loc, tok->len);
+    return tok->ident;
 }
 
 static Type *find_typedef(Token *tok)
@@ -378,12 +409,11 @@ static Type *find_typedef(Token *tok)
 
 static void push_tag_scope(Token *tok, Type *ty)
 {
-    TagScope *sc = calloc(1, sizeof(TagScope));
-    sc->name = strndup(tok->loc, tok->len);
+    TagScope *sc = arena_alloc(&ast_arena, sizeof(TagScope));
+    sc->name = tok->ident;
     sc->depth = scope_depth;
     sc->ty = ty;
-    sc->next = scope->tags;
-    scope->tags = sc;
+    hashmap_put_ptr(&scope->tags, sc->name, sc);
 }
 
 // func-params = ("void" | param ("," param)* ("," "...")?)? ")"
@@ -718,6 +748,10 @@ static Type *pointers(Token **rest, Token *tok, Type *ty)
         while (equal(tok, "const") || equal(tok, "volatile") || equal(tok, "restrict") ||
                equal(tok, "__restrict") || equal(tok, "__restrict__"))
         {
+            if (!equal(tok, "const") && !equal(tok, "volatile"))
+            {
+                ty->is_restrict = true;
+            }
             tok = tok->next;
         }
     }
@@ -1016,7 +1050,7 @@ static Type *copy_struct_type(Type *ty)
     Member *cur = &head;
     for (Member *mem = ty->members; mem; mem = mem->next)
     {
-        Member *m = calloc(1, sizeof(Member));
+        Member *m = arena_alloc(&type_arena, sizeof(Member));
         *m = *mem;
         cur = cur->next = m;
     }
@@ -1349,7 +1383,7 @@ static Relocation *write_gvar_data(Relocation *cur, Initializer *init, Type *ty,
         return cur;
     }
 
-    Relocation *rel = calloc(1, sizeof(Relocation));
+    Relocation *rel = arena_alloc(&ast_arena, sizeof(Relocation));
     rel->offset = offset;
     rel->label = label;
     rel->addend = val;
@@ -1362,7 +1396,7 @@ static void gvar_initializer(Token **rest, Token *tok, Var *var)
     Initializer *init = initializer(rest, tok, var->ty, &var->ty);
 
     Relocation head = {};
-    char *buf = calloc(1, var->ty->size);
+    char *buf = arena_alloc(&ast_arena, var->ty->size);
     write_gvar_data(&head, init, var->ty, buf, 0);
     var->init_data = buf;
     var->rel = head.next;
@@ -1481,7 +1515,7 @@ static Node *stmt(Token **rest, Token *tok)
         }
 
         Node *node = new_node(ND_CASE, tok);
-        int val = const_expr(&tok, tok->next);
+        int64_t val = const_expr(&tok, tok->next);
         tok = skip(tok, ":");
         node->label = new_unique_name();
         node->lhs = stmt(rest, tok);
@@ -1625,7 +1659,7 @@ static Node *stmt(Token **rest, Token *tok)
     if (tok->kind == TK_IDENT && equal(tok->next, ":"))
     {
         Node *node = new_node(ND_LABEL, tok);
-        node->label = strndup(tok->loc, tok->len);
+        node->label = tok->ident;
         node->unique_label = new_unique_name();
         node->lhs = stmt(rest, tok->next->next);
         node->goto_next = labels;
@@ -1973,6 +2007,13 @@ static Node *to_assign(Node *binary)
     add_type(binary->rhs);
     Token *tok = binary->tok;
 
+    // Convert `A op= B` to `A = A op B` if evaluating A has no side
+    // effects, so that A's address is not taken.
+    if (binary->lhs->kind == ND_VAR)
+    {
+        return new_binary(ND_ASSIGN, binary->lhs, binary, tok);
+    }
+
     Var *var = new_lvar("", pointer_to(binary->lhs->ty));
 
     Node *expr1 = new_binary(ND_ASSIGN,
@@ -2449,7 +2490,7 @@ static void struct_members(Token **rest, Token *tok, Type *ty)
             }
             first = false;
 
-            Member *mem = calloc(1, sizeof(Member));
+            Member *mem = arena_alloc(&type_arena, sizeof(Member));
             mem->ty = declarator(&tok, tok, basety);
             mem->name = mem->ty->name;
             mem->idx = idx++;
@@ -2579,8 +2620,7 @@ static Member *get_struct_member(Type *ty, Token *tok)
 {
     for (Member *mem = ty->members; mem; mem = mem->next)
     {
-        if (mem->name->len == tok->len &&
-            !strncmp(mem->name->loc, tok->loc, tok->len))
+        if (mem->name->ident == tok->ident)
         {
             return mem;
         }
@@ -2715,7 +2755,7 @@ static Node *funcall(Token **rest, Token *tok)
     *rest = skip(tok, ")");
 
     Node *node = new_node(ND_FUNCALL, start);
-    node->funcname = strndup(start->loc, start->len);
+    node->funcname = start->ident;
     node->func_ty = ty;
     node->ty = ty->return_ty;
     node->args = head.next;
@@ -2736,7 +2776,16 @@ static Node *primary(Token **rest, Token *tok)
     {
         // This is a GNU statement expresssion.
         Node *node = new_node(ND_STMT_EXPR, tok);
+        Var *mark = locals;
         node->body = compound_stmt(&tok, tok->next->next)->body;
+
+        // The value of a statement expression may live in one of its
+        // variables, so they stay alive as long as the enclosing block.
+        for (Var *var = locals; var != mark; var = var->next)
+        {
+            var->scope_start = scope->start;
+            var->scope_end = 0;
+        }
         *rest = skip(tok, ")");
         return node;
     }
@@ -2867,7 +2916,7 @@ static void resolve_goto_labels(void)
     {
         for (Node *y = labels; y; y = y->goto_next)
         {
-            if (!strcmp(x->label, y->label))
+            if (x->label == y->label)
             {
                 x->unique_label = y->unique_label;
                 break;
@@ -2908,7 +2957,7 @@ static Token *function(Token *tok, Type *basety, VarAttr *attr)
     fn->params = locals;
     if (ty->is_variadic)
     {
-        fn->va_area = new_lvar("__va_area__", array_of(ty_char, 136));
+        fn->va_area = new_lvar(intern("__va_area__", strlen("__va_area__")), array_of(ty_char, 136));
     }
 
     tok = skip(tok, "{");
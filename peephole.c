@@ -0,0 +1,712 @@
+#include "zcc.h"
+
+// Peephole optimizer.
+//
+// The code generator hands the assembly of a function to this file
+// line by line. The lines are parsed into a list of instructions, a
+// table of local rewrite patterns is applied until none of them
+// matches, and the result is printed.
+
+typedef struct Insn Insn;
+struct Insn
+{
+    Insn *next;
+    Insn *prev;
+    char *label; // Label name if this is a label
+    char *op;    // Mnemonic or directive
+    char *args[3];
+    int nargs;
+    char *comment;
+};
+
+typedef struct
+{
+    char *name;
+    bool (*fn)(Insn *insn);
+    int hits;
+    int removed;
+} Pattern;
+
+static Insn head = {&head, &head};
+static HashMap labels; // label name -> Insn
+static HashMap refs;   // label name -> number of references
+static int ninsns;
+
+static char *copy(char *s, int len)
+{
+    char *buf = arena_alloc(&asm_arena, len + 1);
+    memcpy(buf, s, len);
+    return buf;
+}
+
+static char *trim(char *s, int len)
+{
+    while (len > 0 && isspace(*s))
+    {
+        s++;
+        len--;
+    }
+    while (len > 0 && isspace(s[len - 1]))
+    {
+        len--;
+    }
+    return copy(s, len);
+}
+
+static Insn *new_insn(void)
+{
+    return arena_alloc(&asm_arena, sizeof(Insn));
+}
+
+static void insert_before(Insn *pos, Insn *insn)
+{
+    insn->prev = pos->prev;
+    insn->next = pos;
+    pos->prev->next = insn;
+    pos->prev = insn;
+    ninsns++;
+}
+
+static void delete(Insn *insn)
+{
+    insn->prev->next = insn->next;
+    insn->next->prev = insn->prev;
+    ninsns--;
+}
+
+// Parses a single instruction, a label or a directive.
+static void parse_one(char *s, int len)
+{
+    Insn *insn = new_insn();
+
+    char *hash = memchr(s, '#', len);
+    if (hash)
+    {
+        insn->comment = trim(hash + 1, s + len - hash - 1);
+        len = hash - s;
+    }
+
+    while (len > 0 && isspace(*s))
+    {
+        s++;
+        len--;
+    }
+
+    // "label:" or "label: insn"
+    int i = 0;
+    while (i < len && (isalnum(s[i]) || s[i] == '_' || s[i] == '.'))
+    {
+        i++;
+    }
+    if (i > 0 && i < len && s[i] == ':')
+    {
+        insn->label = copy(s, i);
+        insert_before(&head, insn);
+        if (i + 1 < len)
+        {
+            parse_one(s + i + 1, len - i - 1);
+        }
+        return;
+    }
+
+    i = 0;
+    while (i < len && !isspace(s[i]))
+    {
+        i++;
+    }
+    insn->op = copy(s, i);
+
+    // Split operands at commas outside of parentheses.
+    int depth = 0;
+    int start = i;
+    for (; i <= len; i++)
+    {
+        if (i == len || (s[i] == ',' && depth == 0))
+        {
+            char *arg = trim(s + start, i - start);
+            if (*arg && insn->nargs < 3)
+            {
+                insn->args[insn->nargs++] = arg;
+            }
+            start = i + 1;
+        }
+        else if (s[i] == '(')
+        {
+            depth++;
+        }
+        else if (s[i] == ')')
+        {
+            depth--;
+        }
+    }
+
+    insert_before(&head, insn);
+}
+
+// Adds a line of assembly to the current function. A line may hold
+// several instructions separated by semicolons.
+void peephole_push(char *line)
+{
+    char *p = line;
+    for (;;)
+    {
+        char *q = strchr(p, ';');
+        if (!q)
+        {
+            parse_one(p, strlen(p));
+            return;
+        }
+        parse_one(p, q - p);
+        p = q + 1;
+    }
+}
+
+//
+// Helpers for patterns
+//
+
+static bool is_op(Insn *insn, char *op)
+{
+    return insn->op && !strcmp(insn->op, op);
+}
+
+static bool is_reg(char *arg)
+{
+    return arg[0] == '%';
+}
+
+static bool is_jump(Insn *insn)
+{
+    return insn->op && insn->op[0] == 'j';
+}
+
+static bool is_cond_jump(Insn *insn)
+{
+    return is_jump(insn) && strcmp(insn->op, "jmp");
+}
+
+// Returns true for `jmp L`, but not for an indirect jump.
+static bool is_direct_jmp(Insn *insn)
+{
+    return is_op(insn, "jmp") && insn->args[0][0] != '*';
+}
+
+static bool is_directive(Insn *insn)
+{
+    return insn->op && insn->op[0] == '.';
+}
+
+// Returns the next instruction, skipping directives such as `.loc`.
+static Insn *next_insn(Insn *insn)
+{
+    for (insn = insn->next; insn != &head && is_directive(insn); insn = insn->next)
+        ;
+    return insn;
+}
+
+// Returns the size in bytes of a general-purpose register.
+static int reg_size(char *reg)
+{
+    int len = strlen(reg);
+    char last = reg[len - 1];
+
+    if (reg[1] == 'r')
+    {
+        switch (last)
+        {
+        case 'd':
+            return 4;
+        case 'w':
+            return 2;
+        case 'b':
+            return 1;
+        }
+        return 8;
+    }
+    if (reg[1] == 'e')
+    {
+        return 4;
+    }
+    if (reg[1] == 'x')
+    {
+        return 16;
+    }
+    return (last == 'l') ? 1 : 2;
+}
+
+static bool is_reg64(char *arg)
+{
+    return is_reg(arg) && reg_size(arg) == 8;
+}
+
+static bool equal_args(Insn *a, int i, Insn *b, int j)
+{
+    return a->nargs > i && b->nargs > j && !strcmp(a->args[i], b->args[j]);
+}
+
+static char *cc_table[][2] = {
+    {"e", "ne"},
+    {"z", "nz"},
+    {"l", "ge"},
+    {"le", "g"},
+    {"b", "ae"},
+    {"be", "a"},
+    {"p", "np"},
+    {"s", "ns"},
+};
+
+static char *invert_cc(char *cc)
+{
+    for (int i = 0; i < sizeof(cc_table) / sizeof(*cc_table); i++)
+    {
+        if (!strcmp(cc_table[i][0], cc))
+        {
+            return cc_table[i][1];
+        }
+        if (!strcmp(cc_table[i][1], cc))
+        {
+            return cc_table[i][0];
+        }
+    }
+    return NULL;
+}
+
+static bool reads_flags(Insn *insn)
+{
+    char *op = insn->op;
+    return is_cond_jump(insn) || !strncmp(op, "set", 3) || !strncmp(op, "cmov", 4) ||
+           !strcmp(op, "adc") || !strcmp(op, "sbb");
+}
+
+// Returns true if the flags may be read before they are overwritten.
+// Flags are never live across a label or a jump in generated code.
+static bool flags_live_after(Insn *insn)
+{
+    static char *writers[] = {
+        "add", "sub", "cmp", "test", "and", "or", "xor", "neg", "imul",
+        "shl", "shr", "sar", "cmpl", "cmpq", "ucomiss", "ucomisd",
+    };
+
+    for (insn = insn->next; insn != &head; insn = insn->next)
+    {
+        if (insn->label || is_op(insn, "jmp") || is_op(insn, "call") || is_op(insn, "ret"))
+        {
+            return false;
+        }
+        if (is_directive(insn))
+        {
+            continue;
+        }
+        if (reads_flags(insn))
+        {
+            return true;
+        }
+        for (int i = 0; i < sizeof(writers) / sizeof(*writers); i++)
+        {
+            if (!strcmp(insn->op, writers[i]))
+            {
+                return false;
+            }
+        }
+    }
+    return false;
+}
+
+static int nrefs(char *label)
+{
+    return (intptr_t)hashmap_get(&refs, label);
+}
+
+static void add_ref(char *label, int n)
+{
+    hashmap_put(&refs, label, (void *)(intptr_t)(nrefs(label) + n));
+}
+
+static void set_target(Insn *jump, char *label)
+{
+    add_ref(jump->args[0], -1);
+    add_ref(label, 1);
+    jump->args[0] = label;
+}
+
+//
+// Patterns
+//
+
+// mov %rax, %rax
+//
+// A 32-bit self-move such as `mov %eax, %eax` clears the upper half
+// of the register and is not removed.
+static bool self_move(Insn *insn)
+{
+    if (is_op(insn, "mov") && equal_args(insn, 0, insn, 1) && is_reg64(insn->args[0]))
+    {
+        delete(insn);
+        return true;
+    }
+    return false;
+}
+
+// mov A, B; mov B, A  =>  mov A, B
+static bool move_back(Insn *insn)
+{
+    Insn *next = next_insn(insn);
+    if (next == &head || !is_op(insn, "mov") || !is_op(next, "mov"))
+    {
+        return false;
+    }
+    if (equal_args(insn, 0, next, 1) && equal_args(insn, 1, next, 0) &&
+        is_reg64(insn->args[0]) && is_reg64(insn->args[1]))
+    {
+        delete(next);
+        return true;
+    }
+    return false;
+}
+
+// mov R1, M; mov M, R2  =>  mov R1, M; mov R1, R2
+static bool store_reload(Insn *insn)
+{
+    Insn *next = next_insn(insn);
+    if (next == &head || !is_op(insn, "mov") || !is_op(next, "mov"))
+    {
+        return false;
+    }
+    if (!is_reg(insn->args[0]) || is_reg(insn->args[1]) || !equal_args(insn, 1, next, 0))
+    {
+        return false;
+    }
+    if (!is_reg(next->args[1]) || reg_size(insn->args[0]) != reg_size(next->args[1]))
+    {
+        return false;
+    }
+    if (equal_args(insn, 0, next, 1))
+    {
+        delete(next);
+        return true;
+    }
+    next->args[0] = insn->args[0];
+    return true;
+}
+
+// jmp L; L:  =>  L:
+static bool jump_to_next(Insn *insn)
+{
+    if (!is_jump(insn))
+    {
+        return false;
+    }
+    for (Insn *p = insn->next; p != &head && (p->label || is_directive(p)); p = p->next)
+    {
+        if (p->label && !strcmp(p->label, insn->args[0]))
+        {
+            add_ref(insn->args[0], -1);
+            delete(insn);
+            return true;
+        }
+    }
+    return false;
+}
+
+// jCC L1; jmp L2; L1:  =>  jNCC L2; L1:
+static bool branch_over_jump(Insn *insn)
+{
+    if (!is_cond_jump(insn))
+    {
+        return false;
+    }
+    Insn *jmp = next_insn(insn);
+    if (jmp == &head || !is_direct_jmp(jmp))
+    {
+        return false;
+    }
+    Insn *label = jmp->next;
+    if (label == &head || !label->label || strcmp(label->label, insn->args[0]))
+    {
+        return false;
+    }
+    char *cc = invert_cc(insn->op + 1);
+    if (!cc)
+    {
+        return false;
+    }
+    insn->op = format("j%s", cc);
+    set_target(insn, jmp->args[0]);
+    add_ref(jmp->args[0], -1);
+    delete(jmp);
+    return true;
+}
+
+// Returns the unconditional jump a label leads to, if any.
+static Insn *jump_at(char *label)
+{
+    Insn *insn = hashmap_get(&labels, label);
+    if (!insn)
+    {
+        return NULL;
+    }
+    do
+    {
+        insn = next_insn(insn);
+    } while (insn != &head && insn->label);
+
+    return (insn != &head && is_direct_jmp(insn)) ? insn : NULL;
+}
+
+// jmp L1; ... L1: jmp L2  =>  jmp L2; ... L1: jmp L2
+static bool jump_thread(Insn *insn)
+{
+    if (!is_jump(insn) || is_op(insn, "jmp") && !is_direct_jmp(insn))
+    {
+        return false;
+    }
+
+    // Follow a bounded number of jumps so that cycles terminate.
+    char *dest = insn->args[0];
+    for (int i = 0; i < 16; i++)
+    {
+        Insn *jmp = jump_at(dest);
+        if (!jmp || jmp == insn || !strcmp(jmp->args[0], dest))
+        {
+            break;
+        }
+        dest = jmp->args[0];
+    }
+
+    if (!strcmp(dest, insn->args[0]))
+    {
+        return false;
+    }
+    set_target(insn, dest);
+    return true;
+}
+
+// Deletes code after an unconditional jump up to the next label that
+// is still referenced or a directive that switches sections.
+static bool dead_code(Insn *insn)
+{
+    if (!is_op(insn, "jmp") && !is_op(insn, "ret"))
+    {
+        return false;
+    }
+
+    bool changed = false;
+    for (Insn *p = insn->next; p != &head;)
+    {
+        Insn *next = p->next;
+        if (p->label)
+        {
+            if (strncmp(p->label, ".L.bb", 5) || nrefs(p->label) > 0)
+            {
+                break;
+            }
+        }
+        else if (is_directive(p))
+        {
+            if (!is_op(p, ".loc"))
+            {
+                break;
+            }
+        }
+        else if (is_jump(p))
+        {
+            add_ref(p->args[0], -1);
+        }
+        delete(p);
+        changed = true;
+        p = next;
+    }
+    return changed;
+}
+
+// setCC R8; movzbl R8, R32; cmp $0, R32; jne L  =>  setCC R8; movzbl R8, R32; jCC L
+static bool setcc_test(Insn *insn)
+{
+    if (!insn->op || strncmp(insn->op, "set", 3))
+    {
+        return false;
+    }
+    Insn *movz = next_insn(insn);
+    if (movz == &head || !is_op(movz, "movzbl") || !equal_args(insn, 0, movz, 0))
+    {
+        return false;
+    }
+    Insn *cmp = next_insn(movz);
+    if (cmp == &head || (!is_op(cmp, "cmpl") && !is_op(cmp, "cmpq")) ||
+        strcmp(cmp->args[0], "$0") || !equal_args(movz, 1, cmp, 1))
+    {
+        return false;
+    }
+    Insn *jcc = next_insn(cmp);
+    if (jcc == &head || (!is_op(jcc, "jne") && !is_op(jcc, "je")))
+    {
+        return false;
+    }
+    char *cc = insn->op + 3;
+    if (is_op(jcc, "je"))
+    {
+        cc = invert_cc(cc);
+    }
+    if (!cc)
+    {
+        return false;
+    }
+    jcc->op = format("j%s", cc);
+    delete(cmp);
+    return true;
+}
+
+// mov $0, R  =>  xor R32, R32
+static bool zero_idiom(Insn *insn)
+{
+    if (!is_op(insn, "mov") || strcmp(insn->args[0], "$0") || !is_reg(insn->args[1]))
+    {
+        return false;
+    }
+
+    static char *regs[][2] = {
+        {"%rax", "%eax"}, {"%rcx", "%ecx"}, {"%rdx", "%edx"}, {"%rbx", "%ebx"},
+        {"%rsi", "%esi"}, {"%rdi", "%edi"}, {"%r8", "%r8d"}, {"%r9", "%r9d"},
+        {"%r10", "%r10d"}, {"%r11", "%r11d"}, {"%r12", "%r12d"}, {"%r13", "%r13d"},
+        {"%r14", "%r14d"}, {"%r15", "%r15d"},
+    };
+
+    for (int i = 0; i < sizeof(regs) / sizeof(*regs); i++)
+    {
+        char *r = insn->args[1];
+        if (strcmp(r, regs[i][0]) && strcmp(r, regs[i][1]))
+        {
+            continue;
+        }
+        if (flags_live_after(insn))
+        {
+            return false;
+        }
+        insn->op = "xor";
+        insn->args[0] = insn->args[1] = regs[i][1];
+        return true;
+    }
+    return false;
+}
+
+static Pattern patterns[] = {
+    {"self-move", self_move},
+    {"move-back", move_back},
+    {"store-reload", store_reload},
+    {"jump-to-next", jump_to_next},
+    {"branch-over-jump", branch_over_jump},
+    {"jump-thread", jump_thread},
+    {"dead-code", dead_code},
+    {"setcc-test", setcc_test},
+    {"zero-idiom", zero_idiom},
+};
+
+static void index_labels(void)
+{
+    hashmap_free(&labels);
+    hashmap_free(&refs);
+
+    for (Insn *insn = head.next; insn != &head; insn = insn->next)
+    {
+        if (insn->label)
+        {
+            hashmap_put(&labels, insn->label, insn);
+            continue;
+        }
+        for (int i = 0; i < insn->nargs; i++)
+        {
+            // A reference may be part of an expression such as
+            // `.L.bb3-.L.jt0` or `.L..1(%rip)`.
+            char *arg = insn->args[i];
+            if (arg[0] == '.')
+            {
+                add_ref(copy(arg, strcspn(arg, "-+(")), 1);
+            }
+        }
+    }
+}
+
+static void optimize(void)
+{
+    index_labels();
+
+    for (bool changed = true; changed;)
+    {
+        changed = false;
+
+        for (int i = 0; i < sizeof(patterns) / sizeof(*patterns); i++)
+        {
+            Pattern *pat = &patterns[i];
+            for (Insn *insn = head.next; insn != &head;)
+            {
+                // Patterns may delete `insn`, whose `prev` stays valid.
+                Insn *prev = insn->prev;
+                int before = ninsns;
+
+                if (!insn->label && pat->fn(insn))
+                {
+                    pat->hits++;
+                    pat->removed += before - ninsns;
+                    changed = true;
+                    insn = prev->next;
+                    continue;
+                }
+                insn = insn->next;
+            }
+        }
+
+        // Labels may have become dead.
+        for (Insn *insn = head.next; insn != &head;)
+        {
+            Insn *next = insn->next;
+            if (insn->label && !strncmp(insn->label, ".L.bb", 5) && nrefs(insn->label) <= 0)
+            {
+                delete(insn);
+                changed = true;
+            }
+            insn = next;
+        }
+    }
+}
+
+// Optimizes and prints the buffered function.
+void peephole_flush(FILE *out)
+{
+    if (opt_O)
+    {
+        optimize();
+    }
+
+    for (Insn *insn = head.next; insn != &head; insn = insn->next)
+    {
+        if (insn->label)
+        {
+            fprintf(out, "%s:\n", insn->label);
+            continue;
+        }
+
+        fprintf(out, "  %s", insn->op);
+        for (int i = 0; i < insn->nargs; i++)
+        {
+            fprintf(out, "%s%s", i ? ", " : " ", insn->args[i]);
+        }
+        if (insn->comment)
+        {
+            fprintf(out, "  # %s", insn->comment);
+        }
+        fprintf(out, "\n");
+    }
+
+    head.next = head.prev = &head;
+    ninsns = 0;
+}
+
+void peephole_report(FILE *out)
+{
+    fprintf(out, "%-18s %8s %8s\n", "pattern", "hits", "removed");
+    for (int i = 0; i < sizeof(patterns) / sizeof(*patterns); i++)
+    {
+        Pattern *pat = &patterns[i];
+        fprintf(out, "%-18s %8d %8d\n", pat->name, pat->hits, pat->removed);
+    }
+}
@@ -0,0 +1,411 @@
+#include "zcc.h"
+
+// Linear-scan register allocator.
+//
+// Each virtual register gets a single live interval covering every
+// instruction at which it may be live. Intervals are visited in order
+// of their start points and assigned a free real register; if none is
+// left, the interval that ends last is spilled to a stack slot.
+//
+// Instruction i reads its operands at position 2*i and writes its
+// result at position 2*i+1, so a result may reuse the register of an
+// operand that dies at the same instruction.
+
+// Registers clobbered by a function call can only hold values that
+// are not live across one.
+static int gp_caller_saved[] = {REG_RDI, REG_RSI, REG_R8, REG_R9};
+static int gp_callee_saved[] = {REG_RBX, REG_R12, REG_R13, REG_R14, REG_R15};
+
+// XMM8-XMM13. There are no callee-saved XMM registers.
+#define FP_FIRST 8
+#define FP_LAST 13
+
+static int nwords;
+
+bool is_callee_saved(int rn)
+{
+    return rn == REG_RBX || (REG_R12 <= rn && rn <= REG_R15);
+}
+
+static uint64_t *new_set(void)
+{
+    return arena_alloc(&ir_arena, nwords * sizeof(uint64_t));
+}
+
+static bool set_has(uint64_t *set, int i)
+{
+    return set[i / 64] & (1ULL << (i % 64));
+}
+
+static void set_add(uint64_t *set, int i)
+{
+    set[i / 64] |= 1ULL << (i % 64);
+}
+
+// Calls `fn` for every register an instruction reads.
+static void each_use(IR *ir, void (*fn)(Reg *r, void *arg), void *arg)
+{
+    if (ir->a)
+    {
+        fn(ir->a, arg);
+    }
+    if (ir->b)
+    {
+        fn(ir->b, arg);
+    }
+    if (ir->index)
+    {
+        fn(ir->index, arg);
+    }
+    for (int i = 0; i < ir->nargs; i++)
+    {
+        fn(ir->args[i], arg);
+    }
+}
+
+// Returns the successors of a block ending with a given instruction.
+// `buf` must have room for two blocks.
+static BB **successors(IR *ir, BB **buf, int *n)
+{
+    switch (ir->op)
+    {
+    case IR_JMP:
+        buf[0] = ir->bb1;
+        *n = 1;
+        return buf;
+    case IR_BR:
+    case IR_CBR:
+        buf[0] = ir->bb1;
+        buf[1] = ir->bb2;
+        *n = 2;
+        return buf;
+    case IR_JTAB:
+        *n = ir->ntargets;
+        return ir->targets;
+    }
+    *n = 0;
+    return buf;
+}
+
+typedef struct
+{
+    uint64_t *use;
+    uint64_t *def;
+} UseDef;
+
+static void add_use(Reg *r, void *arg)
+{
+    UseDef *ud = arg;
+    if (!set_has(ud->def, r->vn))
+    {
+        set_add(ud->use, r->vn);
+    }
+}
+
+// Computes the sets of registers live at the entry and the exit of
+// each basic block.
+static void compute_liveness(Var *fn)
+{
+    int nbbs = 0;
+    for (BB *bb = fn->bbs; bb; bb = bb->next)
+    {
+        nbbs++;
+    }
+
+    BB **bbs = calloc(nbbs, sizeof(BB *));
+    UseDef *ud = calloc(nbbs, sizeof(UseDef));
+    int i = 0;
+
+    for (BB *bb = fn->bbs; bb; bb = bb->next, i++)
+    {
+        bbs[i] = bb;
+        bb->live_in = new_set();
+        bb->live_out = new_set();
+        ud[i].use = new_set();
+        ud[i].def = new_set();
+
+        for (IR *ir = bb->ir; ir; ir = ir->next)
+        {
+            each_use(ir, add_use, &ud[i]);
+            if (ir->d)
+            {
+                set_add(ud[i].def, ir->d->vn);
+            }
+        }
+    }
+
+    // Iterate to a fixed point. Visiting blocks backwards makes
+    // information flow quickly in the common case.
+    for (bool changed = true; changed;)
+    {
+        changed = false;
+
+        for (i = nbbs - 1; i >= 0; i--)
+        {
+            BB *bb = bbs[i];
+            BB *buf[2];
+            int n;
+            BB **succ = successors(bb->last, buf, &n);
+
+            for (int w = 0; w < nwords; w++)
+            {
+                uint64_t out = 0;
+                for (int j = 0; j < n; j++)
+                {
+                    out |= succ[j]->live_in[w];
+                }
+                uint64_t in = ud[i].use[w] | (out & ~ud[i].def[w]);
+
+                if (out != bb->live_out[w] || in != bb->live_in[w])
+                {
+                    bb->live_out[w] = out;
+                    bb->live_in[w] = in;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    free(bbs);
+    free(ud);
+}
+
+static void extend(Reg *r, int pos)
+{
+    if (pos < r->start)
+    {
+        r->start = pos;
+    }
+    if (r->end < pos)
+    {
+        r->end = pos;
+    }
+}
+
+static void extend_use(Reg *r, void *arg)
+{
+    extend(r, *(int *)arg);
+}
+
+static int cmp_start(const void *x, const void *y)
+{
+    Reg *a = *(Reg **)x;
+    Reg *b = *(Reg **)y;
+    return a->start - b->start;
+}
+
+// ncalls[i] is the number of calls among the first i instructions.
+static int *ncalls;
+
+// Returns true if a given interval is live across a function call.
+// An interval starting at an even position is already live when the
+// instruction there executes; one starting at an odd position is
+// defined by it.
+static bool crosses_call(Reg *r)
+{
+    int lo = (r->start + 1) / 2;
+    int hi = r->end / 2 - 1;
+    return lo <= hi && ncalls[hi + 1] - ncalls[lo] > 0;
+}
+
+static void spill(Reg *r)
+{
+    r->rn = -1;
+    r->spill = true;
+}
+
+static void linear_scan(Reg **regs, int n)
+{
+    // Active intervals indexed by real register number
+    Reg *gp_active[16] = {};
+    Reg *fp_active[16] = {};
+
+    for (int i = 0; i < n; i++)
+    {
+        Reg *r = regs[i];
+
+        // Expire intervals that end before this one starts.
+        for (int j = 0; j < 16; j++)
+        {
+            if (gp_active[j] && gp_active[j]->end < r->start)
+            {
+                gp_active[j] = NULL;
+            }
+            if (fp_active[j] && fp_active[j]->end < r->start)
+            {
+                fp_active[j] = NULL;
+            }
+        }
+
+        bool crosses = crosses_call(r);
+        int cand[16];
+        int ncand = 0;
+
+        if (r->is_fp)
+        {
+            if (!crosses)
+            {
+                for (int j = FP_FIRST; j <= FP_LAST; j++)
+                {
+                    cand[ncand++] = j;
+                }
+            }
+        }
+        else
+        {
+            if (!crosses)
+            {
+                for (int j = 0; j < sizeof(gp_caller_saved) / sizeof(int); j++)
+                {
+                    cand[ncand++] = gp_caller_saved[j];
+                }
+            }
+            for (int j = 0; j < sizeof(gp_callee_saved) / sizeof(int); j++)
+            {
+                cand[ncand++] = gp_callee_saved[j];
+            }
+        }
+
+        Reg **active = r->is_fp ? fp_active : gp_active;
+
+        // Take a free register if there is one.
+        int rn = -1;
+        for (int j = 0; j < ncand; j++)
+        {
+            if (!active[cand[j]])
+            {
+                rn = cand[j];
+                break;
+            }
+        }
+
+        if (rn != -1)
+        {
+            r->rn = rn;
+            active[rn] = r;
+            continue;
+        }
+
+        // Otherwise, spill whichever interval ends last.
+        Reg *victim = NULL;
+        for (int j = 0; j < ncand; j++)
+        {
+            Reg *r2 = active[cand[j]];
+            if (!victim || victim->end < r2->end)
+            {
+                victim = r2;
+            }
+        }
+
+        if (victim && r->end < victim->end)
+        {
+            r->rn = victim->rn;
+            active[r->rn] = r;
+            spill(victim);
+        }
+        else
+        {
+            spill(r);
+        }
+    }
+}
+
+// Maps every virtual register of a function to a real register or
+// a stack slot. Stack slots are assigned by the code generator.
+void alloc_regs(Var *fn)
+{
+    nwords = (fn->nregs + 63) / 64;
+    if (nwords == 0)
+    {
+        nwords = 1;
+    }
+
+    compute_liveness(fn);
+
+    // Number instructions.
+    int ninsns = 0;
+    for (BB *bb = fn->bbs; bb; bb = bb->next)
+    {
+        for (IR *ir = bb->ir; ir; ir = ir->next)
+        {
+            ninsns++;
+        }
+    }
+
+    ncalls = calloc(ninsns + 1, sizeof(int));
+    Reg **regs = calloc(fn->nregs, sizeof(Reg *));
+
+    int i = 0;
+    for (BB *bb = fn->bbs; bb; bb = bb->next)
+    {
+        for (IR *ir = bb->ir; ir; ir = ir->next, i++)
+        {
+            ncalls[i + 1] = ncalls[i] + (ir->op == IR_CALL);
+
+            Reg *rs[4] = {ir->d, ir->a, ir->b, ir->index};
+            for (int j = 0; j < 4; j++)
+            {
+                if (rs[j] && !regs[rs[j]->vn])
+                {
+                    regs[rs[j]->vn] = rs[j];
+                    rs[j]->start = INT32_MAX;
+                    rs[j]->end = -1;
+                }
+            }
+            for (int j = 0; j < ir->nargs; j++)
+            {
+                Reg *r = ir->args[j];
+                if (!regs[r->vn])
+                {
+                    regs[r->vn] = r;
+                    r->start = INT32_MAX;
+                    r->end = -1;
+                }
+            }
+        }
+    }
+
+    // Compute live intervals.
+    i = 0;
+    for (BB *bb = fn->bbs; bb; bb = bb->next)
+    {
+        int first = i;
+        for (IR *ir = bb->ir; ir; ir = ir->next, i++)
+        {
+            int pos = 2 * i;
+            each_use(ir, extend_use, &pos);
+            if (ir->d)
+            {
+                extend(ir->d, 2 * i + 1);
+            }
+        }
+        int last = i - 1;
+
+        for (int vn = 0; vn < fn->nregs; vn++)
+        {
+            if (set_has(bb->live_in, vn))
+            {
+                extend(regs[vn], 2 * first);
+            }
+            if (set_has(bb->live_out, vn))
+            {
+                extend(regs[vn], 2 * last + 1);
+            }
+        }
+    }
+
+    // Sort intervals by their start points and allocate.
+    int n = 0;
+    for (int vn = 0; vn < fn->nregs; vn++)
+    {
+        if (regs[vn])
+        {
+            regs[n++] = regs[vn];
+        }
+    }
+    qsort(regs, n, sizeof(Reg *), cmp_start);
+    linear_scan(regs, n);
+
+    free(regs);
+    free(ncalls);
+}
@@ -0,0 +1,318 @@
+#include "zcc.h"
+
+// If-conversion.
+//
+// A branch whose arms do nothing but compute values and assign them,
+// as in `m = a < b ? a : b` or `if (x > max) max = x;`, is replaced by
+// computing both arms and choosing the results with IR_SELECT, which
+// becomes a conditional move. That avoids mispredicted branches on
+// data-dependent conditions. Since both arms now run, they are limited
+// to a few instructions that cannot fault.
+
+#define MAX_ARM_INSNS 4
+#define MAX_SELECTS 2
+
+// A register assigned in one of the arms, and its value at the end of
+// each arm
+typedef struct
+{
+    Reg *reg;
+    Type *ty;
+    Reg *val[2];
+} Assign;
+
+typedef struct
+{
+    Var *fn;
+    int *ndefs;
+    HashMap npreds;
+    Assign assigns[MAX_SELECTS];
+    int nassigns;
+    IR head; // Instructions moved out of the arms
+    IR *cur;
+} IfConv;
+
+static int npreds(IfConv *s, BB *bb)
+{
+    return (intptr_t)hashmap_get_ptr(&s->npreds, bb);
+}
+
+static void add_pred(IfConv *s, BB *bb)
+{
+    hashmap_put_ptr(&s->npreds, bb, (void *)(intptr_t)(npreds(s, bb) + 1));
+}
+
+// Returns true if an instruction may run even if its arm is not taken.
+static bool can_speculate(IR *ir)
+{
+    switch (ir->op)
+    {
+    case IR_IMM:
+    case IR_FIMM:
+    case IR_MOV:
+    case IR_LADDR:
+    case IR_GADDR:
+    case IR_LEA:
+    case IR_ADD:
+    case IR_SUB:
+    case IR_MUL:
+    case IR_BITAND:
+    case IR_BITOR:
+    case IR_BITXOR:
+    case IR_SHL:
+    case IR_SHR:
+    case IR_EQ:
+    case IR_NE:
+    case IR_LT:
+    case IR_LE:
+    case IR_NEG:
+    case IR_BITNOT:
+    case IR_CAST:
+        // The second operand may be in memory.
+        return !ir->var || ir->op == IR_LEA || ir->op == IR_LADDR || ir->op == IR_GADDR;
+    }
+    return false;
+}
+
+static Assign *find_assign(IfConv *s, Reg *r)
+{
+    for (int i = 0; i < s->nassigns; i++)
+    {
+        if (s->assigns[i].reg == r)
+        {
+            return &s->assigns[i];
+        }
+    }
+    return NULL;
+}
+
+// Returns the value of `r` at this point of an arm.
+static Reg *value_in_arm(IfConv *s, Reg *r, int side)
+{
+    Assign *a = r ? find_assign(s, r) : NULL;
+    return (a && a->val[side]) ? a->val[side] : r;
+}
+
+// Moves the computations of an arm out and records its assignments.
+static bool convert_arm(IfConv *s, BB *arm, int side)
+{
+    if (!arm)
+    {
+        return true;
+    }
+
+    int n = 0;
+    for (IR *ir = arm->ir; ir != arm->last; ir = ir->next)
+    {
+        if (!can_speculate(ir) || (ir->op != IR_MOV && ++n > MAX_ARM_INSNS))
+        {
+            return false;
+        }
+
+        IR *copy = alloc_ir(ir->op, ir->ty, ir->tok);
+        *copy = *ir;
+        copy->next = NULL;
+        copy->a = value_in_arm(s, ir->a, side);
+        copy->b = value_in_arm(s, ir->b, side);
+        copy->index = value_in_arm(s, ir->index, side);
+
+        Reg *d = ir->d;
+        if (!d->var && s->ndefs[d->vn] == 1)
+        {
+            s->cur = s->cur->next = copy;
+            continue;
+        }
+
+        // An assignment to a variable, or to a register that the other
+        // arm sets as well, is turned into a select.
+        Reg *val = copy->a;
+        if (ir->op != IR_MOV)
+        {
+            val = copy->d = add_reg(s->fn, d->is_fp);
+            s->cur = s->cur->next = copy;
+        }
+
+        Assign *a = find_assign(s, d);
+        if (!a)
+        {
+            if (s->nassigns == MAX_SELECTS)
+            {
+                return false;
+            }
+            a = &s->assigns[s->nassigns++];
+            *a = (Assign){.reg = d, .ty = ir->ty};
+        }
+        if (is_flonum(a->ty) != is_flonum(ir->ty) || (is_flonum(a->ty) && a->ty->kind != ir->ty->kind))
+        {
+            return false;
+        }
+        a->val[side] = val;
+    }
+    return true;
+}
+
+// Checks that IR_SELECT can choose a value of this kind on a condition.
+static bool can_select(IR *br, Assign *a)
+{
+    bool fp_cond = is_flonum(br->ty);
+    if (a->reg->is_fp)
+    {
+        // Floating-point values are blended with a mask computed by
+        // a comparison of the same type.
+        return fp_cond && br->ty->kind == a->ty->kind;
+    }
+    // A floating-point equality needs the parity flag as well.
+    return !fp_cond || br->cmp == IR_LT || br->cmp == IR_LE;
+}
+
+static void convert(IfConv *s, BB *bb, BB *then, BB *els, BB *join)
+{
+    IR *br = bb->last;
+    if (br->op == IR_BR && is_flonum(br->ty))
+    {
+        return;
+    }
+
+    s->nassigns = 0;
+    s->head.next = NULL;
+    s->cur = &s->head;
+    if (!convert_arm(s, then, 0) || !convert_arm(s, els, 1))
+    {
+        return;
+    }
+    for (int i = 0; i < s->nassigns; i++)
+    {
+        if (!can_select(br, &s->assigns[i]))
+        {
+            return;
+        }
+    }
+
+    // Append the computations of both arms, then the selects. With more
+    // than one, a select may read a register assigned by another, so
+    // they are computed into temporaries first.
+    IR head = {.next = bb->ir};
+    IR *prev = &head;
+    while (prev->next != br)
+    {
+        prev = prev->next;
+    }
+    if (s->head.next)
+    {
+        prev->next = s->head.next;
+        prev = s->cur;
+    }
+
+    IR *movs = NULL;
+    for (int i = s->nassigns - 1; i >= 0; i--)
+    {
+        Assign *a = &s->assigns[i];
+        IR *sel = alloc_ir(IR_SELECT, br->ty, br->tok);
+        if (br->op == IR_BR)
+        {
+            sel->cmp = IR_NE;
+            sel->a = br->a;
+        }
+        else
+        {
+            sel->cmp = br->cmp;
+            sel->a = br->a;
+            sel->b = br->b;
+            sel->imm = br->imm;
+            sel->var = br->var;
+        }
+        sel->args = arena_alloc(&ir_arena, 2 * sizeof(Reg *));
+        sel->args[0] = a->val[0] ? a->val[0] : a->reg;
+        sel->args[1] = a->val[1] ? a->val[1] : a->reg;
+        sel->nargs = 2;
+        sel->d = a->reg;
+
+        if (s->nassigns > 1)
+        {
+            IR *mov = alloc_ir(IR_MOV, a->ty, br->tok);
+            mov->d = a->reg;
+            mov->a = sel->d = add_reg(s->fn, a->reg->is_fp);
+            mov->next = movs;
+            movs = mov;
+        }
+        prev = prev->next = sel;
+    }
+    for (; movs; movs = movs->next)
+    {
+        prev = prev->next = movs;
+    }
+
+    IR *jmp = alloc_ir(IR_JMP, ty_void, br->tok);
+    jmp->bb1 = join;
+    prev->next = jmp;
+    bb->ir = head.next;
+    bb->last = jmp;
+}
+
+void convert_to_selects(Var *fn)
+{
+    IfConv s = {.fn = fn};
+    s.ndefs = calloc(fn->nregs, sizeof(int));
+    for (BB *bb = fn->bbs; bb; bb = bb->next)
+    {
+        for (IR *ir = bb->ir; ir; ir = ir->next)
+        {
+            if (ir->d)
+            {
+                s.ndefs[ir->d->vn]++;
+            }
+        }
+
+        IR *last = bb->last;
+        if (last->op == IR_JMP || last->op == IR_BR || last->op == IR_CBR)
+        {
+            add_pred(&s, last->bb1);
+        }
+        if (last->op == IR_BR || last->op == IR_CBR)
+        {
+            add_pred(&s, last->bb2);
+        }
+        for (int i = 0; i < last->ntargets; i++)
+        {
+            add_pred(&s, last->targets[i]);
+        }
+    }
+
+    for (BB *bb = fn->bbs; bb; bb = bb->next)
+    {
+        IR *br = bb->last;
+        if (br->op != IR_BR && br->op != IR_CBR)
+        {
+            continue;
+        }
+
+        // An arm is a block of its own that goes on to the join point.
+        BB *then = br->bb1;
+        BB *els = br->bb2;
+        bool then_arm = then != bb && npreds(&s, then) == 1 && then->last->op == IR_JMP;
+        bool els_arm = els != bb && npreds(&s, els) == 1 && els->last->op == IR_JMP;
+
+        if (then_arm && els_arm && then != els && then->last->bb1 == els->last->bb1)
+        {
+            // if (c) { ... } else { ... }
+            BB *join = then->last->bb1;
+            if (join != bb && join != then && join != els)
+            {
+                convert(&s, bb, then, els, join);
+            }
+        }
+        else if (then_arm && then->last->bb1 == els && els != bb)
+        {
+            // if (c) { ... }
+            convert(&s, bb, then, NULL, els);
+        }
+        else if (els_arm && els->last->bb1 == then && then != bb)
+        {
+            // if (!c) { ... }
+            convert(&s, bb, NULL, els, then);
+        }
+    }
+
+    free(s.ndefs);
+    hashmap_free(&s.npreds);
+}
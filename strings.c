@@ -12,4 +12,21 @@ char *format(char *fmt, ...)
     va_end(ap);
     fclose(out);
     return buf;
+}
+
+// Returns the unique copy of a given string. Two interned strings
+// are equal if and only if they are the same pointer.
+char *intern(char *s, int len)
+{
+    static HashMap map;
+
+    char *str = hashmap_get2(&map, s, len);
+    if (str)
+    {
+        return str;
+    }
+
+    str = strndup(s, len);
+    hashmap_put2(&map, str, len, str);
+    return str;
 }
\ No newline at end of file
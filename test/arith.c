@@ -346,5 +346,53 @@ int main()
     ASSERT(-15, (char *)0xfffffffffffffff0 - (char *)0xffffffffffffffff);
     ASSERT(1, (void *)0xffffffffffffffff > (void *)0);
 
+    ASSERT(5, ({ unsigned x=5; x & 0xffffffff; }));
+    ASSERT(1, ({ unsigned x=-1; x == 0xffffffff; }));
+    ASSERT(0, ({ long x=-1; x == 0xffffffff; }));
+    ASSERT(1, ({ long x=0x100000000; x > 0xffffffff; }));
+    ASSERT(4, ({ long x=1; x << 40 >> 38; }));
+    ASSERT(-1, ({ int x=-8; x >> 3; }));
+    ASSERT(7, ({ struct { char c; int a; long b; } s={1,3,4}; long t=0; t+s.a+s.b; }));
+    ASSERT(2, ({ struct { int a; unsigned b; } s={7,3}; unsigned t=5; t-s.b; }));
+    ASSERT(1, ({ int x=3; int y=3; x == y; }));
+
+    ASSERT(-3, ({ int x=-7; x / 2; }));
+    ASSERT(-1, ({ int x=-7; x % 2; }));
+    ASSERT(-2, ({ int x=-7; x / 3; }));
+    ASSERT(-1, ({ int x=-7; x % 3; }));
+    ASSERT(2, ({ int x=-7; x / -3; }));
+    ASSERT(-1, ({ int x=-7; x % -3; }));
+    ASSERT(-7, ({ int x=-7; x / 1; }));
+    ASSERT(7, ({ int x=-7; x / -1; }));
+    ASSERT(-11, ({ int x=-1000; x / 100 + x % 7 / 5; }));
+    ASSERT(21, ({ unsigned x=-1; x / 200000000; }));
+    ASSERT(95, ({ unsigned x=-1; x % 100; }));
+    ASSERT(3, ({ unsigned x=-1; x / 0x55555555; }));
+    ASSERT(1, ({ unsigned x=-1; x / 0xfffffffe; }));
+    ASSERT(4, ({ unsigned x=-1; x / 7 % 8; }));
+    ASSERT(63, ({ unsigned x=-1; x % 64; }));
+    ASSERT(1, ({ long x=-1; x / 1000000000000 == 0; }));
+    ASSERT(-9, ({ long x=-9223372036854775807; x / 1000000000000000000; }));
+    ASSERT(9, ({ unsigned long x=-1; x / 2000000000000000000; }));
+    ASSERT(15, ({ unsigned long x=-1; x % 16; }));
+    ASSERT(5, ({ unsigned long x=-1; x % 10; }));
+
+    ASSERT(9, ({ int x=3; (x+1)+2 + x*1 + 0; }));
+    ASSERT(17, ({ int x=3; 2*(x*3)-1; }));
+    ASSERT(0, ({ unsigned x=1; x + 0xffffffff; }));
+    ASSERT(-2147483648, ({ int x=0x7fffffff; (long)(int)(x + 1u); }));
+    ASSERT(5, ({ int x=5; (x&-1) ^ 0 | 0 << 2; }));
+    ASSERT(3, ({ int x=0; x++ * 0 + 3; }));
+    ASSERT(1, ({ int x=0; x++ * 0; x; }));
+    ASSERT(2, ({ int x=0; 1 || x++; 0 && x++; x += 2; x; }));
+    ASSERT(7, ({ (int)7.9; }));
+    ASSERT(1, ({ (_Bool)0.5; }));
+    ASSERT(5, ({ int x=0; goto in; if (0) { in: x=5; } x; }));
+    ASSERT(3, ({ int x=0; for (int i=0; 0; i++) x=1; while (0) x=2; do x+=3; while (0); x; }));
+    ASSERT(-8, ~(unsigned short)7);
+    ASSERT(-1, ~(unsigned char)0);
+    ASSERT(400, (unsigned char)200 << 1);
+    ASSERT(120000, (short)30000 << 2);
+
     return 0;
 }
\ No newline at end of file
@@ -65,5 +65,10 @@ int main()
     ASSERT(3, (float)3L);
     ASSERT(3, (double)3L);
 
+    ASSERT(253, ({ signed char c=-3; unsigned char u=c; u; }));
+    ASSERT(65535, ({ short s=-1; unsigned short u=s; u; }));
+    ASSERT(-56, ({ unsigned char u=200; signed char c=u; c; }));
+    ASSERT(0, ({ unsigned short u=(short)-1; u<1000; }));
+
     return 0;
 }
\ No newline at end of file
@@ -4,6 +4,62 @@
  * This is a block comment.
  */
 
+int dense_switch(int x)
+{
+    switch (x)
+    {
+    case 1:
+        return 10;
+    case 2:
+        return 20;
+    case 3:
+    case 4:
+        return 34;
+    case 6:
+        return 60;
+    default:
+        return -1;
+    }
+}
+
+int sparse_switch(long x)
+{
+    switch (x)
+    {
+    case -1000:
+        return 1;
+    case 5:
+        return 2;
+    case 300:
+        return 3;
+    case 7000:
+        return 4;
+    case 90000:
+        return 5;
+    case 1L << 40:
+        return 6;
+    }
+    return 0;
+}
+
+int unsigned_switch(unsigned x)
+{
+    switch (x)
+    {
+    case 0:
+        return 1;
+    case 1:
+        return 2;
+    case 2:
+        return 3;
+    case 0x80000000:
+        return 4;
+    case 0xffffffff:
+        return 5;
+    }
+    return 0;
+}
+
 int main()
 {
     ASSERT(3, (
@@ -434,6 +490,33 @@ int main()
                       i;
                   }));
 
+    ASSERT(-1, dense_switch(0));
+    ASSERT(10, dense_switch(1));
+    ASSERT(20, dense_switch(2));
+    ASSERT(34, dense_switch(3));
+    ASSERT(34, dense_switch(4));
+    ASSERT(-1, dense_switch(5));
+    ASSERT(60, dense_switch(6));
+    ASSERT(-1, dense_switch(7));
+    ASSERT(-1, dense_switch(-2147483647 - 1));
+
+    ASSERT(1, sparse_switch(-1000));
+    ASSERT(2, sparse_switch(5));
+    ASSERT(3, sparse_switch(300));
+    ASSERT(4, sparse_switch(7000));
+    ASSERT(5, sparse_switch(90000));
+    ASSERT(6, sparse_switch(1L << 40));
+    ASSERT(0, sparse_switch(6));
+    ASSERT(0, sparse_switch(-1));
+    ASSERT(0, sparse_switch(1L << 41));
+
+    ASSERT(1, unsigned_switch(0));
+    ASSERT(3, unsigned_switch(2));
+    ASSERT(0, unsigned_switch(3));
+    ASSERT(4, unsigned_switch(0x80000000));
+    ASSERT(5, unsigned_switch(0xffffffff));
+    ASSERT(0, unsigned_switch(0x7fffffff));
+
     ASSERT(7, (
                   {
                       int i = 0;
@@ -516,5 +599,21 @@ int main()
                        j;
                    }));
 
+    ASSERT(45, ({ int a[10]; for (int i=0; i<10; i++) a[i]=i; int s=0; for (int i=0; i<10; i++) s+=a[i]; s; }));
+    ASSERT(180, ({ struct { int x; long y; } a[5]; for (int i=0; i<5; i++) { a[i].x=i; a[i].y=i*10; } long s=0; int k=4; for (int i=4; i>=0; i--) s+=a[i].x*(k+1)+a[i].y+a[i].x*a[i].y/10; s; }));
+    ASSERT(25, ({ int a[8]={1,2,3,4,5,6,7,8}; int s=0, i=0; while (i<8) { s+=a[i++]; if (i==4) i+=2; } s; }));
+    ASSERT(60, ({ int a[3][4]; for (int i=0; i<3; i++) for (int j=0; j<4; j++) a[i][j]=i*j; int s=0; for (int i=0; i<3; i++) for (int j=0; j<4; j++) s+=a[i][j]*(j+1); s; }));
+    ASSERT(7, ({ int a[9]={0,1,2,3,4,5,6,7,8}; int i=0; for (; a[i]!=7; i+=1); i; }));
+    ASSERT(88, ({ int a[11], b[11]; for (int i=0; i<11; i++) b[i]=i; for (int i=0; i<11; i++) a[i]=b[i]+3; int s=0; for (int i=0; i<11; i++) s+=a[i]; s; }));
+    ASSERT(15, ({ float x[7], y[7]; for (int i=0; i<7; i++) x[i]=i; for (int i=0; i<7; i++) y[i]=x[i]*2.5f; y[6]; }));
+    ASSERT(5, ({ long a[6]={1,2,3,4,5,6}, b[6]; long *restrict p=b; for (int i=0; i<6; i++) p[i]=a[i]-1; b[0]+b[5]; }));
+    ASSERT(5, ({ int a[10]; for (int i=0; i<10; i++) a[i]=i-5; long s=0; for (int i=0; i<10; i++) s-=a[i]; s; }));
+    ASSERT(256, ({ int a[9]={1,1,1,1,1,1,1,1,1}; int *p=a; for (int i=0; i<8; i++) p[i+1]=p[i]+a[i]; a[8]; }));
+    ASSERT(9, ({ int a[7]={1,5,3,9,-2,4,4}; int m=a[0]; for (int i=1; i<7; i++) if (a[i]>m) m=a[i]; m; }));
+    ASSERT(4, ({ int a[7]={1,5,3,9,-2,4,4}; int c=0; for (int i=0; i<7; i++) c += a[i]>3 ? 1 : 0; c; }));
+    ASSERT(21, ({ long a=1, b=2, t; int c=1; if (c>0) { t=a; a=b; b=t; } a*10+b; }));
+    ASSERT(1, ({ unsigned a=1, b=-1; a<b ? a : b; }));
+    ASSERT(0, ({ int *p=0; p ? *p : 0; }));
+
     return 0;
 }
\ No newline at end of file
@@ -22,4 +22,82 @@ check -o
 ./zcc --help 2>&1 | grep -q zcc
 check --help
 
+# -O1
+echo 'int f(int x) { return x + 1; }' > $tmp/reg.c
+./zcc -O1 -o $tmp/out $tmp/reg.c
+! grep -q '(%rbp)' $tmp/out
+check -O1
+
+# -fomit-frame-pointer
+echo 'int f(int x, int y) { int a[4] = {x}; return a[0]; } int g(void) { return f(1, 2); }' > $tmp/leaf.c
+./zcc -fomit-frame-pointer -o $tmp/out $tmp/leaf.c
+sed -n '/^f:/,/ret/p' $tmp/out | grep -q '(%rsp)' &&
+    ! sed -n '/^f:/,/ret/p' $tmp/out | grep -q 'rbp\|%esi' &&
+    sed -n '/^g:/,/ret/p' $tmp/out | grep -q 'push %rbp'
+check -fomit-frame-pointer
+
+# -emit-ir
+./zcc -O1 -emit-ir -o $tmp/out $tmp/reg.c
+grep -q '^f:' $tmp/out && grep -q 'add.i32' $tmp/out && ! grep -q laddr $tmp/out
+check -emit-ir
+
+# -fpeephole-stats
+echo 'int f(int x) { if (x) return 1; return 0; }' > $tmp/peep.c
+./zcc -O1 -fpeephole-stats -o $tmp/out $tmp/peep.c 2>&1 | grep -q '^jump-to-next *[1-9]'
+check -fpeephole-stats
+
+# -fmem-report
+./zcc -fmem-report -o $tmp/out $tmp/empty.c 2>&1 | grep -q '^tokens'
+check -fmem-report
+
+# tail calls
+echo 'int g(int x); int f(int x) { return g(x + 1); }' > $tmp/tail.c
+./zcc -O1 -o $tmp/out $tmp/tail.c
+grep -q 'jmp g$' $tmp/out && ! grep -q 'call' $tmp/out
+check 'tail calls'
+
+# -finline-report
+echo 'static int sq(int x) { return x * x; } int f(int y) { return sq(y) + 1; }' > $tmp/inline.c
+./zcc -O1 -finline-report -o $tmp/out $tmp/inline.c 2>&1 | grep -q '^f  *sq  *1 ' &&
+    ! sed -n '/^f:/,/ret/p' $tmp/out | grep -q call
+check -finline-report
+
+# -fframe-report
+echo 'void g(char *p); void f(void) { { char a[64]; g(a); } { char b[64]; g(b); } }' > $tmp/frame.c
+./zcc -fframe-report -o $tmp/out $tmp/frame.c 2>&1 | grep -q '^f  *128  *64  *64$'
+check -fframe-report
+
+# dead code
+echo 'static int h(int x) { return x; } static int g(int x) { return h(x); } int f(int x) { return x; return g(x); }' > $tmp/dead.c
+./zcc -O1 -o $tmp/out $tmp/dead.c
+grep -q '^f:' $tmp/out && ! grep -q '^g:' $tmp/out && ! grep -q '^h:' $tmp/out && ! grep -q call $tmp/out
+check 'dead code'
+
+# loop optimizations
+echo 'long f(long *a, int n, int k) { long s = 0; for (int i = 0; i < n; i++) s += a[i] * (k * 9); return s; }' > $tmp/loop.c
+./zcc -O1 -emit-ir -o $tmp/out $tmp/loop.c
+sed -n '/cbr/,$p' $tmp/out | grep -q 'add.i64 v[0-9]*, 8$' && ! sed -n '/cbr/,$p' $tmp/out | grep -q 'cast\|, 9$'
+check 'loop optimizations'
+
+# vectorization
+echo 'void f(float *restrict a, float *b, int n) { for (int i = 0; i < n; i++) a[i] += b[i]; }' > $tmp/vec.c
+./zcc -O1 -o $tmp/out $tmp/vec.c
+grep -q addps $tmp/out
+sed -i 's/restrict //' $tmp/vec.c
+./zcc -O1 -o $tmp/out $tmp/vec.c
+! grep -q addps $tmp/out
+check 'vectorization'
+
+# -funroll-loops
+echo 'void f(int *a, int n) { for (int i = 0; i < n; i++) a[i] = i; }' > $tmp/unroll.c
+./zcc -O1 -funroll-loops=3 -emit-ir -o $tmp/out $tmp/unroll.c
+[ `grep -c store $tmp/out` -eq 4 ]
+check -funroll-loops
+
+# if-conversion
+echo 'int f(int a, int b) { return a < b ? a : b; } double g(double a, double b) { return a < b ? a : b; }' > $tmp/select.c
+./zcc -O1 -o $tmp/out $tmp/select.c
+grep -q cmov $tmp/out && grep -q minsd $tmp/out && ! grep -q 'j[lgn]' $tmp/out
+check 'if-conversion'
+
 echo OK
\ No newline at end of file
@@ -81,6 +81,11 @@ int main()
     ASSERT(0, 0.0 / 0.0 > 0);
     ASSERT(0, 0.0 / 0.0 >= 0);
 
+    ASSERT(5, 0.0 / 0.0 == 0.0 / 0.0 ? 3 : 5);
+    ASSERT(3, 0.0 / 0.0 != 0.0 / 0.0 ? 3 : 5);
+    ASSERT(5, 0.0 / 0.0 < 0 || 0.0 / 0.0 >= 0 ? 3 : 5);
+    ASSERT(3, !(0.0 / 0.0 <= 0) && 1.5f == 1.5 ? 3 : 5);
+
     ASSERT(0, !3.);
     ASSERT(1, !0.);
     ASSERT(0, !3.f);
@@ -89,5 +94,12 @@ int main()
     ASSERT(5, 0.0 ? 3 : 5);
     ASSERT(3, 1.2 ? 3 : 5);
 
+    ASSERT(-2, ({ double a=1.5, b=-2; a<b ? a : b; }));
+    ASSERT(4, ({ float a=-3, b=4; a>b ? a : b; }));
+    ASSERT(1, ({ double a=0.0/0.0, b=1; a<b ? a : b; }));
+    ASSERT(6, ({ double a=1, b=1, x=6, y=7; a==b ? x : y; }));
+    ASSERT(7, ({ double a=0.0/0.0, x=6, y=7; a==a ? x : y; }));
+    ASSERT(5, ({ double a=1, b=2; int x=5, y=6; a<b ? x : y; }));
+
     return 0;
 }
\ No newline at end of file
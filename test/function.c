@@ -21,6 +21,22 @@ int add6(int a, int b, int c, int d, int e, int f)
     return a + b + c + d + e + f;
 }
 
+int add10(int a, int b, int c, int d, int e, int f, int g, char h, int i, int j)
+{
+    return a + b + c + d + e + f + g + h + i + j;
+}
+
+double sub_double10(double a, double b, double c, double d, double e, double f, double g, double h, int i, double j)
+{
+    return a - b - c - d - e - f - g - h - i - j;
+}
+
+int addr_of_param(int a, int b, int c, int d, int e, int f, int g)
+{
+    int *p = &g;
+    return *p * 2;
+}
+
 int addx(int *x, int y)
 {
     return *x + y;
@@ -80,6 +96,72 @@ static int static_fn(void)
     return 3;
 }
 
+static int static_abs(int x)
+{
+    if (x < 0)
+        return -x;
+    return x;
+}
+
+static int static_sum(int n)
+{
+    int a[4] = {n, n, n, n};
+    int *p = &n;
+    *p = 0;
+    for (int i = 0; i < 4; i++)
+        n += a[i];
+    return n;
+}
+
+static short static_half(short x, double y)
+{
+    return x / 2 + y;
+}
+
+static int by_address(void)
+{
+    return 7;
+}
+
+void *by_address_ptr = by_address;
+
+int dead_tail(int x)
+{
+    return x + 1;
+    x = by_address();
+    return x;
+}
+
+long tail_sum(long n, long acc)
+{
+    if (n == 0)
+        return acc;
+    return tail_sum(n - 1, acc + n);
+}
+
+int tail_swap(int a, int b, int n)
+{
+    if (n == 0)
+        return a * 10 + b;
+    return tail_swap(b, a, n - 1);
+}
+
+int tail_odd(int n);
+
+int tail_even(int n)
+{
+    if (n == 0)
+        return 1;
+    return tail_odd(n - 1);
+}
+
+int tail_odd(int n)
+{
+    if (n == 0)
+        return 0;
+    return tail_even(n - 1);
+}
+
 int param_decay(int x[])
 {
     return x[0];
@@ -109,6 +191,8 @@ char schar_fn();
 short sshort_fn();
 
 int add_all(int n, ...);
+long sub_long8(long a, long b, long c, long d, long e, long f, long g, long h);
+double sub_double9(double a, double b, double c, double d, double e, double f, double g, double h, double i);
 
 typedef struct
 {
@@ -178,6 +262,17 @@ int main()
     ASSERT(1, bool_fn_sub(0));
 
     ASSERT(3, static_fn());
+    ASSERT(5000050000, tail_sum(100000, 0));
+    ASSERT(21, tail_swap(1, 2, 7));
+    ASSERT(12, tail_swap(1, 2, 8));
+    ASSERT(1, tail_even(10000));
+    ASSERT(0, tail_odd(10000));
+    ASSERT(5, static_abs(-5) + static_abs(0));
+    ASSERT(12, static_sum(3));
+    ASSERT(-3, static_half(-9, 0.5));
+    ASSERT(24, ({ int x = 0; for (int i = -2; i < 3; i++) x += static_abs(i) * static_sum(1); x; }));
+    ASSERT(1, by_address_ptr != 0);
+    ASSERT(4, dead_tail(3));
 
     ASSERT(3, (
                   {
@@ -199,6 +294,14 @@ int main()
 
     ASSERT(6, add_all(3, 1, 2, 3));
     ASSERT(5, add_all(4, 1, 2, 3, -1));
+    ASSERT(45, add_all(9, 1, 2, 3, 4, 5, 6, 7, 8, 9));
+
+    ASSERT(55, add10(1, 2, 3, 4, 5, 6, 7, 8, 9, 10));
+    ASSERT(90, add10(1, 2, 3, 4, 5, 6, 7, 8, add10(1, 2, 3, 4, 5, 6, 7, 8, 9, 10), -1));
+    ASSERT(-53, sub_double10(1, 2, 3, 4, 5, 6, 7, 8, 9, 10));
+    ASSERT(14, addr_of_param(1, 2, 3, 4, 5, 6, 7));
+    ASSERT(-34, sub_long8(1, 2, 3, 4, 5, 6, 7, 8));
+    ASSERT(-43, sub_double9(1, 2, 3, 4, 5, 6, 7, 8, 9));
 
     // {
     //     char buf[100];
@@ -231,5 +231,18 @@ int main()
                       x[1][2];
                   }));
 
+    ASSERT(7, ({ int x[10]; int i=3; x[i+1]=7; x[4]; }));
+    ASSERT(5, ({ int x[10]; int *p=x+5; p[-2]=5; x[3]; }));
+    ASSERT(9, ({ long x[3][4]; int i=2; int j=3; x[i][j]=9; x[2][3]; }));
+    ASSERT(6, ({ short x[8]; long i=6; x[i]=i; *(x+6); }));
+    ASSERT(4, ({ struct { int a; char b[3]; } x[4]; int i=2; x[i].b[1]=4; x[2].b[1]; }));
+    ASSERT(2, ({ int x[10]; int i=7; &x[i] - &x[5]; }));
+    ASSERT(3, ({ char x[10]; char *p=x; int i=4; p+i-1-x; }));
+
+    ASSERT(14, ({ int x=3; int *p=&x; int *q=&x; int a=*p; *q=11; a+*p; }));
+    ASSERT(24, ({ int x[4]={1,2,3,4}; int i=2; x[i]+=3; x[i]*=2; x[i]+x[i]+x[2]-x[i]; }));
+    ASSERT(88, ({ char c; char *p=&c; *p=300; *p+*p; }));
+    ASSERT(19, ({ struct { int a; int b; } s[3]={{1,2},{3,4},{5,6}}; int i=1; int t=s[i].a*s[i].a+s[i].b; s[i].a=2; t+s[i].a+s[i].b; }));
+
     return 0;
 }
\ No newline at end of file
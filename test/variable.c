@@ -285,6 +285,19 @@ int main()
                       y[0][0] = 4;
                       y[0][0];
                   }));
+    ASSERT(6, (
+                  {
+                      int x = 1;
+                      {
+                          int y[4] = {2};
+                          x += y[0];
+                      }
+                      {
+                          int z[4] = {3};
+                          x += z[0] + z[1];
+                      }
+                      x;
+                  }));
 
     {
         void *x;
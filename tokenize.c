@@ -108,7 +108,7 @@ bool consume(Token **rest, Token *tok, char *str)
 // Create a new token.
 static Token *new_token(TokenKind kind, Token *cur, char *str, int len)
 {
-    Token *tok = calloc(1, sizeof(Token));
+    Token *tok = arena_alloc(&token_arena, sizeof(Token));
     tok->kind = kind;
     tok->loc = str;
     tok->len = len;
@@ -188,58 +188,52 @@ static int read_punct(char *p)
     return ispunct(*p) ? 1 : 0;
 }
 
-static bool is_keyword(Token *tok)
+// Returns true if p[0..len) spells a keyword.
+//
+// Keywords are dispatched on their first character, and a candidate
+// of another length is rejected before its spelling is compared.
+static bool is_keyword(char *p, int len)
 {
-    static char *kw[] = {
-        "return",
-        "if",
-        "else",
-        "for",
-        "do",
-        "while",
-        "int",
-        "sizeof",
-        "char",
-        "struct",
-        "union",
-        "short",
-        "long",
-        "void",
-        "typedef",
-        "_Bool",
-        "enum",
-        "static",
-        "goto",
-        "break",
-        "continue",
-        "switch",
-        "case",
-        "default",
-        "extern",
-        "_Alignof",
-        "_Alignas",
-        "signed",
-        "unsigned",
-        "const",
-        "volatile",
-        "auto",
-        "register",
-        "restrict",
-        "__restrict",
-        "__restrict__",
-        "_Noreturn",
-        "float",
-        "double",
-    };
-
-    for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++)
+#define KW(s) (len == sizeof(s) - 1 && !memcmp(p, s, len))
+    switch (*p)
     {
-        if (equal(tok, kw[i]))
-        {
-            return true;
-        }
+    case '_':
+        return KW("_Bool") || KW("_Alignof") || KW("_Alignas") ||
+               KW("_Noreturn") || KW("__restrict") || KW("__restrict__");
+    case 'a':
+        return KW("auto");
+    case 'b':
+        return KW("break");
+    case 'c':
+        return KW("char") || KW("case") || KW("const") || KW("continue");
+    case 'd':
+        return KW("do") || KW("double") || KW("default");
+    case 'e':
+        return KW("else") || KW("enum") || KW("extern");
+    case 'f':
+        return KW("for") || KW("float");
+    case 'g':
+        return KW("goto");
+    case 'i':
+        return KW("if") || KW("int");
+    case 'l':
+        return KW("long");
+    case 'r':
+        return KW("return") || KW("register") || KW("restrict");
+    case 's':
+        return KW("sizeof") || KW("struct") || KW("short") ||
+               KW("static") || KW("switch") || KW("signed");
+    case 't':
+        return KW("typedef");
+    case 'u':
+        return KW("union") || KW("unsigned");
+    case 'v':
+        return KW("void") || KW("volatile");
+    case 'w':
+        return KW("while");
     }
     return false;
+#undef KW
 }
 
 static int read_escaped_char(char **new_pos, char *p)
@@ -320,7 +314,7 @@ static char *string_literal_end(char *p)
 static Token *read_string_literal(Token *cur, char *start)
 {
     char *end = string_literal_end(start + 1);
-    char *buf = calloc(1, end - start);
+    char *buf = arena_alloc(&token_arena, end - start);
     int len = 0;
 
     for (char *p = start + 1; p < end;)
@@ -518,17 +512,6 @@ static Token *read_number(Token *cur, char *start)
     return tok;
 }
 
-static void convert_keywords(Token *tok)
-{
-    for (Token *t = tok; t->kind != TK_EOF; t = t->next)
-    {
-        if (is_keyword(t))
-        {
-            t->kind = TK_KEYWORD;
-        }
-    }
-}
-
 // Initialize line info for all tokens.
 static void add_line_numbers(Token *tok)
 {
@@ -621,7 +604,15 @@ static Token *tokenize(char *filename, char *p)
             {
                 p++;
             } while (is_ident2(*p));
-            cur = new_token(TK_IDENT, cur, q, p - q);
+            if (is_keyword(q, p - q))
+            {
+                cur = new_token(TK_KEYWORD, cur, q, p - q);
+            }
+            else
+            {
+                cur = new_token(TK_IDENT, cur, q, p - q);
+                cur->ident = intern(q, p - q);
+            }
             continue;
         }
 
@@ -639,7 +630,6 @@ static Token *tokenize(char *filename, char *p)
 
     cur = cur->next = new_token(TK_EOF, cur, p, 0);
     add_line_numbers(head.next);
-    convert_keywords(head.next);
     return head.next;
 }
 
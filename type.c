@@ -17,7 +17,7 @@ Type *ty_double = &(Type){TY_DOUBLE, 8, 8};
 
 static Type *new_type(TypeKind kind, int size, int align)
 {
-    Type *ty = calloc(1, sizeof(Type));
+    Type *ty = arena_alloc(&type_arena, sizeof(Type));
     ty->kind = kind;
     ty->size = size;
     ty->align = align;
@@ -47,7 +47,7 @@ bool is_numeric(Type *ty)
 
 Type *copy_type(Type *ty)
 {
-    Type *ret = calloc(1, sizeof(Type));
+    Type *ret = arena_alloc(&type_arena, sizeof(Type));
     *ret = *ty;
     return ret;
 }
@@ -62,7 +62,7 @@ Type *pointer_to(Type *base)
 
 Type *func_type(Type *return_ty)
 {
-    Type *ty = calloc(1, sizeof(Type));
+    Type *ty = arena_alloc(&type_arena, sizeof(Type));
     ty->kind = TY_FUNC;
     ty->return_ty = return_ty;
     return ty;
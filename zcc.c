@@ -1,12 +1,17 @@
 #include "zcc.h"
 
 static char *opt_o;
+static bool opt_fmem_report;
+static bool opt_emit_ir;
+static bool opt_peephole_stats;
+static bool opt_fframe_report;
+static bool opt_finline_report;
 
 static char *input_path;
 
 static void usage(int status)
 {
-    fprintf(stderr, "zcc [ -o <path> ] <file>\n");
+    fprintf(stderr, "zcc [ -o <path> ] [ -O0 | -O1 ] [ -fomit-frame-pointer ] [ -funroll-loops[=<factor>] ] [ -emit-ir ] [ -fmem-report ] [ -fpeephole-stats ] [ -fframe-report ] [ -finline-report ] <file>\n");
     exit(status);
 }
 
@@ -35,6 +40,83 @@ static void parse_args(int argc, char **argv)
             continue;
         }
 
+        if (!strcmp(argv[i], "-O0"))
+        {
+            opt_O = 0;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-O") || !strcmp(argv[i], "-O1"))
+        {
+            opt_O = 1;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-fomit-frame-pointer"))
+        {
+            opt_fomit_frame_pointer = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-fno-omit-frame-pointer"))
+        {
+            opt_fomit_frame_pointer = false;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-funroll-loops"))
+        {
+            opt_funroll_loops = 4;
+            continue;
+        }
+
+        if (!strncmp(argv[i], "-funroll-loops=", 15))
+        {
+            char *end;
+            opt_funroll_loops = strtol(argv[i] + 15, &end, 10);
+            if (end == argv[i] + 15 || *end || opt_funroll_loops < 1)
+            {
+                error("invalid unroll factor: %s", argv[i]);
+            }
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-fno-unroll-loops"))
+        {
+            opt_funroll_loops = 0;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-emit-ir"))
+        {
+            opt_emit_ir = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-fmem-report"))
+        {
+            opt_fmem_report = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-fpeephole-stats"))
+        {
+            opt_peephole_stats = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-finline-report"))
+        {
+            opt_finline_report = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-fframe-report"))
+        {
+            opt_fframe_report = true;
+            continue;
+        }
+
         if (argv[i][0] == '-' && argv[i][1] != '\0')
         {
             error("unknown argument: %s", argv[i]);
@@ -72,9 +154,54 @@ int main(int argc, char **argv)
     Token *tok = tokenize_file(input_path);
     Var *prog = parse(tok);
 
-    // Traverse the AST to emit assembly.
+    if (opt_O)
+    {
+        fold_constants(prog);
+    }
+
+    // Lower the AST to IR.
+    gen_ir(prog);
+    if (opt_O)
+    {
+        prog = optimize_ir(prog);
+    }
+
     FILE *out = open_file(opt_o);
-    fprintf(out, ".file 1 \"%s\"\n", input_path);
-    codegen(prog, out);
+    if (opt_emit_ir)
+    {
+        dump_ir(prog, out);
+    }
+    else
+    {
+        // Traverse the IR to emit assembly.
+        fprintf(out, ".file 1 \"%s\"\n", input_path);
+        codegen(prog, out);
+    }
+
+    if (opt_peephole_stats)
+    {
+        peephole_report(stderr);
+    }
+
+    if (opt_finline_report)
+    {
+        inline_report(stderr);
+    }
+
+    if (opt_fframe_report && !opt_emit_ir)
+    {
+        frame_report(prog, stderr);
+    }
+
+    if (opt_fmem_report)
+    {
+        arena_report(stderr);
+    }
+
+    arena_free(&token_arena);
+    arena_free(&ast_arena);
+    arena_free(&type_arena);
+    arena_free(&ir_arena);
+    arena_free(&asm_arena);
     return 0;
 }
\ No newline at end of file
@@ -17,10 +17,63 @@ typedef struct Type Type;
 typedef struct Node Node;
 typedef struct Member Member;
 typedef struct Relocation Relocation;
+typedef struct Reg Reg;
+typedef struct BB BB;
+
+/*** arena.c ***/
+
+typedef struct ArenaBlock ArenaBlock;
+
+// Bump-pointer allocator for objects of one compilation phase
+typedef struct
+{
+    char *name;
+    ArenaBlock *blocks;
+    char *ptr;       // Next free byte in the current block
+    char *end;       // End of the current block
+    size_t used;     // Bytes handed out
+    size_t reserved; // Bytes obtained from malloc
+    size_t nallocs;  // Number of allocations
+} Arena;
+
+extern Arena token_arena;
+extern Arena ast_arena;
+extern Arena type_arena;
+extern Arena ir_arena;
+extern Arena asm_arena;
+
+void *arena_alloc(Arena *arena, size_t size);
+void arena_free(Arena *arena);
+void arena_report(FILE *out);
+
+/*** hashmap.c ***/
+
+typedef struct
+{
+    char *key;
+    int keylen;
+    void *val;
+} HashEntry;
+
+typedef struct
+{
+    HashEntry *buckets;
+    int capacity;
+    int used;
+} HashMap;
+
+void *hashmap_get(HashMap *map, char *key);
+void *hashmap_get2(HashMap *map, char *key, int keylen);
+void hashmap_put(HashMap *map, char *key, void *val);
+void hashmap_put2(HashMap *map, char *key, int keylen, void *val);
+void *hashmap_get_ptr(HashMap *map, void *key);
+void hashmap_put_ptr(HashMap *map, void *key, void *val);
+void hashmap_free(HashMap *map);
 
 /*** strings.c ***/
 
 char *format(char *fmt, ...);
+char *intern(char *s, int len);
 
 /*** tokenize.c ***/
 
@@ -45,6 +98,7 @@ struct Token
     double fval;    // If kind is TK_NUM, its value
     char *loc;      // Token location
     int len;        // Token length
+    char *ident;    // Interned spelling if kind is TK_IDENT
     Type *ty;       // Used if TK_NUM or TK_STR
     char *str;      // String literal contents including '\0'
     int line_no;    // Line number
@@ -77,6 +131,10 @@ struct Var
 
     // Local variable
     int offset;
+    Reg *reg;        // Register holding the variable if it is never addressed
+    int scope_start; // Lifetime in scope_clock ticks. Locals whose
+    int scope_end;   // lifetimes are disjoint may share a stack slot.
+    bool on_stack;   // Parameter passed on the stack by the caller
 
     // Global variable or function
     bool is_function;
@@ -93,6 +151,11 @@ struct Var
     Var *locals;
     Var *va_area;
     int stack_size;
+    int unshared_stack_size; // stack_size if no slots were shared
+
+    // Function lowered to IR
+    BB *bbs;
+    int nregs;
 };
 
 // Global variable can be initialized either by a constant expression
@@ -189,6 +252,10 @@ struct Node
 Node *new_cast(Node *expr, Type *ty);
 Var *parse(Token *tok);
 
+/*** fold.c ***/
+
+void fold_constants(Var *prog);
+
 /*** type.c ***/
 
 typedef enum
@@ -215,6 +282,7 @@ struct Type
     int size;
     int align;
     bool is_unsigned;
+    bool is_restrict; // A restrict-qualified pointer
     Type *base;
     Token *name;
     Token *name_pos;
@@ -263,7 +331,186 @@ Type *enum_type(void);
 Type *struct_type(void);
 void add_type(Node *node);
 
+/*** ir.c ***/
+
+// Virtual register
+struct Reg
+{
+    int vn;     // Virtual register number
+    bool is_fp; // Holds a float or a double
+    Var *var;   // Local variable promoted to this register, if any
+
+    // Assigned by the register allocator
+    int rn;     // Real register number, or -1 if not in a register
+    bool spill; // Lives in a stack slot instead
+    int offset; // Offset of the stack slot
+    int start;  // Live interval
+    int end;
+};
+
+typedef enum
+{
+    IR_IMM,      // d = imm
+    IR_FIMM,     // d = fimm
+    IR_MOV,      // d = a
+    IR_LADDR,    // d = &var (local)
+    IR_GADDR,    // d = &var (global)
+    IR_LEA,      // d = address
+    IR_LOAD,     // d = *address
+    IR_STORE,    // *address = b
+    IR_ADD,      // d = a + b
+    IR_SUB,      // d = a - b
+    IR_MUL,      // d = a * b
+    IR_MULH,     // d = high half of a * b
+    IR_DIV,      // d = a / b
+    IR_MOD,      // d = a % b
+    IR_BITAND,   // d = a & b
+    IR_BITOR,    // d = a | b
+    IR_BITXOR,   // d = a ^ b
+    IR_SHL,      // d = a << b
+    IR_SHR,      // d = a >> b
+    IR_EQ,       // d = a == b
+    IR_NE,       // d = a != b
+    IR_LT,       // d = a < b
+    IR_LE,       // d = a <= b
+    IR_NEG,      // d = -a
+    IR_BITNOT,   // d = ~a
+    IR_CAST,     // d = (ty)a where a is of type `from`
+    IR_MEMZERO,  // memset(a or &var, 0, imm)
+    IR_MEMCPY,   // memcpy(a, b, imm)
+    IR_CALL,     // d = funcname(args...)
+    IR_RET,      // return a
+    IR_JMP,      // goto bb1
+    IR_BR,       // if (a) goto bb1 else goto bb2
+    IR_CBR,      // if (a cmp b) goto bb1 else goto bb2
+    IR_JTAB,     // goto targets[a]
+    IR_TAILCALL, // return funcname(args...)
+    IR_VLOOP,    // d = kernel run on a elements at once, reading args...
+    IR_SELECT,   // d = (a cmp b) ? args[0] : args[1]
+} IROp;
+
+// Three-address instruction. If `b` of a binary operator is NULL, its
+// second operand is `imm`, or the memory at `var` plus `imm` if `var`
+// is set.
+//
+// The address of IR_LEA, IR_LOAD and IR_STORE is `a + index * scale +
+// imm`, where `var` takes the place of `a` if set.
+typedef struct IR IR;
+struct IR
+{
+    IR *next;
+    IROp op;
+    Type *ty;   // Operand type
+    Type *from; // Source type of IR_CAST
+    Token *tok; // Representative token
+    Reg *d;
+    Reg *a;
+    Reg *b;
+    Reg *index;
+    int scale;
+    int64_t imm;
+    double fimm;
+    Var *var;
+    BB *bb1;
+    BB *bb2;
+    IROp cmp; // IR_EQ, IR_NE, IR_LT or IR_LE for IR_CBR and IR_SELECT
+
+    // Jump table
+    BB **targets;
+    int ntargets;
+
+    // Function call
+    char *funcname;
+    Reg **args;
+    int nargs;
+
+    // Loop body of IR_VLOOP, each instruction of which works on a
+    // vector of elements of type `ty`
+    IR *kernel;
+};
+
+// Basic block
+struct BB
+{
+    BB *next;
+    int label;
+    IR *ir;
+    IR *last;
+
+    // Used by the register allocator
+    uint64_t *live_in;
+    uint64_t *live_out;
+};
+
+BB *new_bb(void);
+Reg *add_reg(Var *fn, bool is_fp);
+IR *alloc_ir(IROp op, Type *ty, Token *tok);
+void append_ir(BB *bb, IR *ir);
+void gen_ir(Var *prog);
+void dump_ir(Var *prog, FILE *out);
+
+/*** inline.c ***/
+
+void inline_functions(Var *prog);
+void inline_report(FILE *out);
+
+/*** cse.c ***/
+
+void eliminate_common_subexprs(Var *fn);
+
+/*** loop.c ***/
+
+void optimize_loops(Var *fn);
+
+/*** select.c ***/
+
+void convert_to_selects(Var *fn);
+
+/*** opt.c ***/
+
+void remove_dead_insns(Var *fn);
+Var *optimize_ir(Var *prog);
+
+/*** regalloc.c ***/
+
+// x86-64 general-purpose registers in encoding order
+enum
+{
+    REG_RAX,
+    REG_RCX,
+    REG_RDX,
+    REG_RBX,
+    REG_RSP,
+    REG_RBP,
+    REG_RSI,
+    REG_RDI,
+    REG_R8,
+    REG_R9,
+    REG_R10,
+    REG_R11,
+    REG_R12,
+    REG_R13,
+    REG_R14,
+    REG_R15,
+};
+
+bool is_callee_saved(int rn);
+void alloc_regs(Var *fn);
+
+/*** peephole.c ***/
+
+void peephole_push(char *line);
+void peephole_flush(FILE *out);
+void peephole_report(FILE *out);
+
+/*** options.c ***/
+
+extern int opt_O;
+extern bool opt_fomit_frame_pointer;
+extern int opt_funroll_loops;
+
 /*** codegen.c ***/
 
 void codegen(Var *prog, FILE *out);
+void frame_report(Var *prog, FILE *out);
 int align_to(int n, int align);
\ No newline at end of file